@@ -9,6 +9,9 @@
  * algorithms described in "Go channels on steroids" by Dmitry Vyukov. */
 #ifndef CHANNEL_H
 #define CHANNEL_H
+#include <errno.h>
+#include <fcntl.h>
+#include <stdalign.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -16,11 +19,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #ifdef _POSIX_THREADS
 #include <pthread.h>
 #if _POSIX_SEMAPHORES >= 200112l
-#include <errno.h>
 #include <semaphore.h>
 #include <time.h>
 #elif defined __APPLE__
@@ -45,11 +49,35 @@ typedef union channel channel;
  * }; */
 typedef struct channel_case channel_case;
 
+/* struct channel_sched {
+ *     void *(*self)(void);
+ *     void (*park)(void *task);
+ *     int (*timedpark)(void *task, const struct timespec *abstime);
+ *     void (*unpark)(void *task);
+ * }; */
+typedef struct channel_sched channel_sched;
+
+/* struct channel_alloc {
+ *     void *(*alloc)(size_t size, void *ctx);
+ *     void (*free)(void *p, size_t size, void *ctx);
+ *     void *ctx;
+ * }; */
+typedef struct channel_alloc channel_alloc;
+
+/* struct channel_token {
+ *     ...
+ * }; */
+typedef struct channel_token channel_token;
+
 /* Return codes */
 typedef size_t channel_rc;
 #define CH_OK 0
 #define CH_WBLOCK (SIZE_MAX - 1)
 #define CH_CLOSED SIZE_MAX
+#define CH_CANCELED (SIZE_MAX - 2)
+
+/* Completion callback for asynchronous operations */
+typedef void (*channel_async_fn)(void *ctx, channel_rc rc);
 
 /* Op codes */
 typedef enum channel_op {
@@ -60,11 +88,17 @@ typedef enum channel_op {
 
 /* Exported "functions" */
 #define ch_make(T, cap) channel_make(sizeof(T), cap)
+#define ch_oneshot(T) channel_oneshot(sizeof(T))
+#define ch_shm_make(T, cap, name) channel_shm_make(sizeof(T), cap, name)
+#define ch_shm_open(name) channel_shm_open(name)
 #define ch_dup(c) channel_dup(c)
 #define ch_drop(c) channel_drop(c)
 #define ch_fndrop(c, fn) channel_fndrop(c, fn)
 #define ch_open(c) channel_open(c)
 #define ch_close(c) channel_close(c)
+#define ch_setrate(c, rate, burst) channel_setrate(c, rate, burst)
+#define ch_setfair(c) channel_setfair(c)
+#define ch_maxwait(c) channel_maxwait(c)
 
 #define ch_send(c, msg) channel_send(c, msg, sizeof(*msg))
 #define ch_trysend(c, msg) channel_trysend(c, msg, sizeof(*msg))
@@ -76,17 +110,92 @@ typedef enum channel_op {
 #define ch_timedrecv(c, msg, timeout) \
     channel_timedrecv(c, msg, timeout, sizeof(*msg))
 
+#define ch_send_async(c, msg, fn, ctx) \
+    channel_send_async(c, msg, sizeof(*msg), fn, ctx)
+#define ch_recv_async(c, msg, fn, ctx) \
+    channel_recv_async(c, msg, sizeof(*msg), fn, ctx)
+
+#define ch_setsched(sched) channel_setsched(sched)
+#define ch_setalloc(alloc) channel_setalloc(alloc)
+
+#define ch_after(timeout) channel_after(timeout)
+#define ch_ticker(period) channel_ticker(period)
+
 #define ch_alt(cases, len) channel_alt(cases, len, UINT64_MAX)
 #define ch_tryalt(cases, len) channel_tryalt(cases, len, rand())
 #define ch_timedalt(cases, len, timeout) channel_alt(cases, len, timeout)
 
+#define ch_token_init(t) channel_token_init(t)
+#define ch_token_destroy(t) channel_token_destroy(t)
+#define ch_cancel(t) channel_cancel(t)
+#define ch_canceled(t) channel_canceled(t)
+
+#define ch_csend(c, msg, t) \
+    channel_csend(c, msg, UINT64_MAX, t, sizeof(*msg))
+#define ch_timedcsend(c, msg, timeout, t) \
+    channel_csend(c, msg, timeout, t, sizeof(*msg))
+#define ch_crecv(c, msg, t) \
+    channel_crecv(c, msg, UINT64_MAX, t, sizeof(*msg))
+#define ch_timedcrecv(c, msg, timeout, t) \
+    channel_crecv(c, msg, timeout, t, sizeof(*msg))
+#define ch_calt(cases, len, t) channel_calt(cases, len, UINT64_MAX, t)
+#define ch_timedcalt(cases, len, timeout, t) \
+    channel_calt(cases, len, timeout, t)
+
 /* These declarations must be present in exactly one compilation unit. */
 #define CHANNEL_EXTERN_DECL \
+    const channel_sched *_Atomic channel_sched_; \
+    const channel_alloc *_Atomic channel_alloc_; \
+    _Thread_local channel_async_q_ channel_asyncq_; \
+    _Thread_local channel_freelist_ channel_cache_; \
+    pthread_once_t channel_cache_once_ = PTHREAD_ONCE_INIT; \
+    pthread_key_t channel_cache_key_; \
+    channel_wheel_ channel_timers_ = { \
+        .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER \
+    }; \
+    channel_arena_ channel_nodes_; \
     CHANNEL_SEM_WAIT_DECL_ \
     CHANNEL_SEM_TIMEDWAIT_DECL_ \
     extern inline void channel_assert_( \
         const char *, unsigned, const char *) __attribute__((noreturn)); \
+    extern inline void channel_setsched(const channel_sched *); \
+    extern inline void channel_setalloc(const channel_alloc *); \
+    extern inline void channel_sem_init_(channel_sem_ *); \
+    extern inline void channel_sem_destroy_(channel_sem_ *); \
+    extern inline void channel_sem_post_(channel_sem_ *); \
+    extern inline bool channel_sem_take_(channel_sem_ *); \
+    extern inline void channel_sem_wait_(channel_sem_ *); \
+    extern inline int channel_sem_timedwait_( \
+        channel_sem_ *, const ch_timespec_ *); \
+    extern inline channel_node_ *channel_node_at_(uint32_t); \
+    extern inline bool channel_stack_push_( \
+        _Atomic uint64_t *, uint32_t, uint32_t); \
+    extern inline uint32_t channel_stack_pop_(_Atomic uint64_t *); \
+    extern inline uint32_t channel_arena_grow_(void); \
+    extern inline uint32_t channel_node_alloc_( \
+        channel_unbuf_ *, channel_waiter_unbuf_ *, uint32_t); \
+    extern inline void channel_node_drop_(channel_unbuf_ *, uint32_t); \
+    extern inline channel_waiter_unbuf_ *channel_node_claim_( \
+        channel_unbuf_ *, uint32_t); \
+    extern inline void channel_node_release_(channel_unbuf_ *, uint32_t); \
+    extern inline bool channel_stack_prune_( \
+        channel_unbuf_ *, _Atomic uint64_t *); \
+    extern inline bool channel_node_kill_( \
+        channel_unbuf_ *, uint32_t, _Atomic uint64_t *); \
+    extern inline void channel_unbuf_free_(channel_unbuf_ *); \
+    extern inline void channel_cache_flush_(void *); \
+    extern inline void channel_cache_init_(void); \
+    extern inline size_t channel_cache_class_(size_t); \
+    extern inline void *channel_obj_alloc_(size_t); \
+    extern inline void channel_obj_free_(channel *); \
     extern inline channel *channel_make(size_t, size_t); \
+    extern inline channel *channel_oneshot(size_t); \
+    extern inline channel_shm_region_ *channel_shm_map_( \
+        const char *, int, size_t *); \
+    extern inline channel *channel_shm_handle_( \
+        channel_shm_region_ *, size_t); \
+    extern inline channel *channel_shm_make(size_t, size_t, const char *); \
+    extern inline channel *channel_shm_open(const char *); \
     extern inline channel *channel_dup(channel *); \
     extern inline channel *channel_drop(channel *); \
     extern inline channel *channel_fndrop(channel *, void (*)(void *)); \
@@ -96,13 +205,46 @@ typedef enum channel_op {
         channel_waiter_root_ *); \
     extern inline bool channel_waitq_remove_(channel_waiter_ *); \
     extern inline channel *channel_open(channel *); \
+    extern inline void channel_buf_close_(channel_buf_ *); \
+    extern inline void channel_unbuf_close_(channel_unbuf_ *); \
+    extern inline void channel_shm_close_(channel_shm_ *); \
+    extern inline uintptr_t channel_oneshot_load_(channel_oneshot_ *); \
+    extern inline void channel_oneshot_close_(channel_oneshot_ *); \
+    extern inline void channel_rate_close_(channel *); \
     extern inline channel *channel_close(channel *); \
+    extern inline channel *channel_setrate(channel *, double, uint64_t); \
+    extern inline channel *channel_setfair(channel *); \
+    extern inline uint64_t channel_maxwait(channel *); \
     extern inline void channel_buf_waitq_shift_( \
         channel_waiter_root_ *, ch_mutex_ *); \
+    extern inline channel_rc channel_buf_handoff_(channel_buf_ *, void *); \
+    extern inline channel_rc channel_ring_trysend_( \
+        uint32_t, uint32_t, _Atomic uint32_t *, channel_aun64_ *, char *, \
+        void *); \
+    extern inline channel_rc channel_ring_tryrecv_( \
+        uint32_t, uint32_t, _Atomic uint32_t *, channel_aun64_ *, char *, \
+        void *); \
+    extern inline bool channel_buf_ready_(channel_buf_ *, channel_op); \
+    extern inline channel_rc channel_buf_ring_( \
+        channel_buf_ *, void *, channel_op); \
+    extern inline void channel_buf_serve_(channel_buf_ *); \
     extern inline channel_rc channel_buf_trysend_(channel_buf_ *, void *); \
     extern inline channel_rc channel_buf_tryrecv_(channel_buf_ *, void *); \
+    extern inline bool channel_shm_unwait_(_Atomic uint32_t *); \
+    extern inline channel_rc channel_shm_try_( \
+        channel_shm_ *, void *, channel_op); \
+    extern inline channel_rc channel_shm_wait_( \
+        channel_shm_ *, void *, ch_timespec_ *, channel_op); \
     extern inline channel_rc channel_unbuf_try_( \
-        channel_unbuf_ *, void *, channel_waiter_root_ *); \
+        channel_unbuf_ *, void *, channel_op); \
+    extern inline channel_rc channel_oneshot_send_( \
+        channel_oneshot_ *, void *); \
+    extern inline channel_rc channel_oneshot_tryrecv_( \
+        channel_oneshot_ *, void *); \
+    extern inline channel_rc channel_oneshot_recv_( \
+        channel_oneshot_ *, void *, ch_timespec_ *); \
+    extern inline uint64_t channel_now_(void); \
+    extern inline void channel_waited_(channel *, uint64_t); \
     extern inline channel_rc channel_buf_send_( \
         channel_buf_ *, void *, ch_timespec_ *); \
     extern inline channel_rc channel_buf_recv_( \
@@ -112,6 +254,11 @@ typedef enum channel_op {
     extern inline channel_rc channel_unbuf_rendez_( \
         channel_unbuf_ *, void *, ch_timespec_ *, channel_op); \
     extern inline ch_timespec_ channel_add_timeout_(uint64_t); \
+    extern inline channel_rc channel_rate_park_(channel *, uint64_t); \
+    extern inline channel_rc channel_rate_take_( \
+        channel *, uint64_t, uint64_t *); \
+    extern inline channel_rc channel_rate_send_( \
+        channel *, void *, uint64_t, ch_timespec_ *); \
     extern inline channel_rc channel_send(channel *, void *, size_t); \
     extern inline channel_rc channel_recv(channel *, void *, size_t); \
     extern inline channel_rc channel_trysend(channel *, void *, size_t); \
@@ -126,7 +273,37 @@ typedef enum channel_op {
         channel_case[static 1], size_t, size_t, ch_sem_ *, _Atomic size_t *); \
     extern inline void channel_alt_remove_waiters_( \
         channel_case[static 1], size_t, size_t); \
-    extern inline size_t channel_alt(channel_case[], size_t, uint64_t)
+    extern inline channel_token *channel_token_init(channel_token *); \
+    extern inline void channel_token_destroy(channel_token *); \
+    extern inline void channel_cancel(channel_token *); \
+    extern inline bool channel_canceled(channel_token *); \
+    extern inline bool channel_token_push_( \
+        channel_token *, channel_waiter_ *); \
+    extern inline void channel_token_remove_( \
+        channel_token *, channel_waiter_ *); \
+    extern inline size_t channel_calt( \
+        channel_case[], size_t, uint64_t, channel_token *); \
+    extern inline size_t channel_alt(channel_case[], size_t, uint64_t); \
+    extern inline channel_rc channel_csend( \
+        channel *, void *, uint64_t, channel_token *, size_t); \
+    extern inline channel_rc channel_crecv( \
+        channel *, void *, uint64_t, channel_token *, size_t); \
+    extern inline channel_rc channel_async_buf_(channel_async_ *); \
+    extern inline void channel_async_step_(channel_async_ *); \
+    extern inline void channel_async_wake_(channel_sem_ *); \
+    extern inline channel_rc channel_async_start_( \
+        channel *, void *, size_t, channel_async_fn, void *, channel_op); \
+    extern inline channel_rc channel_send_async( \
+        channel *, void *, size_t, channel_async_fn, void *); \
+    extern inline channel_rc channel_recv_async( \
+        channel *, void *, size_t, channel_async_fn, void *); \
+    extern inline void channel_wheel_insert_(channel_timer_ *); \
+    extern inline channel_timer_ *channel_wheel_advance_(uint64_t); \
+    extern inline uint64_t channel_wheel_next_(void); \
+    extern inline void *channel_wheel_main_(void *); \
+    extern inline channel *channel_timer_start_(uint64_t, uint64_t); \
+    extern inline channel *channel_after(uint64_t); \
+    extern inline channel *channel_ticker(uint64_t)
 
 /* ---------------------------- Implementation ---------------------------- */
 #ifdef _POSIX_THREADS // Linux, OS X, and Cygwin (and BSDs--untested, however)
@@ -136,19 +313,20 @@ typedef enum channel_op {
 #define ch_mutex_lock_(m) pthread_mutex_lock(m)
 #define ch_mutex_unlock_(m) pthread_mutex_unlock(m)
 #if _POSIX_SEMAPHORES >= 200112l // Linux and Cygwin (and BSDs?)
-#define ch_sem_ sem_t
-#define ch_sem_init_(sem, pshared, val) sem_init(sem, pshared, val)
-#define ch_sem_post_(sem) sem_post(sem)
-#define ch_sem_wait_(sem) channel_sem_wait_(sem)
-#define ch_sem_timedwait_(sem, ts) channel_sem_timedwait_(sem, ts)
-#define ch_sem_destroy_(sem) sem_destroy(sem)
+#define ch_ossem_ sem_t
+#define ch_ossem_init_(sem, pshared, val) sem_init(sem, pshared, val)
+#define ch_ossem_post_(sem) sem_post(sem)
+#define ch_ossem_wait_(sem) channel_ossem_wait_(sem)
+#define ch_ossem_timedwait_(sem, ts) channel_ossem_timedwait_(sem, ts)
+#define ch_ossem_destroy_(sem) sem_destroy(sem)
 #define ch_timespec_ struct timespec
-#define CHANNEL_SEM_WAIT_DECL_ extern inline void channel_sem_wait_(sem_t *);
+#define CHANNEL_SEM_WAIT_DECL_ extern inline void channel_ossem_wait_(sem_t *);
 #define CHANNEL_SEM_TIMEDWAIT_DECL_ \
-    extern inline int channel_sem_timedwait_(sem_t *, const struct timespec *);
+    extern inline int channel_ossem_timedwait_( \
+        sem_t *, const struct timespec *);
 
 inline void
-channel_sem_wait_(sem_t *sem) {
+channel_ossem_wait_(sem_t *sem) {
     while (sem_wait(sem) != 0) {
         if (errno != EINTR) {
             abort();
@@ -158,7 +336,7 @@ channel_sem_wait_(sem_t *sem) {
 }
 
 inline int
-channel_sem_timedwait_(sem_t *sem, const struct timespec *ts) {
+channel_ossem_timedwait_(sem_t *sem, const struct timespec *ts) {
     int rc;
     while ((rc = sem_timedwait(sem, ts)) != 0) {
         switch (errno) {
@@ -172,19 +350,59 @@ channel_sem_timedwait_(sem_t *sem, const struct timespec *ts) {
     return 0;
 }
 #elif defined __APPLE__ // OS X
-#define ch_sem_ dispatch_semaphore_t
-#define ch_sem_init_(sem, pshared, val) *(sem) = dispatch_semaphore_create(val)
-#define ch_sem_post_(sem) dispatch_semaphore_signal(*(sem))
-#define ch_sem_wait_(sem) \
+#define ch_ossem_ dispatch_semaphore_t
+#define ch_ossem_init_(sem, pshared, val) \
+    *(sem) = dispatch_semaphore_create(val)
+#define ch_ossem_post_(sem) dispatch_semaphore_signal(*(sem))
+#define ch_ossem_wait_(sem) \
     dispatch_semaphore_wait(*(sem), DISPATCH_TIME_FOREVER)
-#define ch_sem_timedwait_(sem, ts) dispatch_semaphore_wait(*(sem), *(ts))
-#define ch_sem_destroy_(sem) dispatch_release(*(sem))
+#define ch_ossem_timedwait_(sem, ts) dispatch_semaphore_wait(*(sem), *(ts))
+#define ch_ossem_destroy_(sem) dispatch_release(*(sem))
 #define ch_timespec_ dispatch_time_t
 #define CHANNEL_SEM_WAIT_DECL_
 #define CHANNEL_SEM_TIMEDWAIT_DECL_
 #endif
 #endif
 
+#define ch_sem_ channel_sem_
+#define ch_sem_init_(sem) channel_sem_init_(sem)
+#define ch_sem_post_(sem) channel_sem_post_(sem)
+#define ch_sem_wait_(sem) channel_sem_wait_(sem)
+#define ch_sem_timedwait_(sem, ts) channel_sem_timedwait_(sem, ts)
+#define ch_sem_destroy_(sem) channel_sem_destroy_(sem)
+
+struct channel_sched {
+    void *(*self)(void);
+    void (*park)(void *);
+    int (*timedpark)(void *, const struct timespec *);
+    void (*unpark)(void *);
+};
+
+extern const channel_sched *_Atomic channel_sched_;
+
+struct channel_alloc {
+    void *(*alloc)(size_t, void *);
+    void (*free)(void *, size_t, void *);
+    void *ctx;
+};
+
+extern const channel_alloc *_Atomic channel_alloc_;
+
+/* Every blocking operation parks on one of these. If a scheduler is installed
+ * and the waiting thread of execution is one of its tasks, the task is parked
+ * through the scheduler and the OS semaphore is never touched. `posting` keeps
+ * the semaphore alive until `channel_sem_post_` is done with the task as the
+ * task may otherwise finish and be freed before `unpark` returns.
+ *
+ * Asynchronous operations never wait. Posting runs `fn` instead. */
+typedef struct channel_sem_ {
+    ch_ossem_ os;
+    void (*fn)(struct channel_sem_ *);
+    const channel_sched *sched;
+    void *task;
+    _Atomic uint32_t permits, posting;
+} channel_sem_;
+
 typedef struct channel_waiter_root_ {
     union channel_waiter_ *_Atomic next, *_Atomic prev;
 } channel_waiter_root_;
@@ -197,8 +415,17 @@ typedef struct channel_waiter_hdr_ {
     _Atomic bool ref;
 } channel_waiter_hdr_;
 
-/* Buffered waiters currently only use the fields in the shared header. */
-typedef struct channel_waiter_hdr_ channel_waiter_buf_;
+/* Receivers set `msg` so that a sender finding the ring empty can hand the
+ * message over directly, in which case it also sets `done`. */
+typedef struct channel_waiter_buf_ {
+    struct channel_waiter_buf_ *next, *prev;
+    ch_sem_ *sem;
+    _Atomic size_t *alt_state;
+    size_t alt_id;
+    _Atomic bool ref;
+    bool done;
+    void *msg;
+} channel_waiter_buf_;
 
 typedef struct channel_waiter_unbuf_ {
     struct channel_waiter_unbuf_ *next, *prev;
@@ -207,6 +434,7 @@ typedef struct channel_waiter_unbuf_ {
     size_t alt_id;
     _Atomic bool ref;
     bool closed;
+    uint32_t node;
     void *msg;
 } channel_waiter_unbuf_;
 
@@ -217,9 +445,24 @@ typedef union channel_waiter_ {
     channel_waiter_unbuf_ unbuf;
 } channel_waiter_;
 
+/* Rate limits are enforced with the generic cell rate algorithm, under which
+ * the whole token bucket is `tat`, the theoretical arrival time of the next
+ * send in nanoseconds. A send is allowed once the clock is within `tau` of it
+ * and pushes it back by `interval`. Senders reserve their turn up front, so
+ * each one parks for exactly as long as it has to. They park on `waitq` only
+ * so that closing the channel can wake them early. */
+typedef struct channel_rate_ {
+    _Atomic uint64_t tat;
+    uint64_t interval, tau;
+    channel_waiter_root_ waitq;
+} channel_rate_;
+
 typedef struct channel_hdr_ {
     uint32_t cap, msgsize;
     _Atomic uint32_t openc, refc;
+    uint32_t flags;
+    channel_rate_ *rate;
+    _Atomic uint64_t maxwait; // Nanoseconds
     channel_waiter_root_ sendq, recvq;
     ch_mutex_ lock;
 } channel_hdr_;
@@ -234,6 +477,11 @@ typedef struct channel_hdr_ {
 #define ch_cell_lap_(cell) ((_Atomic uint32_t *)cell)
 #define ch_cell_msg_(cell) (cell + sizeof(uint32_t))
 
+/* Laps wrap around after 2^31 trips around the ring, which a small channel
+ * can make in days, so they are only ever compared by their difference. A
+ * cell is never more than a lap ahead of or behind a position. */
+#define ch_lap_diff_(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)))
+
 typedef union channel_aun64_ {
     _Atomic uint64_t u64;
     struct {
@@ -259,6 +507,9 @@ typedef union channel_un64_ {
 typedef struct channel_buf_ {
     uint32_t cap, msgsize;
     _Atomic uint32_t openc, refc;
+    uint32_t flags;
+    channel_rate_ *rate;
+    _Atomic uint64_t maxwait; // Nanoseconds
     channel_waiter_root_ sendq, recvq;
     ch_mutex_ lock;
     channel_aun64_ write;
@@ -268,13 +519,120 @@ typedef struct channel_buf_ {
     char buf[]; // channel_cell_<T> buf[];
 } channel_buf_;
 
-/* Unbuffered channels currently only use the fields in the shared header. */
-typedef struct channel_hdr_ channel_unbuf_;
+/* Unbuffered waiters are published through lock-free stacks of these nodes
+ * instead of the waiter queues in the header. Nodes live in a global arena
+ * and are never freed so a stale index is always safe to read, and the upper
+ * half of every stack head is a tag that is bumped on each change to prevent
+ * ABA. A node is referenced by its owner and by the stack it was pushed to.
+ * Whoever pops it moves it from `LIVE` to `BUSY` before touching the waiter,
+ * and an owner giving up moves it from `LIVE` to `DEAD` or, failing that,
+ * waits for the counterpart to finish with it. */
+typedef struct channel_node_ {
+    _Atomic uint32_t next, state, refc;
+    channel_waiter_unbuf_ *w;
+} channel_node_;
+
+#define CH_NODE_LIVE_ 0
+#define CH_NODE_BUSY_ 1
+#define CH_NODE_DEAD_ 2
+
+#define CH_NODE_CLOSED_ UINT32_MAX // Stack head after closing
+#define CH_ARENA_CHUNKSIZE_ 1024
+#define CH_ARENA_CHUNKC_ 4096
+
+typedef struct channel_arena_ {
+    channel_node_ *_Atomic chunks[CH_ARENA_CHUNKC_];
+    _Atomic uint32_t chunkc;
+    _Atomic uint64_t free;
+} channel_arena_;
+
+extern channel_arena_ channel_nodes_;
+
+/* The waiter queues and lock in the header are unused. Freed nodes go back to
+ * `pool` rather than the arena to keep unrelated channels from contending. */
+typedef struct channel_unbuf_ {
+    uint32_t cap, msgsize;
+    _Atomic uint32_t openc, refc;
+    uint32_t flags;
+    channel_rate_ *rate;
+    _Atomic uint64_t maxwait; // Nanoseconds
+    channel_waiter_root_ sendq, recvq;
+    ch_mutex_ lock;
+    _Atomic uint64_t sendst, recvst, pool;
+} channel_unbuf_;
+
+#define ch_stack_head_(idx, tag) ((uint64_t)(tag) << 32 | (uint32_t)(idx))
+#define ch_unbuf_waitst_(c, op) ((op) == CH_SEND ? &(c)->sendst : &(c)->recvst)
+#define ch_unbuf_peerst_(c, op) ((op) == CH_SEND ? &(c)->recvst : &(c)->sendst)
+
+#define CH_SHM_ 1u
+
+/* Shared memory channels are buffered channels whose ring lives in a mapped
+ * region along with everything else other processes need to see. Waiters
+ * can't be shared so they are only counted and parked on process-shared
+ * semaphores in the region. The local handle has its own reference count but
+ * `openc` in the region is shared. */
+typedef struct channel_shm_region_ {
+    _Atomic uint32_t magic;
+    uint32_t cap, msgsize;
+    _Atomic uint32_t openc, sendw, recvw;
+    ch_ossem_ sendsem, recvsem;
+    channel_aun64_ write;
+    char pad[64 - sizeof(channel_aun64_)];
+    channel_aun64_ read;
+    char pad1[64 - sizeof(channel_aun64_)];
+    char buf[]; // channel_cell_<T> buf[];
+} channel_shm_region_;
+
+#define CH_SHM_MAGIC_ 0x6368616eu
+
+typedef struct channel_shm_ {
+    uint32_t cap, msgsize;
+    _Atomic uint32_t openc, refc;
+    uint32_t flags;
+    channel_rate_ *rate;
+    _Atomic uint64_t maxwait; // Nanoseconds
+    channel_waiter_root_ sendq, recvq;
+    ch_mutex_ lock;
+    channel_shm_region_ *region;
+    size_t size;
+} channel_shm_;
+
+#define CH_ONESHOT_ 2u
+#define CH_FAIR_ 4u
+
+/* Oneshot channels carry a single message. Everything about them is in
+ * `state`, which is one of the values below or the address of the one
+ * receiver parked on the channel, so the lock and waiter queues in the header
+ * are unused and the lock is never even initialized. The message is only
+ * written while `BUSY` and never changes once the channel is `FULL`. A
+ * sender that finds a receiver parked copies the message straight to it. */
+typedef struct channel_oneshot_ {
+    uint32_t cap, msgsize;
+    _Atomic uint32_t openc, refc;
+    uint32_t flags;
+    channel_rate_ *rate;
+    _Atomic uint64_t maxwait; // Nanoseconds
+    channel_waiter_root_ sendq, recvq;
+    ch_mutex_ lock;
+    _Atomic uintptr_t state;
+    alignas(max_align_t) char msg[];
+} channel_oneshot_;
+
+#define CH_ONESHOT_EMPTY_ 0
+#define CH_ONESHOT_FULL_ 1
+#define CH_ONESHOT_BUSY_ 2
+#define CH_ONESHOT_DONE_ 3 // Received from or closed while empty
+
+#define ch_openc_(c) \
+    ((c)->hdr.flags & CH_SHM_ ? &(c)->shm.region->openc : &(c)->hdr.openc)
 
 union channel {
     channel_hdr_ hdr;
     channel_buf_ buf;
     channel_unbuf_ unbuf;
+    channel_shm_ shm;
+    channel_oneshot_ oneshot;
 };
 
 struct channel_case {
@@ -284,6 +642,83 @@ struct channel_case {
     channel_waiter_ _w;
 };
 
+/* Cancellable operations register a waiter that shares the state of their
+ * alternation, so cancelling is just one more way of claiming it. */
+struct channel_token {
+    _Atomic bool canceled;
+    channel_waiter_root_ waitq;
+    ch_mutex_ lock;
+};
+
+/* `sem` must be the first member. `buf` holds a copy of the message for sends
+ * so the caller's copy doesn't have to outlive the call. */
+typedef struct channel_async_ {
+    channel_sem_ sem;
+    channel_waiter_ w;
+    struct channel_async_ *next;
+    channel *c;
+    channel_op op;
+    void *msg;
+    channel_async_fn fn;
+    void *ctx;
+    alignas(max_align_t) char buf[];
+} channel_async_;
+
+/* Completing an asynchronous operation can wake another one, and so on, so
+ * wakeups are queued per thread instead of recursing. */
+typedef struct channel_async_q_ {
+    channel_async_ *head, *tail;
+    bool busy;
+} channel_async_q_;
+
+extern _Thread_local channel_async_q_ channel_asyncq_;
+
+/* Without an allocator hook, dropped channels of up to
+ * `CH_CACHE_MIN_ << (CH_CACHE_CLASSES_ - 1)` bytes are kept on per-thread
+ * free lists, one per power of two, which are linked through the first word
+ * of each object. Channels end up on the lists of whichever thread drops
+ * them, so the lists of a thread stop growing at `CH_CACHE_BYTES_` in all.
+ * Whatever is left is freed when the thread exits. */
+#define CH_CACHE_MIN_ 128
+#define CH_CACHE_CLASSES_ 5
+#define CH_CACHE_BYTES_ 16384
+
+typedef struct channel_freelist_ {
+    void *heads[CH_CACHE_CLASSES_];
+    size_t bytes;
+    bool keyed;
+} channel_freelist_;
+
+extern _Thread_local channel_freelist_ channel_cache_;
+extern pthread_once_t channel_cache_once_;
+extern pthread_key_t channel_cache_key_;
+
+/* Timers live in a hierarchical wheel of `CH_WHEEL_LEVELS_` levels with 64
+ * slots each, where a slot on level `n` spans 64^n ticks. Timers are filed on
+ * the lowest level that their expiry fits in and are moved down a level each
+ * time the wheel comes around to their slot, so adding and firing are both
+ * O(1). `bits` marks the nonempty slots of each level. */
+typedef struct channel_timer_ {
+    struct channel_timer_ *next;
+    channel *c;
+    uint64_t expiry, period; // In ticks
+} channel_timer_;
+
+#define CH_WHEEL_TICK_ 1000000 // Nanoseconds
+#define CH_WHEEL_LEVELS_ 6
+
+typedef struct channel_wheel_ {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool started;
+    uint64_t base, now, wake; // `now` is the next tick to be processed
+    size_t timerc;
+    uint64_t bits[CH_WHEEL_LEVELS_];
+    channel_timer_ *slots[CH_WHEEL_LEVELS_][64];
+} channel_wheel_;
+
+extern channel_wheel_ channel_timers_;
+
 typedef enum channel_alt_rc_ {
     CH_ALT_READY_,
     CH_ALT_WAIT_,
@@ -304,14 +739,26 @@ typedef enum channel_alt_rc_ {
     atomic_store_explicit(obj, des, memory_order_seq_cst)
 #define ch_faa_rlx_(obj, arg) \
     atomic_fetch_add_explicit(obj, arg, memory_order_relaxed)
+#define ch_faa_rel_(obj, arg) \
+    atomic_fetch_add_explicit(obj, arg, memory_order_release)
+#define ch_fas_rel_(obj, arg) \
+    atomic_fetch_sub_explicit(obj, arg, memory_order_release)
 #define ch_fas_acr_(obj, arg) \
     atomic_fetch_sub_explicit(obj, arg, memory_order_acq_rel)
+#define ch_xchg_acr_(obj, des) \
+    atomic_exchange_explicit(obj, des, memory_order_acq_rel)
 #define ch_cas_w_seq_acq_(obj, exp, des) \
     atomic_compare_exchange_weak_explicit( \
         obj, exp, des, memory_order_seq_cst, memory_order_acquire)
+#define ch_cas_w_acq_rlx_(obj, exp, des) \
+    atomic_compare_exchange_weak_explicit( \
+        obj, exp, des, memory_order_acquire, memory_order_relaxed)
 #define ch_cas_s_acr_rlx_(obj, exp, des) \
     atomic_compare_exchange_strong_explicit( \
         obj, exp, des, memory_order_acq_rel, memory_order_relaxed)
+#define ch_cas_s_seq_acq_(obj, exp, des) \
+    atomic_compare_exchange_strong_explicit( \
+        obj, exp, des, memory_order_seq_cst, memory_order_acquire)
 
 /* `ch_assert_` never becomes a noop, even when `NDEBUG` is set. */
 #define ch_assert_(pred) \
@@ -324,15 +771,375 @@ channel_assert_(const char *file, unsigned line, const char *pred) {
     abort();
 }
 
+/* Installs a user-space scheduler, or removes it if `sched` is `NULL`. Only
+ * operations that start blocking after the call are affected. */
+inline void
+channel_setsched(const channel_sched *sched) {
+#ifdef __APPLE__
+    ch_assert_(!sched); // TODO: Deadlines are `dispatch_time_t`s on OS X
+#endif
+    ch_assert_(!sched ||
+        (sched->self && sched->park && sched->timedpark && sched->unpark));
+    ch_store_rel_(&channel_sched_, sched);
+}
+
+/* Installs an allocator for channels, or goes back to the default one if
+ * `alloc` is `NULL`. Must not be called while any channels exist. */
+inline void
+channel_setalloc(const channel_alloc *alloc) {
+    ch_assert_(!alloc || (alloc->alloc && alloc->free));
+    ch_store_rel_(&channel_alloc_, alloc);
+}
+
+inline void
+channel_sem_init_(channel_sem_ *sem) {
+    sem->fn = NULL;
+    sem->sched = ch_load_acq_(&channel_sched_);
+    sem->task = sem->sched ? sem->sched->self() : NULL;
+    if (sem->task) {
+        ch_store_rlx_(&sem->permits, 0);
+        ch_store_rlx_(&sem->posting, 0);
+    } else {
+        ch_ossem_init_(&sem->os, 0, 0);
+    }
+}
+
+inline void
+channel_sem_destroy_(channel_sem_ *sem) {
+    if (!sem->task) {
+        ch_ossem_destroy_(&sem->os);
+        return;
+    }
+    while (ch_load_acq_(&sem->posting) > 0) {
+        sched_yield();
+    }
+}
+
+inline void
+channel_sem_post_(channel_sem_ *sem) {
+    if (sem->fn) {
+        sem->fn(sem);
+        return;
+    }
+    if (!sem->task) {
+        ch_ossem_post_(&sem->os);
+        return;
+    }
+    ch_faa_rlx_(&sem->posting, 1);
+    ch_faa_rel_(&sem->permits, 1);
+    sem->sched->unpark(sem->task);
+    ch_fas_rel_(&sem->posting, 1);
+}
+
+inline bool
+channel_sem_take_(channel_sem_ *sem) {
+    uint32_t permits = ch_load_rlx_(&sem->permits);
+    while (permits > 0) {
+        if (ch_cas_w_acq_rlx_(&sem->permits, &permits, permits - 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void
+channel_sem_wait_(channel_sem_ *sem) {
+    if (!sem->task) {
+        ch_ossem_wait_(&sem->os);
+        return;
+    }
+    while (!channel_sem_take_(sem)) {
+        sem->sched->park(sem->task);
+    }
+}
+
+/* Returns 0 on success and nonzero on timeout. */
+inline int
+channel_sem_timedwait_(channel_sem_ *sem, const ch_timespec_ *ts) {
+    if (!sem->task) {
+        return ch_ossem_timedwait_(&sem->os, ts);
+    }
+#ifndef __APPLE__
+    while (!channel_sem_take_(sem)) {
+        if (sem->sched->timedpark(sem->task, ts) != 0) {
+            return channel_sem_take_(sem) ? 0 : -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+inline channel_node_ *
+channel_node_at_(uint32_t idx) {
+    return ch_load_acq_(&channel_nodes_.chunks[idx / CH_ARENA_CHUNKSIZE_]) +
+        (idx % CH_ARENA_CHUNKSIZE_);
+}
+
+/* Pushes the chain of nodes from `first` to `last`. Fails if the stack has
+ * been closed. */
+inline bool
+channel_stack_push_(_Atomic uint64_t *stack, uint32_t first, uint32_t last) {
+    uint64_t head = ch_load_rlx_(stack);
+    do {
+        if ((uint32_t)head == CH_NODE_CLOSED_) {
+            return false;
+        }
+        ch_store_rlx_(&channel_node_at_(last)->next, (uint32_t)head);
+    } while (!ch_cas_w_seq_acq_(
+        stack, &head, ch_stack_head_(first, (head >> 32) + 1)));
+    return true;
+}
+
+/* Returns 0 if the stack is empty. */
+inline uint32_t
+channel_stack_pop_(_Atomic uint64_t *stack) {
+    uint64_t head = ch_load_acq_(stack);
+    for ( ; ; ) {
+        uint32_t idx = (uint32_t)head;
+        if (idx == 0 || idx == CH_NODE_CLOSED_) {
+            return idx;
+        }
+        uint32_t next = ch_load_rlx_(&channel_node_at_(idx)->next);
+        if (ch_cas_w_seq_acq_(
+            stack, &head, ch_stack_head_(next, (head >> 32) + 1))) {
+            return idx;
+        }
+    }
+}
+
+/* Keeps the first node of a new chunk and frees the rest. Index 0 doubles as
+ * `NULL` so it is never handed out. */
+inline uint32_t
+channel_arena_grow_(void) {
+    channel_node_ *chunk;
+    ch_assert_((chunk = calloc(CH_ARENA_CHUNKSIZE_, sizeof(*chunk))));
+    uint32_t n;
+    for (bool won = false; !won; ) {
+        n = ch_load_acq_(&channel_nodes_.chunkc);
+        ch_assert_(n < CH_ARENA_CHUNKC_);
+        channel_node_ *empty = NULL;
+        won = ch_cas_s_acr_rlx_(&channel_nodes_.chunks[n], &empty, chunk);
+        uint32_t n1 = n; // Whoever installed the chunk may not have bumped this
+        ch_cas_s_acr_rlx_(&channel_nodes_.chunkc, &n1, n + 1);
+    }
+
+    uint32_t first = n * CH_ARENA_CHUNKSIZE_ + (n == 0);
+    uint32_t last = (n + 1) * CH_ARENA_CHUNKSIZE_ - 1;
+    for (uint32_t i = first + 1; i < last; i++) {
+        ch_store_rlx_(&chunk[i % CH_ARENA_CHUNKSIZE_].next, i + 1);
+    }
+    channel_stack_push_(&channel_nodes_.free, first + 1, last);
+    return first;
+}
+
+inline uint32_t
+channel_node_alloc_(
+    channel_unbuf_ *c, channel_waiter_unbuf_ *w, uint32_t refc
+) {
+    uint32_t idx;
+    if (
+        !(idx = channel_stack_pop_(&c->pool)) &&
+        !(idx = channel_stack_pop_(&channel_nodes_.free))
+    ) {
+        idx = channel_arena_grow_();
+    }
+    channel_node_ *n = channel_node_at_(idx);
+    ch_store_rlx_(&n->state, CH_NODE_LIVE_);
+    ch_store_rlx_(&n->refc, refc);
+    n->w = w;
+    return idx;
+}
+
+inline void
+channel_node_drop_(channel_unbuf_ *c, uint32_t idx) {
+    if (ch_fas_acr_(&channel_node_at_(idx)->refc, 1) == 1) {
+        channel_stack_push_(&c->pool, idx, idx);
+    }
+}
+
+/* Takes a popped node from its owner, or drops it if the owner gave up or
+ * the alternation it belongs to has already been claimed. */
+inline channel_waiter_unbuf_ *
+channel_node_claim_(channel_unbuf_ *c, uint32_t idx) {
+    channel_node_ *n = channel_node_at_(idx);
+    uint32_t live = CH_NODE_LIVE_;
+    if (ch_cas_s_acr_rlx_(&n->state, &live, CH_NODE_BUSY_)) {
+        channel_waiter_unbuf_ *w = n->w;
+        size_t magic = CH_ALT_MAGIC_;
+        if (
+            !w->alt_state ||
+            ch_cas_s_acr_rlx_(w->alt_state, &magic, w->alt_id)
+        ) {
+            return w;
+        }
+        ch_store_rel_(&n->state, CH_NODE_DEAD_);
+    }
+    channel_node_drop_(c, idx);
+    return NULL;
+}
+
+/* Must only be called after the claimed waiter has been posted. */
+inline void
+channel_node_release_(channel_unbuf_ *c, uint32_t idx) {
+    ch_store_rel_(&channel_node_at_(idx)->state, CH_NODE_DEAD_);
+    channel_node_drop_(c, idx);
+}
+
+/* Pops dead nodes off the top of the stack and returns whether a live one is
+ * left there. */
+inline bool
+channel_stack_prune_(channel_unbuf_ *c, _Atomic uint64_t *stack) {
+    uint64_t head = ch_load_seq_(stack);
+    for ( ; ; ) {
+        uint32_t idx = (uint32_t)head;
+        if (idx == 0 || idx == CH_NODE_CLOSED_) {
+            return false;
+        }
+        channel_node_ *n = channel_node_at_(idx);
+        if (ch_load_acq_(&n->state) != CH_NODE_DEAD_) {
+            return true;
+        }
+        uint64_t head1 =
+            ch_stack_head_(ch_load_rlx_(&n->next), (head >> 32) + 1);
+        if (ch_cas_w_seq_acq_(stack, &head, head1)) {
+            channel_node_drop_(c, idx);
+            head = head1;
+        }
+    }
+}
+
+/* Withdraws the owner's node. Returns false if a counterpart got to it
+ * first, in which case the waiter will be posted. */
+inline bool
+channel_node_kill_(channel_unbuf_ *c, uint32_t idx, _Atomic uint64_t *stack) {
+    channel_node_ *n = channel_node_at_(idx);
+    uint32_t live = CH_NODE_LIVE_;
+    if (!ch_cas_s_acr_rlx_(&n->state, &live, CH_NODE_DEAD_)) {
+        return false;
+    }
+    channel_stack_prune_(c, stack);
+    return true;
+}
+
+/* Only dead nodes can be left on the stacks of a channel that is being
+ * freed. The pool goes back to the arena in one push. */
+inline void
+channel_unbuf_free_(channel_unbuf_ *c) {
+    _Atomic uint64_t *stacks[] = {&c->sendst, &c->recvst};
+    for (size_t i = 0; i < 2; i++) {
+        uint32_t idx;
+        while (
+            (idx = channel_stack_pop_(stacks[i])) && idx != CH_NODE_CLOSED_
+        ) {
+            channel_node_drop_(c, idx);
+        }
+    }
+    uint32_t first = (uint32_t)ch_xchg_acr_(&c->pool, 0);
+    if (first != 0) {
+        uint32_t last = first, next;
+        while ((next = ch_load_rlx_(&channel_node_at_(last)->next))) {
+            last = next;
+        }
+        channel_stack_push_(&channel_nodes_.free, first, last);
+    }
+}
+
+inline void
+channel_cache_flush_(void *arg) {
+    channel_freelist_ *f = (channel_freelist_ *)arg;
+    for (size_t i = 0; i < CH_CACHE_CLASSES_; i++) {
+        void *p;
+        while ((p = f->heads[i])) {
+            f->heads[i] = *(void **)p;
+            free(p);
+        }
+    }
+    f->bytes = 0;
+    f->keyed = false;
+}
+
+inline void
+channel_cache_init_(void) {
+    ch_assert_(
+        pthread_key_create(&channel_cache_key_, channel_cache_flush_) == 0);
+}
+
+/* Returns `CH_CACHE_CLASSES_` if objects of `size` aren't cached. */
+inline size_t
+channel_cache_class_(size_t size) {
+    if (size <= CH_CACHE_MIN_) {
+        return 0;
+    }
+    size_t class = 64 - __builtin_clzll(size - 1) - 7;
+    return class < CH_CACHE_CLASSES_ ? class : CH_CACHE_CLASSES_;
+}
+
+/* Objects are zeroed however they are allocated. */
+inline void *
+channel_obj_alloc_(size_t size) {
+    const channel_alloc *a = ch_load_acq_(&channel_alloc_);
+    void *p;
+    if (a) {
+        ch_assert_((p = a->alloc(size, a->ctx)));
+        return memset(p, 0, size);
+    }
+    size_t class = channel_cache_class_(size);
+    if (class == CH_CACHE_CLASSES_) {
+        ch_assert_((p = calloc(1, size)));
+        return p;
+    }
+    channel_freelist_ *f = &channel_cache_;
+    if ((p = f->heads[class])) {
+        f->heads[class] = *(void **)p;
+        f->bytes -= (size_t)CH_CACHE_MIN_ << class;
+        return memset(p, 0, size);
+    }
+    ch_assert_((p = calloc(1, (size_t)CH_CACHE_MIN_ << class)));
+    return p;
+}
+
+inline void
+channel_obj_free_(channel *c) {
+    size_t size = sizeof(*c);
+    if (c->hdr.flags & CH_ONESHOT_) {
+        size = offsetof(channel_oneshot_, msg) + c->hdr.msgsize;
+    } else if (!(c->hdr.flags & CH_SHM_)) {
+        size = c->hdr.cap == 0 ? sizeof(c->unbuf) :
+            offsetof(channel_buf_, buf) +
+                (c->hdr.cap * ch_cellsize_(c->hdr.msgsize));
+    }
+    const channel_alloc *a = ch_load_acq_(&channel_alloc_);
+    if (a) {
+        a->free(c, size, a->ctx);
+        return;
+    }
+    size_t class = channel_cache_class_(size);
+    channel_freelist_ *f = &channel_cache_;
+    if (class == CH_CACHE_CLASSES_ ||
+        f->bytes + ((size_t)CH_CACHE_MIN_ << class) > CH_CACHE_BYTES_) {
+        free(c);
+        return;
+    }
+    if (!f->keyed) { // So that the destructor runs
+        pthread_once(&channel_cache_once_, channel_cache_init_);
+        ch_assert_(pthread_setspecific(channel_cache_key_, f) == 0);
+        f->keyed = true;
+    }
+    *(void **)c = f->heads[class];
+    f->heads[class] = c;
+    f->bytes += (size_t)CH_CACHE_MIN_ << class;
+}
+
 inline channel *
 channel_make(size_t msgsize, size_t cap) {
     channel *c;
     if (cap == 0) {
-        ch_assert_(msgsize <= UINT32_MAX && (c = calloc(1, sizeof(c->unbuf))));
+        ch_assert_(msgsize <= UINT32_MAX);
+        c = channel_obj_alloc_(sizeof(c->unbuf));
     } else {
         ch_assert_(cap <= UINT32_MAX && cap <= SIZE_MAX / msgsize);
-        ch_assert_((c = calloc(
-            1, offsetof(channel_buf_, buf) + (cap * ch_cellsize_(msgsize)))));
+        c = channel_obj_alloc_(
+            offsetof(channel_buf_, buf) + (cap * ch_cellsize_(msgsize)));
         c->hdr.cap = cap;
         ch_store_rlx_(&c->buf.read.lap, 1);
     }
@@ -347,6 +1154,112 @@ channel_make(size_t msgsize, size_t cap) {
     return c;
 }
 
+/* Allocates a oneshot channel, which only has room for its one message. */
+inline channel *
+channel_oneshot(size_t msgsize) {
+    ch_assert_(msgsize <= UINT32_MAX);
+    channel *c = channel_obj_alloc_(offsetof(channel_oneshot_, msg) + msgsize);
+    c->hdr.cap = 1;
+    c->hdr.msgsize = msgsize;
+    c->hdr.flags = CH_ONESHOT_;
+    ch_store_rlx_(&c->hdr.openc, 1);
+    ch_store_rlx_(&c->hdr.refc, 1);
+    return c;
+}
+
+/* Maps `size` bytes of the named region, or of a new anonymous one if `name`
+ * is `NULL`. `size` is an output parameter when opening an existing region. */
+inline channel_shm_region_ *
+channel_shm_map_(const char *name, int oflag, size_t *size) {
+    int fd = -1;
+    if (name) {
+        if ((fd = shm_open(name, O_RDWR | oflag, 0600)) < 0) {
+            return NULL;
+        }
+        struct stat st;
+        bool ok = oflag & O_CREAT ?
+            ftruncate(fd, *size) == 0 : fstat(fd, &st) == 0;
+        if (ok && !(oflag & O_CREAT) && (*size = st.st_size) == 0) {
+            errno = EINVAL; // Not sized by its creator yet
+            ok = false;
+        }
+        if (!ok) {
+            close(fd);
+            if (oflag & O_CREAT) {
+                shm_unlink(name);
+            }
+            return NULL;
+        }
+    }
+    void *r = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | (name ? 0 : MAP_ANONYMOUS), fd, 0);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return r == MAP_FAILED ? NULL : r;
+}
+
+inline channel *
+channel_shm_handle_(channel_shm_region_ *r, size_t size) {
+    channel *c = channel_obj_alloc_(sizeof(*c));
+    c->hdr.cap = r->cap;
+    c->hdr.msgsize = r->msgsize;
+    c->hdr.flags = CH_SHM_;
+    ch_store_rlx_(&c->hdr.refc, 1);
+    ch_mutex_init_(c->hdr.lock);
+    c->shm.region = r;
+    c->shm.size = size;
+    return c;
+}
+
+/* Returns `NULL` with `errno` set if the region can't be created, e.g. if
+ * `name` is already taken. */
+inline channel *
+channel_shm_make(size_t msgsize, size_t cap, const char *name) {
+#ifdef __APPLE__
+    ch_assert_(false); // TODO: OS X lacks process-shared unnamed semaphores
+#endif
+    ch_assert_(msgsize <= UINT32_MAX && 0 < cap && cap <= UINT32_MAX);
+    ch_assert_(cap <= SIZE_MAX / ch_cellsize_(msgsize));
+    size_t size =
+        offsetof(channel_shm_region_, buf) + (cap * ch_cellsize_(msgsize));
+    channel_shm_region_ *r = channel_shm_map_(name, O_CREAT | O_EXCL, &size);
+    if (!r) {
+        return NULL;
+    }
+    r->cap = cap;
+    r->msgsize = msgsize;
+    ch_store_rlx_(&r->openc, 1);
+    ch_store_rlx_(&r->read.lap, 1);
+    ch_assert_(ch_ossem_init_(&r->sendsem, 1, 0) == 0);
+    ch_assert_(ch_ossem_init_(&r->recvsem, 1, 0) == 0);
+    ch_store_rel_(&r->magic, CH_SHM_MAGIC_);
+    return channel_shm_handle_(r, size);
+}
+
+/* Returns `NULL` with `errno` set if there is no such region or if it
+ * doesn't hold a fully initialized channel. */
+inline channel *
+channel_shm_open(const char *name) {
+    ch_assert_(name);
+    size_t size = 0;
+    channel_shm_region_ *r = channel_shm_map_(name, 0, &size);
+    if (!r) {
+        return NULL;
+    }
+    if (
+        size < offsetof(channel_shm_region_, buf) ||
+        ch_load_acq_(&r->magic) != CH_SHM_MAGIC_ ||
+        size != offsetof(channel_shm_region_, buf) +
+            ((size_t)r->cap * ch_cellsize_(r->msgsize))
+    ) {
+        munmap(r, size);
+        errno = EINVAL;
+        return NULL;
+    }
+    return channel_shm_handle_(r, size);
+}
+
 inline channel *
 channel_dup(channel *c) {
     uint32_t prev = ch_faa_rlx_(&c->hdr.refc, 1);
@@ -359,10 +1272,20 @@ channel_drop(channel *c) {
     switch (ch_fas_acr_(&c->hdr.refc, 1)) {
     case 0: ch_assert_(false);
     case 1:
+        if (c->hdr.flags & CH_ONESHOT_) {
+            channel_obj_free_(c);
+            return NULL;
+        }
+        if (c->hdr.flags & CH_SHM_) {
+            munmap(c->shm.region, c->shm.size);
+        } else if (c->hdr.cap == 0) {
+            channel_unbuf_free_(&c->unbuf);
+        }
         ch_mutex_lock_(&c->hdr.lock);
         ch_mutex_unlock_(&c->hdr.lock);
         ch_assert_(ch_mutex_destroy_(&c->hdr.lock) == 0);
-        free(c); // fallthrough
+        free(c->hdr.rate);
+        channel_obj_free_(c); // fallthrough
     default: return NULL;
     }
 }
@@ -372,7 +1295,16 @@ channel_fndrop(channel *c, void (*fn)(void *)) {
     switch (ch_fas_acr_(&c->hdr.refc, 1)) {
     case 0: ch_assert_(false);
     case 1:
-        if (c->hdr.cap > 0) {
+        if (c->hdr.flags & CH_ONESHOT_) {
+            if (ch_load_acq_(&c->oneshot.state) == CH_ONESHOT_FULL_) {
+                fn(c->oneshot.msg);
+            }
+            channel_obj_free_(c);
+            return NULL;
+        }
+        if (c->hdr.flags & CH_SHM_) { // Other processes may still be using it
+            munmap(c->shm.region, c->shm.size);
+        } else if (c->hdr.cap > 0) {
             channel_un64_ read = {ch_load_rlx_(&c->buf.read.u64)};
             for ( ; ; ) {
                 char *cell =
@@ -384,11 +1316,14 @@ channel_fndrop(channel *c, void (*fn)(void *)) {
                 read.u64 = read.idx + 1 < c->buf.cap ?
                     read.u64 + 1 : (uint64_t)(read.lap + 2) << 32;
             }
+        } else {
+            channel_unbuf_free_(&c->unbuf);
         }
         ch_mutex_lock_(&c->hdr.lock);
         ch_mutex_unlock_(&c->hdr.lock);
         ch_assert_(ch_mutex_destroy_(&c->hdr.lock) == 0);
-        free(c); // fallthrough
+        free(c->hdr.rate);
+        channel_obj_free_(c); // fallthrough
     default: return NULL;
     }
 }
@@ -426,44 +1361,178 @@ channel_waitq_remove_(channel_waiter_ *w) {
 
 inline channel *
 channel_open(channel *c) {
-    uint32_t prev = ch_faa_rlx_(&c->hdr.openc, 1);
+    uint32_t prev = ch_faa_rlx_(ch_openc_(c), 1);
     ch_assert_(0 < prev && prev < UINT32_MAX);
     return c;
 }
 
-inline channel *
-channel_close(channel *c) {
-    switch (ch_fas_acr_(&c->hdr.openc, 1)) {
-    case 0: ch_assert_(false);
-    case 1:
-        ch_mutex_lock_(&c->hdr.lock);
-        if (c->hdr.cap > 0) {
-            channel_waiter_buf_ *w;
-            /* UBSan complains about union member accesses when the pointer is
-             * `NULL` but I don't think I care since we aren't actually
-             * dereferencing the pointer. */
-            while ((w = &channel_waitq_shift_(&c->buf.sendq)->buf)) {
-                ch_sem_post_(w->sem);
-            }
-            while ((w = &channel_waitq_shift_(&c->buf.recvq)->buf)) {
-                ch_sem_post_(w->sem);
+/* Waiters are only posted after unlocking as posting may run the callback of
+ * an asynchronous operation. Shifted waiters are chained through `next`,
+ * which must be read before posting. Alternations are claimed like any other
+ * wakeup so that they never see two. */
+inline void
+channel_buf_close_(channel_buf_ *c) {
+    channel_waiter_ *closed = NULL, *w;
+    channel_waiter_root_ *waitqs[] = {&c->sendq, &c->recvq};
+    ch_mutex_lock_(&c->lock);
+    for (size_t i = 0; i < 2; i++) {
+        while ((w = channel_waitq_shift_(waitqs[i]))) {
+            w->hdr.next = closed;
+            closed = w;
+        }
+    }
+    ch_mutex_unlock_(&c->lock);
+    while ((w = closed)) {
+        closed = w->hdr.next;
+        if (w->hdr.alt_state) {
+            size_t magic = CH_ALT_MAGIC_;
+            if (!ch_cas_s_acr_rlx_(w->hdr.alt_state, &magic, w->hdr.alt_id)) {
+                ch_store_rel_(&w->hdr.ref, false);
+                continue;
             }
-        } else {
-            channel_waiter_unbuf_ *w;
-            while ((w = &channel_waitq_shift_(&c->unbuf.sendq)->unbuf)) {
-                w->closed = true;
-                ch_sem_post_(w->sem);
-            }
-            while ((w = &channel_waitq_shift_(&c->unbuf.recvq)->unbuf)) {
+        }
+        ch_sem_post_(w->hdr.sem);
+    }
+}
+
+inline void
+channel_unbuf_close_(channel_unbuf_ *c) {
+    _Atomic uint64_t *stacks[] = {&c->sendst, &c->recvst};
+    for (size_t i = 0; i < 2; i++) {
+        uint32_t idx = (uint32_t)ch_xchg_acr_(stacks[i], CH_NODE_CLOSED_);
+        while (idx != 0) {
+            uint32_t next = ch_load_rlx_(&channel_node_at_(idx)->next);
+            channel_waiter_unbuf_ *w = channel_node_claim_(c, idx);
+            if (w) {
                 w->closed = true;
                 ch_sem_post_(w->sem);
+                channel_node_release_(c, idx);
+            }
+            idx = next;
+        }
+    }
+}
+
+/* Posts every registered waiter. Anyone registering later rechecks the channel
+ * before parking and so sees that it is closed. */
+inline void
+channel_shm_close_(channel_shm_ *c) {
+    channel_shm_region_ *r = c->region;
+    for (uint32_t n = ch_xchg_acr_(&r->sendw, 0); n > 0; n--) {
+        ch_ossem_post_(&r->sendsem);
+    }
+    for (uint32_t n = ch_xchg_acr_(&r->recvw, 0); n > 0; n--) {
+        ch_ossem_post_(&r->recvsem);
+    }
+}
+
+/* Waits out a sender that is in the middle of filling the channel. */
+inline uintptr_t
+channel_oneshot_load_(channel_oneshot_ *c) {
+    uintptr_t s;
+    while ((s = ch_load_acq_(&c->state)) == CH_ONESHOT_BUSY_) {
+        sched_yield();
+    }
+    return s;
+}
+
+/* A parked alternation that has already been claimed by someone else just
+ * gets `ref` cleared, as with the waiter queues. */
+inline void
+channel_oneshot_close_(channel_oneshot_ *c) {
+    uintptr_t s = channel_oneshot_load_(c);
+    while (s != CH_ONESHOT_FULL_ && s != CH_ONESHOT_DONE_) {
+        if (!ch_cas_w_acq_rlx_(&c->state, &s, CH_ONESHOT_DONE_)) {
+            if (s == CH_ONESHOT_BUSY_) {
+                s = channel_oneshot_load_(c);
             }
+            continue;
         }
-        ch_mutex_unlock_(&c->hdr.lock); // fallthrough
+        channel_waiter_buf_ *w = (channel_waiter_buf_ *)s;
+        if (s == CH_ONESHOT_EMPTY_) {
+            return;
+        } else if (w->alt_state) {
+            size_t magic = CH_ALT_MAGIC_;
+            if (!ch_cas_s_acr_rlx_(w->alt_state, &magic, w->alt_id)) {
+                ch_store_rel_(&w->ref, false);
+                return;
+            }
+        }
+        ch_sem_post_(w->sem);
+        return;
+    }
+}
+
+inline void
+channel_rate_close_(channel *c) {
+    channel_waiter_ *closed = NULL, *w;
+    ch_mutex_lock_(&c->hdr.lock);
+    while ((w = channel_waitq_shift_(&c->hdr.rate->waitq))) {
+        w->hdr.next = closed;
+        closed = w;
+    }
+    ch_mutex_unlock_(&c->hdr.lock);
+    while ((w = closed)) {
+        closed = w->hdr.next;
+        ch_sem_post_(w->hdr.sem);
+    }
+}
+
+inline channel *
+channel_close(channel *c) {
+    switch (ch_fas_acr_(ch_openc_(c), 1)) {
+    case 0: ch_assert_(false);
+    case 1:
+        if (c->hdr.flags & CH_SHM_) {
+            channel_shm_close_(&c->shm);
+        } else if (c->hdr.flags & CH_ONESHOT_) {
+            channel_oneshot_close_(&c->oneshot);
+        } else if (c->hdr.cap == 0) {
+            channel_unbuf_close_(&c->unbuf);
+        } else {
+            channel_buf_close_(&c->buf);
+        }
+        if (c->hdr.rate) {
+            channel_rate_close_(c);
+        } // fallthrough
     default: return NULL;
     }
 }
 
+/* Limits sends to `rate` per second on average with bursts of up to `burst`.
+ * Must be called before the channel is shared. */
+inline channel *
+channel_setrate(channel *c, double rate, uint64_t burst) {
+    ch_assert_(!(c->hdr.flags & (CH_SHM_ | CH_ONESHOT_)) && !c->hdr.rate);
+    ch_assert_(rate > 0 && 1e9 / rate >= 1 && 1e9 / rate < 0x1p64);
+    uint64_t interval = (uint64_t)(1e9 / rate);
+    ch_assert_(0 < burst && burst - 1 <= UINT64_MAX / interval);
+    channel_rate_ *r;
+    ch_assert_((r = malloc(sizeof(*r))));
+    ch_store_rlx_(&r->tat, 0);
+    r->interval = interval;
+    r->tau = (burst - 1) * interval;
+    ch_store_rlx_(&r->waitq.next, (channel_waiter_ *)&r->waitq);
+    ch_store_rlx_(&r->waitq.prev, (channel_waiter_ *)&r->waitq);
+    c->hdr.rate = r;
+    return c;
+}
+
+/* Must be called before the channel is shared. */
+inline channel *
+channel_setfair(channel *c) {
+    ch_assert_(c->hdr.cap > 0 && !(c->hdr.flags & (CH_SHM_ | CH_ONESHOT_)));
+    c->hdr.flags |= CH_FAIR_;
+    return c;
+}
+
+/* Returns the longest time in microseconds that a blocking send or receive
+ * has spent waiting since the last call. */
+inline uint64_t
+channel_maxwait(channel *c) {
+    return ch_xchg_acr_(&c->hdr.maxwait, 0) / 1000;
+}
+
 inline void
 channel_buf_waitq_shift_(channel_waiter_root_ *waitq, ch_mutex_ *lock) {
     while (&ch_load_seq_(&waitq->next)->root != waitq) {
@@ -484,61 +1553,103 @@ channel_buf_waitq_shift_(channel_waiter_root_ *waitq, ch_mutex_ *lock) {
     }
 }
 
+/* Copies the message straight into a parked receiver, saving it the round
+ * trip through the ring. Only done while the ring is empty as the message
+ * would otherwise overtake the ones already in it. */
 inline channel_rc
-channel_buf_trysend_(channel_buf_ *c, void *msg) {
-    if (ch_load_acq_(&c->openc) == 0) {
+channel_buf_handoff_(channel_buf_ *c, void *msg) {
+    for ( ; ; ) {
+        ch_mutex_lock_(&c->lock);
+        channel_un64_ read = {ch_load_acq_(&c->read.u64)};
+        char *cell = c->buf + (read.idx * ch_cellsize_(c->msgsize));
+        channel_waiter_buf_ *w = read.lap == ch_load_acq_(ch_cell_lap_(cell)) ?
+            NULL : &channel_waitq_shift_(&c->recvq)->buf;
+        ch_mutex_unlock_(&c->lock);
+        if (!w) {
+            return CH_WBLOCK;
+        }
+        if (w->alt_state) {
+            size_t magic = CH_ALT_MAGIC_;
+            if (!ch_cas_s_acr_rlx_(w->alt_state, &magic, w->alt_id)) {
+                ch_store_rel_(&w->ref, false);
+                continue;
+            }
+        }
+        memcpy(w->msg, msg, c->msgsize);
+        w->done = true;
+        ch_sem_post_(w->sem);
+        return CH_OK;
+    }
+}
+
+/* The lock-free ring of buffered and shared memory channels. */
+inline channel_rc
+channel_ring_trysend_(
+    uint32_t cap,
+    uint32_t msgsize,
+    _Atomic uint32_t *openc,
+    channel_aun64_ *pos,
+    char *buf,
+    void *msg
+) {
+    if (ch_load_acq_(openc) == 0) {
         return CH_CLOSED;
     }
 
-    channel_un64_ write = {ch_load_acq_(&c->write.u64)};
+    channel_un64_ write = {ch_load_acq_(&pos->u64)};
     for (int i = 0; ; ) {
-        char *cell = c->buf + (write.idx * ch_cellsize_(c->msgsize));
+        char *cell = buf + (write.idx * ch_cellsize_(msgsize));
         uint32_t lap = ch_load_acq_(ch_cell_lap_(cell));
         if (write.lap == lap) {
-            uint64_t write1 = write.idx + 1 < c->cap ?
+            uint64_t write1 = write.idx + 1 < cap ?
                 write.u64 + 1 : (uint64_t)(write.lap + 2) << 32;
-            if (!ch_cas_w_seq_acq_(&c->write.u64, &write.u64, write1)) {
+            if (!ch_cas_w_seq_acq_(&pos->u64, &write.u64, write1)) {
                 continue;
             }
-            memcpy(ch_cell_msg_(cell), msg, c->msgsize);
+            memcpy(ch_cell_msg_(cell), msg, msgsize);
             ch_store_rel_(ch_cell_lap_(cell), lap + 1);
-            channel_buf_waitq_shift_(&c->recvq, &c->lock);
             return CH_OK;
         }
 
-        if (write.lap > lap) {
+        if (ch_lap_diff_(write.lap, lap) > 0) {
             if (++i > 4) {
                 return CH_WBLOCK;
             }
             sched_yield();
         }
-        if (ch_load_acq_(&c->openc) == 0) {
+        if (ch_load_acq_(openc) == 0) {
             return CH_CLOSED;
         }
-        write.u64 = ch_load_acq_(&c->write.u64);
+        write.u64 = ch_load_acq_(&pos->u64);
     }
 }
 
 inline channel_rc
-channel_buf_tryrecv_(channel_buf_ *c, void *msg) {
-    channel_un64_ read = {ch_load_acq_(&c->read.u64)};
+channel_ring_tryrecv_(
+    uint32_t cap,
+    uint32_t msgsize,
+    _Atomic uint32_t *openc,
+    channel_aun64_ *pos,
+    char *buf,
+    void *msg
+) {
+    channel_un64_ read = {ch_load_acq_(&pos->u64)};
     for (int i = 0; ; ) {
-        char *cell = c->buf + (read.idx * ch_cellsize_(c->msgsize));
+        char *cell = buf + (read.idx * ch_cellsize_(msgsize));
         uint32_t lap = ch_load_acq_(ch_cell_lap_(cell));
         if (read.lap == lap) {
-            uint64_t read1 = read.idx + 1 < c->cap ?
+            uint64_t read1 = read.idx + 1 < cap ?
                 read.u64 + 1 : (uint64_t)(read.lap + 2) << 32;
-            if (!ch_cas_w_seq_acq_(&c->read.u64, &read.u64, read1)) {
+            if (!ch_cas_w_seq_acq_(&pos->u64, &read.u64, read1)) {
                 continue;
             }
-            memcpy(msg, ch_cell_msg_(cell), c->msgsize);
+            memcpy(msg, ch_cell_msg_(cell), msgsize);
             ch_store_rel_(ch_cell_lap_(cell), lap + 1);
-            channel_buf_waitq_shift_(&c->sendq, &c->lock);
             return CH_OK;
         }
 
-        if (read.lap > lap) {
-            if (ch_load_acq_(&c->openc) == 0) {
+        if (ch_lap_diff_(read.lap, lap) > 0) {
+            if (ch_load_acq_(openc) == 0) {
                 return CH_CLOSED;
             }
             if (++i > 4) {
@@ -546,73 +1657,368 @@ channel_buf_tryrecv_(channel_buf_ *c, void *msg) {
             }
             sched_yield();
         }
-        read.u64 = ch_load_acq_(&c->read.u64);
+        read.u64 = ch_load_acq_(&pos->u64);
     }
 }
 
+/* Whether the next send or receive on the ring would find its cell ready. */
+inline bool
+channel_buf_ready_(channel_buf_ *c, channel_op op) {
+    channel_un64_ u = op == CH_SEND ?
+        (const channel_un64_){ch_load_acq_(&c->write.u64)} :
+        (const channel_un64_){ch_load_acq_(&c->read.u64)};
+    char *cell = c->buf + (u.idx * ch_cellsize_(c->msgsize));
+    return ch_lap_diff_(u.lap, ch_load_acq_(ch_cell_lap_(cell))) <= 0;
+}
+
+/* Every ring operation on a fair channel is done under the lock, so the ring
+ * can't change between checking that it is ready and using it. */
 inline channel_rc
-channel_unbuf_try_(channel_unbuf_ *c, void *msg, channel_waiter_root_ *waitq) {
-    while (ch_load_acq_(&c->openc) > 0) {
-        if (&ch_load_acq_(&waitq->next)->root == waitq) {
-            return CH_WBLOCK;
-        }
+channel_buf_ring_(channel_buf_ *c, void *msg, channel_op op) {
+    if (!channel_buf_ready_(c, op)) {
+        return op == CH_RECV && ch_load_acq_(&c->openc) == 0 ?
+            CH_CLOSED : CH_WBLOCK;
+    }
+    return op == CH_SEND ?
+        channel_ring_trysend_(
+            c->cap, c->msgsize, &c->openc, &c->write, c->buf, msg) :
+        channel_ring_tryrecv_(
+            c->cap, c->msgsize, &c->openc, &c->read, c->buf, msg);
+}
 
+/* Waiters on fair channels are never woken just to race for the ring.
+ * Whoever changes the ring completes the operations at the heads of the
+ * queues instead, for as long as the ring allows. A waiter is only taken off
+ * its queue together with its operation, so nobody can get ahead of it. */
+inline void
+channel_buf_serve_(channel_buf_ *c) {
+    while (
+        &ch_load_seq_(&c->sendq.next)->root != &c->sendq ||
+        &ch_load_seq_(&c->recvq.next)->root != &c->recvq
+    ) {
         ch_mutex_lock_(&c->lock);
-        if (ch_load_acq_(&c->openc) == 0) {
-            ch_mutex_unlock_(&c->lock);
-            return CH_CLOSED;
+        channel_waiter_ *w = NULL;
+        channel_op op = CH_SEND;
+        if (channel_buf_ready_(c, CH_SEND)) {
+            w = channel_waitq_shift_(&c->sendq);
+        }
+        if (!w && channel_buf_ready_(c, CH_RECV)) {
+            w = channel_waitq_shift_(&c->recvq);
+            op = CH_RECV;
+        }
+        bool claimed = false, done = false;
+        if (w) {
+            size_t magic = CH_ALT_MAGIC_;
+            claimed = !w->buf.alt_state || ch_cas_s_acr_rlx_(
+                w->buf.alt_state, &magic, w->buf.alt_id);
+            done = claimed && channel_buf_ring_(c, w->buf.msg, op) == CH_OK;
         }
-        channel_waiter_unbuf_ *w = &channel_waitq_shift_(waitq)->unbuf;
         ch_mutex_unlock_(&c->lock);
         if (!w) {
-            return CH_WBLOCK;
+            return;
         }
-        if (w->alt_state) {
-            size_t magic = CH_ALT_MAGIC_;
-            if (!ch_cas_s_acr_rlx_(w->alt_state, &magic, w->alt_id)) {
-                ch_store_rel_(&w->ref, false);
-                continue;
+        if (!claimed) {
+            ch_store_rel_(&w->buf.ref, false);
+            continue;
+        }
+        w->buf.done = done;
+        ch_sem_post_(w->buf.sem);
+    }
+}
+
+/* Fair channels don't hand messages off, as the parked receivers are served
+ * from the ring in order anyway. */
+inline channel_rc
+channel_buf_trysend_(channel_buf_ *c, void *msg) {
+    if (ch_load_acq_(&c->openc) == 0) {
+        return CH_CLOSED;
+    }
+    channel_rc rc;
+    if (c->flags & CH_FAIR_) {
+        ch_mutex_lock_(&c->lock);
+        rc = &ch_load_rlx_(&c->sendq.next)->root != &c->sendq ?
+            CH_WBLOCK : // Get in line behind the parked senders
+            channel_buf_ring_(c, msg, CH_SEND);
+        ch_mutex_unlock_(&c->lock);
+        if (rc == CH_OK) {
+            channel_buf_serve_(c);
+        }
+        return rc;
+    }
+    if (
+        &ch_load_seq_(&c->recvq.next)->root != &c->recvq &&
+        channel_buf_handoff_(c, msg) == CH_OK
+    ) {
+        return CH_OK;
+    }
+    rc = channel_ring_trysend_(
+        c->cap, c->msgsize, &c->openc, &c->write, c->buf, msg);
+    if (rc == CH_OK) {
+        channel_buf_waitq_shift_(&c->recvq, &c->lock);
+    }
+    return rc;
+}
+
+inline channel_rc
+channel_buf_tryrecv_(channel_buf_ *c, void *msg) {
+    channel_rc rc;
+    if (c->flags & CH_FAIR_) {
+        ch_mutex_lock_(&c->lock);
+        rc = &ch_load_rlx_(&c->recvq.next)->root != &c->recvq &&
+            ch_load_acq_(&c->openc) > 0 ?
+            CH_WBLOCK : channel_buf_ring_(c, msg, CH_RECV);
+        ch_mutex_unlock_(&c->lock);
+        if (rc == CH_OK) {
+            channel_buf_serve_(c);
+        }
+        return rc;
+    }
+    rc = channel_ring_tryrecv_(
+        c->cap, c->msgsize, &c->openc, &c->read, c->buf, msg);
+    if (rc == CH_OK) {
+        channel_buf_waitq_shift_(&c->sendq, &c->lock);
+    }
+    return rc;
+}
+
+/* Takes back one registration, if there are any left. */
+inline bool
+channel_shm_unwait_(_Atomic uint32_t *waitc) {
+    uint32_t n = ch_load_rlx_(waitc);
+    while (n > 0) {
+        if (ch_cas_w_acq_rlx_(waitc, &n, n - 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline channel_rc
+channel_shm_try_(channel_shm_ *c, void *msg, channel_op op) {
+    channel_shm_region_ *r = c->region;
+    channel_rc rc;
+    if (op == CH_SEND) {
+        rc = channel_ring_trysend_(
+            c->cap, c->msgsize, &r->openc, &r->write, r->buf, msg);
+    } else {
+        rc = channel_ring_tryrecv_(
+            c->cap, c->msgsize, &r->openc, &r->read, r->buf, msg);
+    }
+    if (rc == CH_OK) {
+        _Atomic uint32_t *waitc = op == CH_SEND ? &r->recvw : &r->sendw;
+        atomic_thread_fence(memory_order_seq_cst);
+        if (channel_shm_unwait_(waitc)) {
+            ch_ossem_post_(op == CH_SEND ? &r->recvsem : &r->sendsem);
+        }
+    }
+    return rc;
+}
+
+/* Waiters register by bumping a count that is decremented by whoever posts
+ * them, and then try again in case a counterpart just missed the count. A
+ * waiter that can't take its registration back has to absorb the post that
+ * is on its way. */
+inline channel_rc
+channel_shm_wait_(
+    channel_shm_ *c, void *msg, ch_timespec_ *timeout, channel_op op
+) {
+    channel_shm_region_ *r = c->region;
+    _Atomic uint32_t *waitc = op == CH_SEND ? &r->sendw : &r->recvw;
+    ch_ossem_ *sem = op == CH_SEND ? &r->sendsem : &r->recvsem;
+    channel_rc rc;
+    while ((rc = channel_shm_try_(c, msg, op)) == CH_WBLOCK) {
+        ch_faa_rlx_(waitc, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if ((rc = channel_shm_try_(c, msg, op)) != CH_WBLOCK) {
+            if (!channel_shm_unwait_(waitc)) {
+                ch_ossem_wait_(sem);
+            }
+            break;
+        }
+
+        if (timeout == NULL) {
+            ch_ossem_wait_(sem);
+        } else if (ch_ossem_timedwait_(sem, timeout) != 0) {
+            if (!channel_shm_unwait_(waitc)) {
+                ch_ossem_wait_(sem);
+                rc = channel_shm_try_(c, msg, op);
             }
+            break;
+        }
+    }
+    return rc;
+}
+
+inline channel_rc
+channel_unbuf_try_(channel_unbuf_ *c, void *msg, channel_op op) {
+    while (ch_load_acq_(&c->openc) > 0) {
+        uint32_t idx = channel_stack_pop_(ch_unbuf_peerst_(c, op));
+        if (idx == 0) {
+            return CH_WBLOCK;
+        } else if (idx == CH_NODE_CLOSED_) {
+            break;
         }
-        if (waitq == &c->recvq) {
+        channel_waiter_unbuf_ *w = channel_node_claim_(c, idx);
+        if (!w) {
+            continue;
+        }
+        if (op == CH_SEND) {
             memcpy(w->msg, msg, c->msgsize);
         } else {
             memcpy(msg, w->msg, c->msgsize);
         }
         ch_sem_post_(w->sem);
+        channel_node_release_(c, idx);
         return CH_OK;
     }
     return CH_CLOSED;
 }
 
+/* Never blocks. Only the first send on a channel that hasn't been closed
+ * succeeds. If an alternation that is parked on the channel has already been
+ * claimed by someone else, the message is left in the channel instead. */
+inline channel_rc
+channel_oneshot_send_(channel_oneshot_ *c, void *msg) {
+    uintptr_t s = ch_load_acq_(&c->state);
+    do {
+        if (s <= CH_ONESHOT_DONE_ && s != CH_ONESHOT_EMPTY_) {
+            return CH_CLOSED;
+        }
+    } while (!ch_cas_w_acq_rlx_(&c->state, &s, CH_ONESHOT_BUSY_));
+    channel_waiter_buf_ *w = (channel_waiter_buf_ *)s;
+    if (s != CH_ONESHOT_EMPTY_ && w->alt_state) {
+        size_t magic = CH_ALT_MAGIC_;
+        if (!ch_cas_s_acr_rlx_(w->alt_state, &magic, w->alt_id)) {
+            memcpy(c->msg, msg, c->msgsize);
+            ch_store_rel_(&c->state, CH_ONESHOT_FULL_);
+            ch_store_rel_(&w->ref, false);
+            return CH_OK;
+        }
+    }
+    if (s == CH_ONESHOT_EMPTY_) {
+        memcpy(c->msg, msg, c->msgsize);
+        ch_store_rel_(&c->state, CH_ONESHOT_FULL_);
+        return CH_OK;
+    }
+    memcpy(w->msg, msg, c->msgsize);
+    w->done = true;
+    ch_store_rel_(&c->state, CH_ONESHOT_DONE_);
+    ch_sem_post_(w->sem);
+    return CH_OK;
+}
+
+inline channel_rc
+channel_oneshot_tryrecv_(channel_oneshot_ *c, void *msg) {
+    uintptr_t s = channel_oneshot_load_(c);
+    for ( ; ; ) {
+        switch (s) {
+        case CH_ONESHOT_FULL_:
+            if (!ch_cas_w_acq_rlx_(&c->state, &s, CH_ONESHOT_DONE_)) {
+                continue;
+            }
+            memcpy(msg, c->msg, c->msgsize);
+            return CH_OK;
+        case CH_ONESHOT_DONE_: return CH_CLOSED;
+        default: return CH_WBLOCK; // Empty or another receiver is parked
+        }
+    }
+}
+
+inline channel_rc
+channel_oneshot_recv_(channel_oneshot_ *c, void *msg, ch_timespec_ *timeout) {
+    channel_rc rc = channel_oneshot_tryrecv_(c, msg);
+    if (rc != CH_WBLOCK) {
+        return rc;
+    }
+    ch_sem_ sem;
+    ch_sem_init_(&sem);
+    channel_waiter_buf_ w = {.sem = &sem, .alt_id = CH_ALT_NIL_, .msg = msg};
+    for ( ; ; ) {
+        uintptr_t s = CH_ONESHOT_EMPTY_;
+        if (ch_cas_s_acr_rlx_(&c->state, &s, (uintptr_t)&w)) {
+            break;
+        }
+        ch_assert_(s <= CH_ONESHOT_DONE_); // Only one receiver may wait
+        if ((rc = channel_oneshot_tryrecv_(c, msg)) != CH_WBLOCK) {
+            ch_sem_destroy_(&sem);
+            return rc;
+        }
+    }
+
+    if (timeout == NULL) {
+        ch_sem_wait_(&sem);
+    } else if (ch_sem_timedwait_(&sem, timeout) != 0) {
+        uintptr_t s = (uintptr_t)&w;
+        if (ch_cas_s_acr_rlx_(&c->state, &s, CH_ONESHOT_EMPTY_)) {
+            ch_sem_destroy_(&sem);
+            return CH_WBLOCK;
+        }
+        ch_sem_wait_(&sem);
+    }
+    ch_sem_destroy_(&sem);
+    return w.done ? CH_OK : CH_CLOSED;
+}
+
+inline uint64_t
+channel_now_(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Records a wait that started at `start`, in nanoseconds. */
+inline void
+channel_waited_(channel *c, uint64_t start) {
+    uint64_t wait = channel_now_() - start;
+    uint64_t max = ch_load_rlx_(&c->hdr.maxwait);
+    while (wait > max) {
+        if (ch_cas_w_acq_rlx_(&c->hdr.maxwait, &max, wait)) {
+            return;
+        }
+    }
+}
+
+/* On fair channels, a waiter that finds the ring ready after registering
+ * stays in line and serves the queues, which may well complete its own
+ * operation. */
 inline channel_rc
 channel_buf_send_(channel_buf_ *c, void *msg, ch_timespec_ *timeout) {
     ch_sem_ sem;
-    ch_sem_init_(&sem, 0, 0);
-    channel_waiter_buf_ w = {.sem = &sem, .alt_id = CH_ALT_NIL_};
+    ch_sem_init_(&sem);
+    channel_waiter_buf_ w = {.sem = &sem, .alt_id = CH_ALT_NIL_, .msg = msg};
 
+    channel_rc rc;
+    uint64_t start = 0;
     for ( ; ; ) {
-        channel_rc rc = channel_buf_trysend_(c, msg);
-        if (rc != CH_WBLOCK) {
-            return rc;
+        if ((rc = channel_buf_trysend_(c, msg)) != CH_WBLOCK) {
+            break;
         }
 
         ch_mutex_lock_(&c->lock);
         if (ch_load_acq_(&c->openc) == 0) {
             ch_mutex_unlock_(&c->lock);
-            return CH_CLOSED;
+            rc = CH_CLOSED;
+            break;
         }
         /* TODO: Casts are evil. Figure out how to get rid of these. */
         channel_waitq_push_(&c->sendq, (channel_waiter_ *)&w);
         channel_un64_ write = {ch_load_acq_(&c->write.u64)};
         char *cell = c->buf + (write.idx * ch_cellsize_(c->msgsize));
         if (write.lap == ch_load_acq_(ch_cell_lap_(cell))) {
-            channel_waitq_remove_((channel_waiter_ *)&w);
+            if (!(c->flags & CH_FAIR_)) {
+                channel_waitq_remove_((channel_waiter_ *)&w);
+                ch_mutex_unlock_(&c->lock);
+                continue;
+            }
+            ch_mutex_unlock_(&c->lock);
+            channel_buf_serve_(c);
+        } else {
             ch_mutex_unlock_(&c->lock);
-            continue;
         }
-        ch_mutex_unlock_(&c->lock);
 
+        if (start == 0) {
+            start = channel_now_();
+        }
         if (timeout == NULL) {
             ch_sem_wait_(&sem);
         } else if (ch_sem_timedwait_(&sem, timeout) != 0) { // != 0 due to OS X
@@ -622,28 +2028,33 @@ channel_buf_send_(channel_buf_ *c, void *msg, ch_timespec_ *timeout) {
             ch_mutex_unlock_(&c->lock);
             if (!onqueue) {
                 ch_sem_wait_(w.sem);
-                channel_rc rc = channel_buf_trysend_(c, msg);
-                if (rc != CH_WBLOCK) {
-                    ch_sem_destroy_(&sem);
-                    return rc;
-                }
+                rc = w.done ? CH_OK : channel_buf_trysend_(c, msg);
             }
-            ch_sem_destroy_(&sem);
-            return CH_WBLOCK;
+            break;
+        }
+        if (w.done) {
+            rc = CH_OK;
+            break;
         }
     }
+    if (start != 0) {
+        channel_waited_((channel *)c, start);
+    }
+    ch_sem_destroy_(&sem);
+    return rc;
 }
 
 inline channel_rc
 channel_buf_recv_(channel_buf_ *c, void *msg, ch_timespec_ *timeout) {
     ch_sem_ sem;
-    ch_sem_init_(&sem, 0, 0);
-    channel_waiter_buf_ w = {.sem = &sem, .alt_id = CH_ALT_NIL_};
+    ch_sem_init_(&sem);
+    channel_waiter_buf_ w = {.sem = &sem, .alt_id = CH_ALT_NIL_, .msg = msg};
 
+    channel_rc rc;
+    uint64_t start = 0;
     for ( ; ; ) {
-        channel_rc rc = channel_buf_tryrecv_(c, msg);
-        if (rc != CH_WBLOCK) {
-            return rc;
+        if ((rc = channel_buf_tryrecv_(c, msg)) != CH_WBLOCK) {
+            break;
         }
 
         ch_mutex_lock_(&c->lock);
@@ -651,17 +2062,25 @@ channel_buf_recv_(channel_buf_ *c, void *msg, ch_timespec_ *timeout) {
         channel_un64_ read = {ch_load_acq_(&c->read.u64)};
         char *cell = c->buf + (read.idx * ch_cellsize_(c->msgsize));
         if (read.lap == ch_load_acq_(ch_cell_lap_(cell))) {
-            channel_waitq_remove_((channel_waiter_ *)&w);
+            if (!(c->flags & CH_FAIR_) || ch_load_acq_(&c->openc) == 0) {
+                channel_waitq_remove_((channel_waiter_ *)&w);
+                ch_mutex_unlock_(&c->lock);
+                continue;
+            }
             ch_mutex_unlock_(&c->lock);
-            continue;
-        }
-        if (ch_load_acq_(&c->openc) == 0) {
+            channel_buf_serve_(c);
+        } else if (ch_load_acq_(&c->openc) == 0) {
             channel_waitq_remove_((channel_waiter_ *)&w);
             ch_mutex_unlock_(&c->lock);
-            return CH_CLOSED;
+            rc = CH_CLOSED;
+            break;
+        } else {
+            ch_mutex_unlock_(&c->lock);
         }
-        ch_mutex_unlock_(&c->lock);
 
+        if (start == 0) {
+            start = channel_now_();
+        }
         if (timeout == NULL) {
             ch_sem_wait_(&sem);
         } else if (ch_sem_timedwait_(&sem, timeout) != 0) {
@@ -671,60 +2090,53 @@ channel_buf_recv_(channel_buf_ *c, void *msg, ch_timespec_ *timeout) {
             ch_mutex_unlock_(&c->lock);
             if (!onqueue) {
                 ch_sem_wait_(w.sem);
-                channel_rc rc = channel_buf_tryrecv_(c, msg);
-                if (rc != CH_WBLOCK) {
-                    ch_sem_destroy_(&sem);
-                    return rc;
-                }
+                rc = w.done ? CH_OK : channel_buf_tryrecv_(c, msg);
             }
-            ch_sem_destroy_(&sem);
-            return CH_WBLOCK;
+            break;
         }
+        if (w.done) {
+            rc = CH_OK;
+            break;
+        }
+    }
+    if (start != 0) {
+        channel_waited_((channel *)c, start);
     }
+    ch_sem_destroy_(&sem);
+    return rc;
 }
 
+/* Tries to pair up with a waiting counterpart and otherwise pushes `w`. A
+ * counterpart pushing at the same time might have missed `w`, so if one is
+ * found afterwards `w` is withdrawn and the whole thing retried. Returns
+ * `CH_WBLOCK` if `w` was left for a counterpart to post.
+ *
+ * An asynchronous `w` can be completed and freed as soon as it is pushed, so
+ * the node gets an extra reference for the duration of the call. */
 inline channel_rc
 channel_unbuf_rendez_or_wait_(
     channel_unbuf_ *c, void *msg, channel_waiter_unbuf_ *w, channel_op op
 ) {
-    channel_waiter_root_ *shiftq, *pushq;
-    if (op == CH_SEND) {
-        shiftq = &c->recvq;
-        pushq = &c->sendq;
-    } else {
-        shiftq = &c->sendq;
-        pushq = &c->recvq;
-    }
+    for ( ; ; ) {
+        channel_rc rc = channel_unbuf_try_(c, msg, op);
+        if (rc != CH_WBLOCK) {
+            return rc;
+        }
 
-    while (ch_load_acq_(&c->openc) > 0) {
-        ch_mutex_lock_(&c->lock);
-        if (ch_load_acq_(&c->openc) == 0) {
-            ch_mutex_unlock_(&c->lock);
+        uint32_t idx = w->node = channel_node_alloc_(c, w, 3);
+        if (!channel_stack_push_(ch_unbuf_waitst_(c, op), idx, idx)) {
+            channel_stack_push_(&c->pool, idx, idx); // Never shared
             return CH_CLOSED;
         }
-        channel_waiter_unbuf_ *w1 = &channel_waitq_shift_(shiftq)->unbuf;
-        if (w1) {
-            ch_mutex_unlock_(&c->lock);
-            if (w1->alt_state) {
-                size_t magic = CH_ALT_MAGIC_;
-                if (!ch_cas_s_acr_rlx_(w1->alt_state, &magic, w1->alt_id)) {
-                    ch_store_rel_(&w1->ref, false);
-                    continue;
-                }
-            }
-            if (op == CH_SEND) {
-                memcpy(w1->msg, msg, c->msgsize);
-            } else {
-                memcpy(msg, w1->msg, c->msgsize);
-            }
-            ch_sem_post_(w1->sem);
-            return CH_OK;
+        bool withdrawn =
+            channel_stack_prune_(c, ch_unbuf_peerst_(c, op)) &&
+            channel_node_kill_(c, idx, ch_unbuf_waitst_(c, op));
+        channel_node_drop_(c, idx);
+        if (!withdrawn) {
+            return CH_WBLOCK;
         }
-        channel_waitq_push_(pushq, (channel_waiter_ *)w);
-        ch_mutex_unlock_(&c->lock);
-        return CH_WBLOCK;
+        channel_node_drop_(c, idx);
     }
-    return CH_CLOSED;
 }
 
 inline channel_rc
@@ -732,7 +2144,7 @@ channel_unbuf_rendez_(
     channel_unbuf_ *c, void *msg, ch_timespec_ *timeout, channel_op op
 ) {
     ch_sem_ sem;
-    ch_sem_init_(&sem, 0, 0);
+    ch_sem_init_(&sem);
     channel_waiter_unbuf_ w = {.sem = &sem, .alt_id = CH_ALT_NIL_, .msg = msg};
     channel_rc rc = channel_unbuf_rendez_or_wait_(c, msg, &w, op);
     if (rc != CH_WBLOCK) {
@@ -740,18 +2152,20 @@ channel_unbuf_rendez_(
         return rc;
     }
 
+    uint64_t start = channel_now_();
     if (timeout == NULL) {
         ch_sem_wait_(&sem);
     } else if (ch_sem_timedwait_(&sem, timeout) != 0) {
-        ch_mutex_lock_(&c->lock);
-        bool onqueue = channel_waitq_remove_((channel_waiter_ *)&w);
-        ch_mutex_unlock_(&c->lock);
-        if (onqueue) {
+        if (channel_node_kill_(c, w.node, ch_unbuf_waitst_(c, op))) {
+            channel_waited_((channel *)c, start);
+            channel_node_drop_(c, w.node);
             ch_sem_destroy_(&sem);
             return CH_WBLOCK;
         }
         ch_sem_wait_(w.sem);
     }
+    channel_waited_((channel *)c, start);
+    channel_node_drop_(c, w.node);
     ch_sem_destroy_(&sem);
     return w.closed ? CH_CLOSED : CH_OK;
 }
@@ -774,9 +2188,97 @@ channel_add_timeout_(uint64_t timeout) {
     return ts;
 }
 
+/* Only closing the channel posts a rate limited sender so a timeout means
+ * that its turn has come. */
+inline channel_rc
+channel_rate_park_(channel *c, uint64_t wait) {
+    ch_sem_ sem;
+    ch_sem_init_(&sem);
+    channel_waiter_ w = {.hdr = {.sem = &sem, .alt_id = CH_ALT_NIL_}};
+    ch_timespec_ ts = channel_add_timeout_((wait + 999) / 1000);
+
+    channel_rc rc = CH_CLOSED;
+    ch_mutex_lock_(&c->hdr.lock);
+    if (ch_load_acq_(&c->hdr.openc) == 0) {
+        ch_mutex_unlock_(&c->hdr.lock);
+        ch_sem_destroy_(&sem);
+        return rc;
+    }
+    channel_waitq_push_(&c->hdr.rate->waitq, &w);
+    ch_mutex_unlock_(&c->hdr.lock);
+
+    if (ch_sem_timedwait_(&sem, &ts) != 0) {
+        ch_mutex_lock_(&c->hdr.lock);
+        bool onqueue = channel_waitq_remove_(&w);
+        ch_mutex_unlock_(&c->hdr.lock);
+        if (onqueue) {
+            rc = CH_OK;
+        } else {
+            ch_sem_wait_(&sem);
+        }
+    }
+    ch_sem_destroy_(&sem);
+    return rc;
+}
+
+/* Reserves the caller's turn and waits for it. Returns `CH_WBLOCK` without
+ * reserving anything if the turn is more than `timeout` microseconds away.
+ * `tat` is set to what the reservation pushed it to. */
+inline channel_rc
+channel_rate_take_(channel *c, uint64_t timeout, uint64_t *tat) {
+    channel_rate_ *r = c->hdr.rate;
+    if (ch_load_acq_(&c->hdr.openc) == 0) {
+        return CH_CLOSED;
+    }
+    uint64_t now = channel_now_(), prev = ch_load_rlx_(&r->tat), wait;
+    uint64_t limit = timeout > UINT64_MAX / 1000 ? UINT64_MAX : timeout * 1000;
+    do {
+        uint64_t start = prev > now ? prev : now;
+        wait = start - now > r->tau ? start - now - r->tau : 0;
+        if (wait > limit) {
+            return CH_WBLOCK;
+        }
+        *tat = start + r->interval;
+    } while (!ch_cas_w_acq_rlx_(&r->tat, &prev, *tat));
+    return wait > 0 ? channel_rate_park_(c, wait) : CH_OK;
+}
+
+/* The turn is handed back if the send itself fails, unless another sender
+ * has reserved one since. A `timeout` of 0 means that the send must not
+ * block. */
+inline channel_rc
+channel_rate_send_(channel *c, void *msg, uint64_t timeout, ch_timespec_ *ts) {
+    uint64_t tat;
+    channel_rc rc = channel_rate_take_(c, timeout, &tat);
+    if (rc == CH_OK) {
+        if (timeout == 0) {
+            rc = c->hdr.cap > 0 ?
+                channel_buf_trysend_(&c->buf, msg) :
+                channel_unbuf_try_(&c->unbuf, msg, CH_SEND);
+        } else {
+            rc = c->hdr.cap > 0 ?
+                channel_buf_send_(&c->buf, msg, ts) :
+                channel_unbuf_rendez_(&c->unbuf, msg, ts, CH_SEND);
+        }
+        if (rc != CH_OK) {
+            channel_rate_ *r = c->hdr.rate;
+            ch_cas_s_acr_rlx_(&r->tat, &tat, tat - r->interval);
+        }
+    }
+    return rc;
+}
+
 inline channel_rc
 channel_send(channel *c, void *msg, size_t msgsize) {
     ch_assert_(msgsize == c->hdr.msgsize);
+    if (c->hdr.flags & CH_SHM_) {
+        return channel_shm_wait_(&c->shm, msg, NULL, CH_SEND);
+    } else if (c->hdr.flags & CH_ONESHOT_) {
+        return channel_oneshot_send_(&c->oneshot, msg);
+    }
+    if (c->hdr.rate) {
+        return channel_rate_send_(c, msg, UINT64_MAX, NULL);
+    }
     return c->hdr.cap > 0 ?
         channel_buf_send_(&c->buf, msg, NULL) :
         channel_unbuf_rendez_(&c->unbuf, msg, NULL, CH_SEND);
@@ -785,6 +2287,11 @@ channel_send(channel *c, void *msg, size_t msgsize) {
 inline channel_rc
 channel_recv(channel *c, void *msg, size_t msgsize) {
     ch_assert_(msgsize == c->hdr.msgsize);
+    if (c->hdr.flags & CH_SHM_) {
+        return channel_shm_wait_(&c->shm, msg, NULL, CH_RECV);
+    } else if (c->hdr.flags & CH_ONESHOT_) {
+        return channel_oneshot_recv_(&c->oneshot, msg, NULL);
+    }
     return c->hdr.cap > 0 ?
         channel_buf_recv_(&c->buf, msg, NULL) :
         channel_unbuf_rendez_(&c->unbuf, msg, NULL, CH_RECV);
@@ -793,23 +2300,44 @@ channel_recv(channel *c, void *msg, size_t msgsize) {
 inline channel_rc
 channel_trysend(channel *c, void *msg, size_t msgsize) {
     ch_assert_(msgsize == c->hdr.msgsize);
+    if (c->hdr.flags & CH_SHM_) {
+        return channel_shm_try_(&c->shm, msg, CH_SEND);
+    } else if (c->hdr.flags & CH_ONESHOT_) {
+        return channel_oneshot_send_(&c->oneshot, msg);
+    }
+    if (c->hdr.rate) {
+        return channel_rate_send_(c, msg, 0, NULL);
+    }
     return c->hdr.cap > 0 ?
         channel_buf_trysend_(&c->buf, msg) :
-        channel_unbuf_try_(&c->unbuf, msg, &c->unbuf.recvq);
+        channel_unbuf_try_(&c->unbuf, msg, CH_SEND);
 }
 
 inline channel_rc
 channel_tryrecv(channel *c, void *msg, size_t msgsize) {
     ch_assert_(msgsize == c->hdr.msgsize);
+    if (c->hdr.flags & CH_SHM_) {
+        return channel_shm_try_(&c->shm, msg, CH_RECV);
+    } else if (c->hdr.flags & CH_ONESHOT_) {
+        return channel_oneshot_tryrecv_(&c->oneshot, msg);
+    }
     return c->hdr.cap > 0 ?
         channel_buf_tryrecv_(&c->buf, msg) :
-        channel_unbuf_try_(&c->unbuf, msg, &c->unbuf.sendq);
+        channel_unbuf_try_(&c->unbuf, msg, CH_RECV);
 }
 
 inline channel_rc
 channel_timedsend(channel *c, void *msg, uint64_t timeout, size_t msgsize) {
     ch_assert_(msgsize == c->hdr.msgsize);
     ch_timespec_ ts = channel_add_timeout_(timeout);
+    if (c->hdr.flags & CH_SHM_) {
+        return channel_shm_wait_(&c->shm, msg, &ts, CH_SEND);
+    } else if (c->hdr.flags & CH_ONESHOT_) {
+        return channel_oneshot_send_(&c->oneshot, msg);
+    }
+    if (c->hdr.rate) {
+        return channel_rate_send_(c, msg, timeout, &ts);
+    }
     return c->hdr.cap > 0 ?
         channel_buf_send_(&c->buf, msg, &ts) :
         channel_unbuf_rendez_(&c->unbuf, msg, &ts, CH_SEND);
@@ -819,6 +2347,11 @@ inline channel_rc
 channel_timedrecv(channel *c, void *msg, uint64_t timeout, size_t msgsize) {
     ch_assert_(msgsize == c->hdr.msgsize);
     ch_timespec_ ts = channel_add_timeout_(timeout);
+    if (c->hdr.flags & CH_SHM_) {
+        return channel_shm_wait_(&c->shm, msg, &ts, CH_RECV);
+    } else if (c->hdr.flags & CH_ONESHOT_) {
+        return channel_oneshot_recv_(&c->oneshot, msg, &ts);
+    }
     return c->hdr.cap > 0 ?
         channel_buf_recv_(&c->buf, msg, &ts) :
         channel_unbuf_rendez_(&c->unbuf, msg, &ts, CH_RECV);
@@ -850,15 +2383,9 @@ channel_tryalt(channel_case cases[], size_t len, size_t offset) {
 inline bool
 channel_alt_ready_(channel *c, channel_op op) {
     if (c->hdr.cap == 0) {
-        return op == CH_SEND ?
-            &ch_load_acq_(&c->unbuf.recvq.next)->root != &c->unbuf.recvq :
-            &ch_load_acq_(&c->unbuf.sendq.next)->root != &c->unbuf.sendq;
+        return channel_stack_prune_(&c->unbuf, ch_unbuf_peerst_(&c->unbuf, op));
     }
-    channel_un64_ u = op == CH_SEND ?
-        (const channel_un64_){ch_load_acq_(&c->buf.write.u64)} :
-        (const channel_un64_){ch_load_acq_(&c->buf.read.u64)};
-    char *cell = c->buf.buf + (u.idx * ch_cellsize_(c->buf.msgsize));
-    return u.lap <= ch_load_acq_(ch_cell_lap_(cell));
+    return channel_buf_ready_(&c->buf, op);
 }
 
 inline channel_alt_rc_
@@ -872,22 +2399,78 @@ channel_alt_wait_(
     size_t closedc = 0;
     for (size_t i = 0; i < len; i++) {
         channel_case *cc = cases + ((i + offset) % len);
+        ch_assert_(cc->op == CH_NOOP || !(cc->c->hdr.flags & CH_SHM_));
         if (cc->op == CH_NOOP || ch_load_acq_(&cc->c->hdr.openc) == 0) {
+            cc->_w.hdr.sem = NULL;
             closedc++;
             continue;
         }
 
-        if (cc->c->hdr.cap == 0) {
-            cc->_w.unbuf.msg = cc->msg;
-        }
+        ch_assert_(cc->op != CH_SEND || !cc->c->hdr.rate);
         cc->_w.hdr.sem = sem;
         cc->_w.hdr.alt_state = state;
         cc->_w.hdr.alt_id = (i + offset) % len;
+        if (cc->c->hdr.flags & CH_ONESHOT_) {
+            if (cc->op == CH_SEND) { // Sends never block
+                cc->_w.hdr.sem = NULL;
+                closedc++;
+                continue;
+            }
+            cc->_w.buf.msg = cc->msg;
+            cc->_w.buf.done = false;
+            ch_store_rlx_(&cc->_w.hdr.ref, true);
+            uintptr_t s = CH_ONESHOT_EMPTY_;
+            if (ch_cas_s_acr_rlx_(
+                &cc->c->oneshot.state, &s, (uintptr_t)&cc->_w)) {
+                continue;
+            }
+            ch_assert_(s <= CH_ONESHOT_DONE_); // Only one receiver may wait
+            cc->_w.hdr.sem = NULL;
+            if (s == CH_ONESHOT_DONE_) {
+                closedc++;
+                continue;
+            }
+            return CH_ALT_READY_;
+        }
+        if (cc->c->hdr.cap == 0) {
+            channel_unbuf_ *c = &cc->c->unbuf;
+            channel_waiter_unbuf_ *w = &cc->_w.unbuf;
+            w->msg = cc->msg;
+            w->closed = false;
+            w->node = channel_node_alloc_(c, w, 2);
+            if (!channel_stack_push_(
+                ch_unbuf_waitst_(c, cc->op), w->node, w->node)) {
+                channel_stack_push_(&c->pool, w->node, w->node);
+                w->sem = NULL;
+                closedc++;
+                continue;
+            }
+            if (channel_alt_ready_(cc->c, cc->op)) {
+                if (channel_node_kill_(
+                    c, w->node, ch_unbuf_waitst_(c, cc->op))) {
+                    channel_node_drop_(c, w->node);
+                    w->sem = NULL;
+                }
+                return CH_ALT_READY_;
+            }
+            continue;
+        }
+
+        cc->_w.buf.msg = cc->msg;
+        cc->_w.buf.done = false;
         channel_waiter_root_ *waitq = cc->op == CH_SEND ?
             &cc->c->hdr.sendq : &cc->c->hdr.recvq;
         ch_mutex_lock_(&cc->c->hdr.lock);
         channel_waitq_push_(waitq, &cc->_w);
         if (channel_alt_ready_(cc->c, cc->op)) {
+            if (
+                cc->c->hdr.flags & CH_FAIR_ &&
+                ch_load_acq_(&cc->c->hdr.openc) > 0
+            ) {
+                ch_mutex_unlock_(&cc->c->hdr.lock);
+                channel_buf_serve_(&cc->c->buf);
+                continue;
+            }
             channel_waitq_remove_(&cc->_w);
             ch_mutex_unlock_(&cc->c->hdr.lock);
             cc->_w.hdr.sem = NULL;
@@ -908,11 +2491,39 @@ channel_alt_remove_waiters_(
 ) {
     for (size_t i = 0; i < len; i++) {
         channel_case *cc = cases + i;
-        if (
-            cc->op == CH_NOOP ||
-            ch_load_acq_(&cc->c->hdr.openc) == 0 ||
-            !cc->_w.hdr.sem
-        ) {
+        if (cc->op == CH_NOOP || !cc->_w.hdr.sem) {
+            continue;
+        }
+
+        if (cc->c->hdr.flags & CH_ONESHOT_) {
+            uintptr_t s = (uintptr_t)&cc->_w;
+            if (
+                !ch_cas_s_acr_rlx_(
+                    &cc->c->oneshot.state, &s, CH_ONESHOT_EMPTY_) &&
+                i != state
+            ) {
+                while (ch_load_acq_(&cc->_w.hdr.ref)) {
+                    sched_yield();
+                }
+            }
+            cc->_w.hdr.sem = NULL;
+            continue;
+        }
+
+        if (cc->c->hdr.cap == 0) {
+            channel_unbuf_ *c = &cc->c->unbuf;
+            uint32_t idx = cc->_w.unbuf.node;
+            if (
+                !channel_node_kill_(c, idx, ch_unbuf_waitst_(c, cc->op)) &&
+                i != state
+            ) {
+                channel_node_ *n = channel_node_at_(idx);
+                while (ch_load_acq_(&n->state) == CH_NODE_BUSY_) {
+                    sched_yield();
+                }
+            }
+            channel_node_drop_(c, idx);
+            cc->_w.hdr.sem = NULL;
             continue;
         }
 
@@ -928,59 +2539,509 @@ channel_alt_remove_waiters_(
     }
 }
 
+inline channel_token *
+channel_token_init(channel_token *t) {
+    ch_store_rlx_(&t->canceled, false);
+    ch_store_rlx_(&t->waitq.next, (channel_waiter_ *)&t->waitq);
+    ch_store_rlx_(&t->waitq.prev, (channel_waiter_ *)&t->waitq);
+    ch_mutex_init_(t->lock);
+    return t;
+}
+
+/* No operation may be using the token anymore. */
+inline void
+channel_token_destroy(channel_token *t) {
+    ch_assert_(&ch_load_rlx_(&t->waitq.next)->root == &t->waitq);
+    ch_assert_(ch_mutex_destroy_(&t->lock) == 0);
+}
+
+/* Claims the alternation state of every registered operation, just as
+ * closing a channel does. The claim has to be sequentially consistent as
+ * operations only check `canceled` after resetting their state. */
+inline void
+channel_cancel(channel_token *t) {
+    channel_waiter_ *canceled = NULL, *w;
+    ch_mutex_lock_(&t->lock);
+    if (ch_load_rlx_(&t->canceled)) {
+        ch_mutex_unlock_(&t->lock);
+        return;
+    }
+    ch_store_seq_(&t->canceled, true);
+    while ((w = channel_waitq_shift_(&t->waitq))) {
+        w->hdr.next = canceled;
+        canceled = w;
+    }
+    ch_mutex_unlock_(&t->lock);
+    while ((w = canceled)) {
+        canceled = w->hdr.next;
+        size_t magic = CH_ALT_MAGIC_;
+        if (!ch_cas_s_seq_acq_(w->hdr.alt_state, &magic, w->hdr.alt_id)) {
+            ch_store_rel_(&w->hdr.ref, false);
+            continue;
+        }
+        ch_sem_post_(w->hdr.sem);
+    }
+}
+
+inline bool
+channel_canceled(channel_token *t) {
+    return ch_load_acq_(&t->canceled);
+}
+
+/* Returns `false` without registering `w` if the token is already canceled. */
+inline bool
+channel_token_push_(channel_token *t, channel_waiter_ *w) {
+    ch_mutex_lock_(&t->lock);
+    bool canceled = ch_load_rlx_(&t->canceled);
+    if (!canceled) {
+        channel_waitq_push_(&t->waitq, w);
+    }
+    ch_mutex_unlock_(&t->lock);
+    return !canceled;
+}
+
+/* A canceller that claimed the state has already posted and is done with
+ * `w`. One that didn't clears `ref` once its claim fails. */
+inline void
+channel_token_remove_(channel_token *t, channel_waiter_ *w) {
+    ch_mutex_lock_(&t->lock);
+    bool onqueue = channel_waitq_remove_(w);
+    ch_mutex_unlock_(&t->lock);
+    if (!onqueue && ch_load_acq_(w->hdr.alt_state) != CH_CANCELED) {
+        while (ch_load_acq_(&w->hdr.ref)) {
+            sched_yield();
+        }
+    }
+}
+
+/* With a token, the state starts out claimed so that a cancellation between
+ * rounds fails to claim it and is instead noticed at the start of the next.
+ * The state is never left unclaimed on the way out. */
 inline size_t
-channel_alt(channel_case cases[], size_t len, uint64_t timeout) {
+channel_calt(
+    channel_case cases[], size_t len, uint64_t timeout, channel_token *t
+) {
+    if (t && ch_load_acq_(&t->canceled)) {
+        return CH_CANCELED;
+    }
     ch_timespec_ ts;
     if (timeout < UINT64_MAX) {
         ts = channel_add_timeout_(timeout);
     }
     size_t offset = rand();
     ch_sem_ sem;
-    ch_sem_init_(&sem, 0, 0);
+    ch_sem_init_(&sem);
+    _Atomic size_t state;
+    ch_store_rlx_(&state, CH_ALT_NIL_);
+    channel_waiter_ tw = {.hdr = {
+        .sem = &sem, .alt_state = &state, .alt_id = CH_CANCELED
+    }};
+    if (t && !channel_token_push_(t, &tw)) {
+        ch_sem_destroy_(&sem);
+        return CH_CANCELED;
+    }
     bool timedout = false;
+    size_t rc;
     do {
-        size_t idx = channel_tryalt(cases, len, offset);
-        if (idx != CH_WBLOCK) {
-            return idx;
+        if ((rc = channel_tryalt(cases, len, offset)) != CH_WBLOCK) {
+            break;
         }
 
-        _Atomic size_t state;
-        ch_store_rlx_(&state, CH_ALT_MAGIC_);
+        ch_store_seq_(&state, CH_ALT_MAGIC_);
         size_t state1 = CH_ALT_MAGIC_;
-        switch (channel_alt_wait_(cases, len, offset, &sem, &state)) {
-        case CH_ALT_CLOSED_: return CH_CLOSED;
-        case CH_ALT_READY_:
+        bool canceled = t && ch_load_seq_(&t->canceled);
+        channel_alt_rc_ arc = canceled ?
+            CH_ALT_CLOSED_ :
+            channel_alt_wait_(cases, len, offset, &sem, &state);
+        if (arc == CH_ALT_CLOSED_) {
             if (!ch_cas_s_acr_rlx_(&state, &state1, CH_ALT_NIL_)) {
-                ch_sem_wait_(&sem);
+                ch_sem_wait_(&sem); // Only a canceller can have claimed it
+                canceled = true;
             }
+            rc = canceled ? CH_CANCELED : CH_CLOSED;
             break;
-        case CH_ALT_WAIT_:
+        }
+        if (arc == CH_ALT_READY_) {
+            if (!ch_cas_s_acr_rlx_(&state, &state1, CH_ALT_NIL_)) {
+                ch_sem_wait_(&sem);
+            }
+        } else if (timeout != UINT64_MAX &&
+            ch_sem_timedwait_(&sem, &ts) != 0) {
+            timedout = true;
+            if (!ch_cas_s_acr_rlx_(&state, &state1, CH_ALT_NIL_)) {
+                ch_sem_wait_(&sem);
+            }
+        } else {
             if (timeout == UINT64_MAX) {
                 ch_sem_wait_(&sem);
-            } else if (ch_sem_timedwait_(&sem, &ts) != 0) {
-                timedout = true;
-                if (!ch_cas_s_acr_rlx_(&state, &state1, CH_ALT_NIL_)) {
-                    ch_sem_wait_(&sem);
-                }
-                break;
             }
             ch_cas_s_acr_rlx_(&state, &state1, CH_ALT_NIL_);
         }
 
         channel_alt_remove_waiters_(cases, len, state1);
+        if (state1 == CH_CANCELED) {
+            rc = CH_CANCELED;
+            break;
+        }
         if (state1 != CH_ALT_MAGIC_) {
             channel_case *cc = cases + state1;
-            if (
-                cc->c->hdr.cap == 0 ||
-                (cc->op == CH_SEND && channel_buf_trysend_(
-                    &cc->c->buf, cc->msg) == CH_OK) ||
-                (cc->op == CH_RECV && channel_buf_tryrecv_(
-                    &cc->c->buf, cc->msg) == CH_OK)
-            ) {
-                return state1;
+            bool done;
+            if (cc->c->hdr.flags & CH_ONESHOT_) {
+                done = cc->_w.buf.done || channel_oneshot_tryrecv_(
+                    &cc->c->oneshot, cc->msg) == CH_OK;
+            } else if (cc->c->hdr.cap == 0) {
+                done = !cc->_w.unbuf.closed;
+            } else {
+                done = cc->_w.buf.done || (cc->op == CH_SEND ?
+                    channel_buf_trysend_(&cc->c->buf, cc->msg) :
+                    channel_buf_tryrecv_(&cc->c->buf, cc->msg)) == CH_OK;
+            }
+            if (done) {
+                rc = state1;
+                break;
             }
         }
     } while (!timedout);
-    return CH_WBLOCK;
+    if (t) {
+        channel_token_remove_(t, &tw);
+    }
+    ch_sem_destroy_(&sem);
+    return rc;
+}
+
+inline size_t
+channel_alt(channel_case cases[], size_t len, uint64_t timeout) {
+    return channel_calt(cases, len, timeout, NULL);
+}
+
+/* Cancellable sends and receives are alternations of one case, which return
+ * 0, i.e. `CH_OK`, on success. */
+inline channel_rc
+channel_csend(
+    channel *c, void *msg, uint64_t timeout, channel_token *t, size_t msgsize
+) {
+    ch_assert_(msgsize == c->hdr.msgsize);
+    channel_case cc = {.c = c, .msg = msg, .op = CH_SEND};
+    return channel_calt(&cc, 1, timeout, t);
+}
+
+inline channel_rc
+channel_crecv(
+    channel *c, void *msg, uint64_t timeout, channel_token *t, size_t msgsize
+) {
+    ch_assert_(msgsize == c->hdr.msgsize);
+    channel_case cc = {.c = c, .msg = msg, .op = CH_RECV};
+    return channel_calt(&cc, 1, timeout, t);
+}
+
+inline channel_rc
+channel_async_buf_(channel_async_ *a) {
+    channel_buf_ *c = &a->c->buf;
+    channel_waiter_ *w = &a->w;
+    for ( ; ; ) {
+        channel_rc rc = a->op == CH_SEND ?
+            channel_buf_trysend_(c, a->msg) : channel_buf_tryrecv_(c, a->msg);
+        if (rc != CH_WBLOCK) {
+            return rc;
+        }
+
+        ch_mutex_lock_(&c->lock);
+        if (a->op == CH_SEND && ch_load_acq_(&c->openc) == 0) {
+            ch_mutex_unlock_(&c->lock);
+            return CH_CLOSED;
+        }
+        channel_waitq_push_(a->op == CH_SEND ? &c->sendq : &c->recvq, w);
+        if (channel_alt_ready_(a->c, a->op)) {
+            if (c->flags & CH_FAIR_ && ch_load_acq_(&c->openc) > 0) {
+                ch_mutex_unlock_(&c->lock);
+                channel_buf_serve_(c); // May complete and free `a`
+                return CH_WBLOCK;
+            }
+            channel_waitq_remove_(w);
+            ch_mutex_unlock_(&c->lock);
+            continue;
+        }
+        if (a->op == CH_RECV && ch_load_acq_(&c->openc) == 0) {
+            channel_waitq_remove_(w);
+            ch_mutex_unlock_(&c->lock);
+            return CH_CLOSED;
+        }
+        ch_mutex_unlock_(&c->lock);
+        return CH_WBLOCK;
+    }
+}
+
+/* Unbuffered operations have already been completed by the counterpart when
+ * the waiter is posted. Buffered ones have only been told to retry, unless a
+ * message was handed off. */
+inline void
+channel_async_step_(channel_async_ *a) {
+    channel_rc rc;
+    if (a->c->hdr.cap == 0) {
+        rc = a->w.unbuf.closed ? CH_CLOSED : CH_OK;
+        channel_node_drop_(&a->c->unbuf, a->w.unbuf.node);
+    } else if (a->w.buf.done) {
+        rc = CH_OK;
+    } else if ((rc = channel_async_buf_(a)) == CH_WBLOCK) {
+        return;
+    }
+    a->fn(a->ctx, rc);
+    ch_drop(a->c);
+    free(a);
+}
+
+inline void
+channel_async_wake_(channel_sem_ *sem) {
+    channel_async_q_ *q = &channel_asyncq_;
+    channel_async_ *a = (channel_async_ *)sem;
+    a->next = NULL;
+    if (q->tail) {
+        q->tail->next = a;
+    } else {
+        q->head = a;
+    }
+    q->tail = a;
+    if (q->busy) {
+        return;
+    }
+
+    q->busy = true;
+    while ((a = q->head)) {
+        if (!(q->head = a->next)) {
+            q->tail = NULL;
+        }
+        channel_async_step_(a);
+    }
+    q->busy = false;
+}
+
+inline channel_rc
+channel_async_start_(
+    channel *c,
+    void *msg,
+    size_t msgsize,
+    channel_async_fn fn,
+    void *ctx,
+    channel_op op
+) {
+    ch_assert_(msgsize == c->hdr.msgsize);
+    ch_assert_(!(c->hdr.flags & (CH_SHM_ | CH_ONESHOT_)));
+    ch_assert_(op != CH_SEND || !c->hdr.rate);
+    channel_async_ *a;
+    size_t bufsize = op == CH_SEND ? msgsize : 0;
+    ch_assert_((a = malloc(sizeof(*a) + bufsize)));
+    a->sem.fn = channel_async_wake_;
+    a->w = (const channel_waiter_){
+        .hdr = {.sem = &a->sem, .alt_id = CH_ALT_NIL_}
+    };
+    a->c = c;
+    a->op = op;
+    a->msg = op == CH_SEND ? memcpy(a->buf, msg, msgsize) : msg;
+    a->fn = fn;
+    a->ctx = ctx;
+
+    /* The reference has to be taken before the waiter is visible as the
+     * operation can complete at any point after that. */
+    channel_rc rc;
+    ch_dup(c);
+    if (c->hdr.cap == 0) {
+        a->w.unbuf.msg = a->msg;
+        rc = channel_unbuf_rendez_or_wait_(&c->unbuf, a->msg, &a->w.unbuf, op);
+    } else {
+        a->w.buf.msg = a->msg;
+        rc = channel_async_buf_(a);
+    }
+    if (rc != CH_WBLOCK) {
+        ch_drop(c);
+        free(a);
+    }
+    return rc;
+}
+
+inline channel_rc
+channel_send_async(
+    channel *c, void *msg, size_t msgsize, channel_async_fn fn, void *ctx
+) {
+    return channel_async_start_(c, msg, msgsize, fn, ctx, CH_SEND);
+}
+
+inline channel_rc
+channel_recv_async(
+    channel *c, void *msg, size_t msgsize, channel_async_fn fn, void *ctx
+) {
+    return channel_async_start_(c, msg, msgsize, fn, ctx, CH_RECV);
+}
+/* Must be called with the lock held. Timers that are already due go in the
+ * slot that is processed next. */
+inline void
+channel_wheel_insert_(channel_timer_ *t) {
+    channel_wheel_ *w = &channel_timers_;
+    uint64_t now = w->now, expiry = t->expiry > now ? t->expiry : now;
+    size_t level = 0;
+    while (level < CH_WHEEL_LEVELS_ - 1 && (expiry - now) >> 6 * (level + 1)) {
+        level++;
+    }
+    if ((expiry - now) >> 6 * (level + 1)) { // Beyond the top level
+        expiry = now + ((uint64_t)1 << 6 * CH_WHEEL_LEVELS_) - 1;
+    }
+    size_t slot = (expiry >> 6 * level) & 63;
+    t->next = w->slots[level][slot];
+    w->slots[level][slot] = t;
+    w->bits[level] |= (uint64_t)1 << slot;
+}
+
+/* Processes every tick up to and including `tick` and returns the timers
+ * that fired in the order they came due. Slots on higher levels are emptied
+ * back into the wheel when the levels below them wrap around. */
+inline channel_timer_ *
+channel_wheel_advance_(uint64_t tick) {
+    channel_wheel_ *w = &channel_timers_;
+    channel_timer_ *fired = NULL, **last = &fired, *t;
+    for ( ; w->now <= tick; w->now++) {
+        size_t top = 0;
+        while (top < CH_WHEEL_LEVELS_ - 1 &&
+            (w->now & (((uint64_t)1 << 6 * (top + 1)) - 1)) == 0) {
+            top++;
+        }
+        for (size_t level = top; level > 0; level--) {
+            size_t slot = (w->now >> 6 * level) & 63;
+            t = w->slots[level][slot];
+            w->slots[level][slot] = NULL;
+            w->bits[level] &= ~((uint64_t)1 << slot);
+            while (t) {
+                channel_timer_ *next = t->next;
+                channel_wheel_insert_(t);
+                t = next;
+            }
+        }
+        size_t slot = w->now & 63;
+        if ((t = w->slots[0][slot])) {
+            *last = t;
+            while (t->next) {
+                t = t->next;
+            }
+            last = &t->next;
+            w->slots[0][slot] = NULL;
+        }
+        w->bits[0] &= ~((uint64_t)1 << slot);
+    }
+    return fired;
+}
+
+/* Returns the next tick that has to be processed, which is either the next
+ * nonempty slot on the bottom level or the next wraparound. */
+inline uint64_t
+channel_wheel_next_(void) {
+    channel_wheel_ *w = &channel_timers_;
+    size_t slot = w->now & 63;
+    uint64_t ahead = w->bits[0] >> slot;
+    return ahead ?
+        w->now + (uint64_t)__builtin_ctzll(ahead) : w->now + (64 - slot);
+}
+
+/* Channels are only ever sent to with `channel_trysend` so a slow receiver
+ * misses ticks instead of holding up the wheel. A ticker that falls behind
+ * skips the ticks it missed and is dropped once its channel is closed. */
+inline void *
+channel_wheel_main_(void *arg) {
+    (void)arg;
+    channel_wheel_ *w = &channel_timers_;
+    pthread_mutex_lock(&w->lock);
+    for ( ; ; ) {
+        uint64_t now = channel_now_();
+        channel_timer_ *fired =
+            channel_wheel_advance_((now - w->base) / CH_WHEEL_TICK_);
+        if (fired) {
+            pthread_mutex_unlock(&w->lock);
+            uint64_t stamp = now / 1000;
+            channel_timer_ *t, *again = NULL;
+            size_t donec = 0;
+            while ((t = fired)) {
+                fired = t->next;
+                channel_rc rc = channel_trysend(t->c, &stamp, sizeof(stamp));
+                if (t->period == 0 || rc == CH_CLOSED) {
+                    channel_drop(t->c);
+                    free(t);
+                    donec++;
+                } else {
+                    t->next = again;
+                    again = t;
+                }
+            }
+            pthread_mutex_lock(&w->lock);
+            w->timerc -= donec;
+            while ((t = again)) {
+                again = t->next;
+                t->expiry += t->period;
+                if (t->expiry < w->now) {
+                    t->expiry +=
+                        (w->now - t->expiry + t->period - 1) / t->period *
+                        t->period;
+                }
+                channel_wheel_insert_(t);
+            }
+            continue;
+        }
+        if (w->timerc == 0) {
+            w->wake = UINT64_MAX;
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+        w->wake = channel_wheel_next_();
+        uint64_t wait = w->base + w->wake * CH_WHEEL_TICK_ - now;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += wait % 1000000000;
+        ts.tv_sec += ts.tv_nsec / 1000000000 + wait / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&w->cond, &w->lock, &ts);
+    }
+    return NULL;
+}
+
+/* The wheel thread is started on first use and runs for the rest of the
+ * process. It holds a reference to the channel of every pending timer. */
+inline channel *
+channel_timer_start_(uint64_t timeout, uint64_t period) {
+    channel *c = channel_make(sizeof(uint64_t), 1);
+    channel_timer_ *t;
+    ch_assert_((t = malloc(sizeof(*t))));
+    t->c = channel_dup(c);
+    t->period = period;
+
+    channel_wheel_ *w = &channel_timers_;
+    pthread_mutex_lock(&w->lock);
+    uint64_t now = channel_now_();
+    if (!w->started) {
+        pthread_t thread;
+        w->base = now;
+        w->wake = UINT64_MAX;
+        ch_assert_(
+            pthread_create(&thread, NULL, channel_wheel_main_, NULL) == 0);
+        ch_assert_(pthread_detach(thread) == 0);
+        w->started = true;
+    }
+    uint64_t due = timeout > UINT64_MAX / 4000 ?
+        UINT64_MAX / 2 : now - w->base + timeout * 1000;
+    t->expiry = (due + CH_WHEEL_TICK_ - 1) / CH_WHEEL_TICK_;
+    channel_wheel_insert_(t);
+    w->timerc++;
+    if (t->expiry < w->wake) {
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return c;
+}
+
+inline channel *
+channel_after(uint64_t timeout) {
+    return channel_timer_start_(timeout, 0);
+}
+
+inline channel *
+channel_ticker(uint64_t period) {
+    ch_assert_(0 < period && period <= UINT64_MAX / 1000);
+    return channel_timer_start_(
+        period, (period * 1000 + CH_WHEEL_TICK_ - 1) / CH_WHEEL_TICK_);
 }
 #endif
@@ -0,0 +1,311 @@
+/* `primes.c` again, except that every filter is a green thread multiplexed
+ * over a handful of OS threads by a toy M:N scheduler plugged in with
+ * `ch_setsched`. Linux only due to `ucontext.h`. */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+#include "../channel.h"
+
+CHANNEL_EXTERN_DECL;
+
+#define THREADC 4
+#define PRIMEC 2000
+#define STACKSIZE (64 * 1024)
+
+enum state {
+    RUNNING,
+    NOTIFIED, // Running with a pending unpark
+    PARKED,
+};
+
+typedef struct task {
+    ucontext_t ctx;
+    struct task *next;
+    _Atomic int state;
+    void (*fn)(void *);
+    void *arg;
+    bool done;
+    const struct timespec *deadline;
+    struct task *sleepnext;
+    char stack[];
+} task;
+
+typedef struct worker {
+    ucontext_t ctx;
+    task *parking;
+} worker;
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+task *runq, *runqtail, *sleepers;
+size_t livec;
+
+_Thread_local worker *self_worker;
+_Thread_local task *self_task;
+
+/* Green threads migrate between OS threads so thread locals must never be
+ * cached across a context switch. */
+__attribute__((noinline)) worker *
+get_worker(void) {
+    return self_worker;
+}
+
+__attribute__((noinline)) task *
+get_task(void) {
+    return self_task;
+}
+
+__attribute__((noinline)) void
+set_task(task *t) {
+    self_task = t;
+}
+
+void
+enqueue_locked(task *t) {
+    t->next = NULL;
+    if (runqtail) {
+        runqtail->next = t;
+    } else {
+        runq = t;
+    }
+    runqtail = t;
+    pthread_cond_signal(&cond);
+}
+
+void *
+sched_self(void) {
+    return get_task();
+}
+
+void
+sched_unpark(void *arg) {
+    task *t = (task *)arg;
+    int state = atomic_load(&t->state);
+    for ( ; ; ) {
+        switch (state) {
+        case NOTIFIED: return;
+        case RUNNING:
+            if (atomic_compare_exchange_weak(&t->state, &state, NOTIFIED)) {
+                return;
+            }
+            break;
+        case PARKED:
+            if (atomic_compare_exchange_weak(&t->state, &state, RUNNING)) {
+                pthread_mutex_lock(&lock);
+                enqueue_locked(t);
+                pthread_mutex_unlock(&lock);
+                return;
+            }
+        }
+    }
+}
+
+/* The task only gets marked as parked after switching back to the worker so
+ * that an unpark can't resume it while it is still running. */
+void
+sched_park(void *arg) {
+    task *t = (task *)arg;
+    int state = NOTIFIED;
+    if (atomic_compare_exchange_strong(&t->state, &state, RUNNING)) {
+        return;
+    }
+    worker *w = get_worker();
+    w->parking = t;
+    swapcontext(&t->ctx, &w->ctx);
+}
+
+int
+sched_timedpark(void *arg, const struct timespec *deadline) {
+    task *t = (task *)arg;
+    pthread_mutex_lock(&lock);
+    t->deadline = deadline;
+    t->sleepnext = sleepers;
+    sleepers = t;
+    pthread_mutex_unlock(&lock);
+
+    sched_park(t);
+
+    pthread_mutex_lock(&lock);
+    for (task **tp = &sleepers; *tp; tp = &(*tp)->sleepnext) {
+        if (*tp == t) {
+            *tp = t->sleepnext;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > deadline->tv_sec ||
+        (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+const channel_sched sched = {
+    sched_self, sched_park, sched_timedpark, sched_unpark
+};
+
+void
+trampoline(void) {
+    task *t = get_task();
+    t->fn(t->arg);
+    t->done = true;
+    swapcontext(&t->ctx, &get_worker()->ctx);
+}
+
+void
+go(void (*fn)(void *), void *arg) {
+    task *t = malloc(sizeof(*t) + STACKSIZE);
+    getcontext(&t->ctx);
+    t->ctx.uc_stack.ss_sp = t->stack;
+    t->ctx.uc_stack.ss_size = STACKSIZE;
+    t->ctx.uc_link = NULL;
+    makecontext(&t->ctx, trampoline, 0);
+    atomic_init(&t->state, RUNNING);
+    t->fn = fn;
+    t->arg = arg;
+    t->done = false;
+    pthread_mutex_lock(&lock);
+    livec++;
+    enqueue_locked(t);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Wakes sleepers whose deadlines have passed and returns the earliest
+ * remaining deadline, if any. */
+bool
+wake_sleepers_locked(struct timespec *next) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    bool any = false;
+    for (task *t = sleepers; t; t = t->sleepnext) {
+        const struct timespec *d = t->deadline;
+        if (now.tv_sec > d->tv_sec ||
+            (now.tv_sec == d->tv_sec && now.tv_nsec >= d->tv_nsec)) {
+            int state = PARKED;
+            if (atomic_compare_exchange_strong(&t->state, &state, RUNNING)) {
+                enqueue_locked(t);
+            }
+        } else if (!any || d->tv_sec < next->tv_sec ||
+            (d->tv_sec == next->tv_sec && d->tv_nsec < next->tv_nsec)) {
+            *next = *d;
+            any = true;
+        }
+    }
+    return any;
+}
+
+void *
+work(void *arg) {
+    (void)arg;
+    worker w = {.parking = NULL};
+    self_worker = &w;
+    pthread_mutex_lock(&lock);
+    for ( ; ; ) {
+        struct timespec next;
+        bool timed = wake_sleepers_locked(&next);
+        if (livec == 0) {
+            break;
+        }
+        if (!runq) {
+            if (timed) {
+                pthread_cond_timedwait(&cond, &lock, &next);
+            } else {
+                pthread_cond_wait(&cond, &lock);
+            }
+            continue;
+        }
+        task *t = runq;
+        if (!(runq = t->next)) {
+            runqtail = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+
+        set_task(t);
+        swapcontext(&w.ctx, &t->ctx);
+        set_task(NULL);
+
+        pthread_mutex_lock(&lock);
+        if (t->done) {
+            free(t);
+            if (--livec == 0) {
+                pthread_cond_broadcast(&cond);
+            }
+        } else if (w.parking) {
+            int state = RUNNING;
+            if (!atomic_compare_exchange_strong(&t->state, &state, PARKED)) {
+                atomic_store(&t->state, RUNNING); // Unparked while parking
+                enqueue_locked(t);
+            }
+            w.parking = NULL;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+void
+generate(void *arg) {
+    channel *chan = (channel *)arg;
+    for (int i = 2; ch_send(chan, &i) == CH_OK; i++);
+    ch_drop(chan);
+}
+
+typedef struct filter_args {
+    channel *in, *out;
+    int p;
+} filter_args;
+
+void
+filter(void *arg) {
+    filter_args args = *(filter_args *)arg;
+    free(arg);
+
+    int i;
+    while (ch_recv(args.in, &i) == CH_OK) {
+        if (i % args.p != 0 && ch_send(args.out, &i) != CH_OK) {
+            break;
+        }
+    }
+    /* Closing from the receiving side propagates back up the chain. */
+    ch_close(args.in);
+    ch_drop(args.in);
+    ch_drop(args.out);
+}
+
+void
+sieve(void *arg) {
+    (void)arg;
+    channel *chan = ch_make(int, 0);
+    go(generate, ch_dup(chan));
+    for (int i = 0; i < PRIMEC; i++) {
+        int p;
+        ch_recv(chan, &p);
+        printf("%d\n", p);
+
+        filter_args *args = malloc(sizeof(*args));
+        *args = (filter_args){chan, ch_make(int, 0), p};
+        chan = ch_dup(args->out);
+        go(filter, args);
+    }
+    ch_close(chan);
+    ch_drop(chan);
+}
+
+int
+main(void) {
+    pthread_t pool[THREADC];
+    ch_setsched(&sched);
+    go(sieve, NULL);
+    for (int i = 0; i < THREADC; i++) {
+        pthread_create(pool + i, NULL, work, NULL);
+    }
+    for (int i = 0; i < THREADC; i++) {
+        pthread_join(pool[i], NULL);
+    }
+    return 0;
+}
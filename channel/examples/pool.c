@@ -4,6 +4,9 @@
 #include <unistd.h>
 #include "../channel.h"
 
+/* Every worker contends on the same `ch_recv` here, which falls over under
+ * load. See `executor/executor.h` for a work-stealing pool. */
+
 CHANNEL_EXTERN_DECL;
 
 typedef void (*fn)(void);
@@ -15,7 +18,7 @@ work(void *arg) {
     channel *c = (channel *)arg;
     fn f;
 
-    while (ch_recv(c, f) == CH_OK) {
+    while (ch_recv(c, &f) == CH_OK) {
         f();
     }
     return NULL;
@@ -37,7 +40,7 @@ main(void) {
     }
     for (int i = 0; i < 1024; i++) {
         fn f = {count};
-        ch_send(work_queue, f);
+        ch_send(work_queue, &f);
     }
     ch_close(work_queue);
     for (int i = 0; i < THREADC; i++) {
@@ -0,0 +1,113 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include "../channel.h"
+
+CHANNEL_EXTERN_DECL;
+
+#define THREADC 4
+#define LIM 10000
+
+typedef struct counts {
+    size_t allocs, frees, live;
+} counts;
+
+void *
+count_alloc(size_t size, void *ctx) {
+    counts *n = (counts *)ctx;
+    n->allocs++;
+    n->live += size;
+    return malloc(size);
+}
+
+void
+count_free(void *p, size_t size, void *ctx) {
+    counts *n = (counts *)ctx;
+    n->frees++;
+    n->live -= size;
+    free(p);
+}
+
+/* Request and reply channels that are made and dropped on every round. */
+void *
+churn(void *arg) {
+    (void)arg;
+    for (int i = 0; i < LIM; i++) {
+        channel *req = ch_make(int, 1), *rep = ch_make(int, 0);
+        assert(ch_send(req, &i) == CH_OK);
+        int j;
+        assert(ch_recv(req, &j) == CH_OK && j == i);
+        assert(ch_trysend(rep, &i) == CH_WBLOCK);
+        ch_drop(rep);
+        ch_drop(req);
+    }
+    return NULL;
+}
+
+/* Drops channels that another thread made, which only ever fills up this
+ * thread's free lists. */
+void *
+dropper(void *arg) {
+    channel **chans = (channel **)arg;
+    for (int i = 0; i < LIM; i++) {
+        ch_drop(chans[i]);
+        assert(channel_cache_.bytes <= CH_CACHE_BYTES_);
+    }
+    return NULL;
+}
+
+int
+main(void) {
+    /* Dropped channels are reused and come back as good as new. */
+    channel *chan = ch_make(int, 4);
+    for (int i = 0; i < 3; i++) {
+        assert(ch_send(chan, &i) == CH_OK);
+    }
+    ch_close(chan);
+    channel *prev = chan;
+    ch_drop(chan);
+    chan = ch_make(int, 4);
+    assert(chan == prev);
+    int i;
+    assert(ch_tryrecv(chan, &i) == CH_WBLOCK);
+    for (int i = 0; i < 4; i++) {
+        assert(ch_send(chan, &i) == CH_OK);
+    }
+    assert(ch_trysend(chan, &i) == CH_WBLOCK);
+    for (int i = 0, j; i < 4; i++) {
+        assert(ch_recv(chan, &j) == CH_OK && j == i);
+    }
+    ch_drop(chan);
+
+    /* Threads leave their free lists behind when they exit. */
+    pthread_t threads[THREADC];
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_create(threads + i, NULL, churn, NULL) == 0);
+    }
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    /* Free lists stay bounded when channels migrate between threads. */
+    channel **chans = malloc(LIM * sizeof(*chans));
+    for (int i = 0; i < LIM; i++) {
+        chans[i] = ch_make(int, i % 64);
+    }
+    assert(pthread_create(threads, NULL, dropper, chans) == 0);
+    assert(pthread_join(threads[0], NULL) == 0);
+    free(chans);
+
+    /* Every channel goes back to the allocator that it came from. */
+    counts n = {0};
+    channel_alloc alloc = {count_alloc, count_free, &n};
+    ch_setalloc(&alloc);
+    churn(NULL);
+    channel *big = ch_make(char[4096], 16);
+    assert(n.allocs == 2 * LIM + 1 && n.live > 16 * 4096);
+    ch_drop(big);
+    assert(n.frees == n.allocs && n.live == 0);
+    ch_setalloc(NULL);
+
+    printf("All tests passed\n");
+    return 0;
+}
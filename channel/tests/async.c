@@ -0,0 +1,125 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include "../channel.h"
+
+CHANNEL_EXTERN_DECL;
+
+#define THREADC 8
+#define LIM 100000ll
+
+typedef struct result {
+    _Atomic int calls;
+    _Atomic channel_rc rc;
+} result;
+
+void
+done(void *ctx, channel_rc rc) {
+    result *r = (result *)ctx;
+    atomic_store(&r->rc, rc);
+    atomic_fetch_add(&r->calls, 1);
+}
+
+/* Event loop style receiver that re-arms itself from its own callback. */
+typedef struct loop {
+    channel *c;
+    int msg;
+    long long sum;
+    _Atomic bool closed;
+} loop;
+
+void
+loop_recv(void *ctx, channel_rc rc) {
+    loop *l = (loop *)ctx;
+    while (rc == CH_OK) {
+        l->sum += l->msg;
+        rc = ch_recv_async(l->c, &l->msg, loop_recv, l);
+    }
+    if (rc == CH_CLOSED) {
+        atomic_store(&l->closed, true);
+    }
+}
+
+void *
+sender(void *arg) {
+    channel *c = (channel *)arg;
+    for (int i = 1; i <= LIM; i++) {
+        assert(ch_send(c, &i) == CH_OK);
+    }
+    return NULL;
+}
+
+void
+test_loop(size_t cap) {
+    loop l = {ch_make(int, cap), 0, 0, false};
+    loop_recv(&l, ch_recv_async(l.c, &l.msg, loop_recv, &l));
+    pthread_t pool[THREADC];
+    for (size_t i = 0; i < THREADC; i++) {
+        assert(pthread_create(pool + i, NULL, sender, l.c) == 0);
+    }
+    for (size_t i = 0; i < THREADC; i++) {
+        assert(pthread_join(pool[i], NULL) == 0);
+    }
+    ch_close(l.c);
+    while (!atomic_load(&l.closed)) {
+        sched_yield();
+    }
+    printf("%lld\n", l.sum);
+    assert(l.sum == ((LIM * (LIM + 1)) / 2) * THREADC);
+    ch_drop(l.c);
+}
+
+int
+main(void) {
+    int i, j;
+    result r = {0, 0}, r1 = {0, 0};
+
+    /* Buffered: the callback runs on whichever thread completes the
+     * operation, in this case the sender. */
+    channel *chan = ch_make(int, 1);
+    assert(ch_recv_async(chan, &i, done, &r) == CH_WBLOCK);
+    j = 1;
+    assert(ch_send(chan, &j) == CH_OK);
+    assert(atomic_load(&r.calls) == 1 && atomic_load(&r.rc) == CH_OK);
+    assert(i == 1);
+    /* Operations that can complete immediately do so without calling the
+     * callback. Sent messages are copied, so `j` may be reused right away. */
+    j = 2;
+    assert(ch_send_async(chan, &j, done, &r) == CH_OK);
+    j = 3;
+    assert(ch_send_async(chan, &j, done, &r) == CH_WBLOCK);
+    j = 4;
+    assert(ch_recv(chan, &i) == CH_OK && i == 2);
+    assert(atomic_load(&r.calls) == 2 && atomic_load(&r.rc) == CH_OK);
+    assert(ch_recv(chan, &i) == CH_OK && i == 3);
+    assert(ch_recv_async(chan, &i, done, &r1) == CH_WBLOCK);
+    ch_close(chan);
+    assert(atomic_load(&r1.calls) == 1 && atomic_load(&r1.rc) == CH_CLOSED);
+    assert(ch_send_async(chan, &j, done, &r) == CH_CLOSED);
+    ch_drop(chan);
+
+    /* Unbuffered */
+    atomic_store(&r.calls, 0);
+    atomic_store(&r1.calls, 0);
+    chan = ch_make(int, 0);
+    j = 5;
+    assert(ch_send_async(chan, &j, done, &r) == CH_WBLOCK);
+    assert(ch_recv(chan, &i) == CH_OK && i == 5);
+    assert(atomic_load(&r.calls) == 1 && atomic_load(&r.rc) == CH_OK);
+    assert(ch_recv_async(chan, &i, done, &r) == CH_WBLOCK);
+    j = 6;
+    assert(ch_send_async(chan, &j, done, &r1) == CH_OK);
+    assert(atomic_load(&r.calls) == 2 && atomic_load(&r.rc) == CH_OK);
+    assert(i == 6 && atomic_load(&r1.calls) == 0);
+    assert(ch_send_async(chan, &j, done, &r1) == CH_WBLOCK);
+    ch_close(chan);
+    assert(atomic_load(&r1.calls) == 1 && atomic_load(&r1.rc) == CH_CLOSED);
+    ch_drop(chan);
+
+    test_loop(0);
+    test_loop(4);
+
+    printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include "../channel.h"
+
+CHANNEL_EXTERN_DECL;
+
+#define THREADC 8
+#define ROUNDS 2000
+
+typedef struct waiter {
+    channel *c;
+    channel_token *t;
+    channel_op op;
+    bool alt;
+} waiter;
+
+double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *
+block(void *arg) {
+    waiter *w = (waiter *)arg;
+    int i = 0;
+    channel_rc rc;
+    if (w->alt) {
+        channel *never = ch_make(int, 0);
+        channel_case cases[] = {
+            {.c = never, .msg = &i, .op = CH_RECV},
+            {.c = w->c, .msg = &i, .op = w->op},
+        };
+        rc = ch_calt(cases, 2, w->t);
+        ch_drop(never);
+    } else if (w->op == CH_SEND) {
+        rc = ch_csend(w->c, &i, w->t);
+    } else {
+        rc = ch_crecv(w->c, &i, w->t);
+    }
+    return (void *)(intptr_t)rc;
+}
+
+typedef struct racer {
+    channel *c;
+    channel_token *t;
+    int received;
+    channel_rc rc;
+} racer;
+
+void *
+race(void *arg) {
+    racer *r = (racer *)arg;
+    r->rc = ch_crecv(r->c, &r->received, r->t);
+    return NULL;
+}
+
+void *
+cancel(void *arg) {
+    if (rand() % 2) {
+        sched_yield();
+    }
+    ch_cancel((channel_token *)arg);
+    return NULL;
+}
+
+/* A message is either received or left for someone else, never both. */
+void
+test_race(size_t cap) {
+    channel *chan = ch_make(int, cap);
+    for (int i = 1; i <= ROUNDS; i++) {
+        channel_token t;
+        ch_token_init(&t);
+        racer r = {.c = chan, .t = &t};
+        pthread_t threads[2];
+        assert(pthread_create(threads, NULL, race, &r) == 0);
+        assert(pthread_create(threads + 1, NULL, cancel, &t) == 0);
+        channel_rc sent = ch_timedsend(chan, &i, 100);
+        assert(pthread_join(threads[0], NULL) == 0);
+        assert(pthread_join(threads[1], NULL) == 0);
+        ch_token_destroy(&t);
+
+        int j;
+        if (r.rc == CH_OK) {
+            assert(sent == CH_OK && r.received == i);
+            assert(ch_tryrecv(chan, &j) == CH_WBLOCK);
+        } else {
+            assert(r.rc == CH_CANCELED);
+            assert(cap > 0 || sent == CH_WBLOCK);
+            if (sent == CH_OK) {
+                assert(ch_tryrecv(chan, &j) == CH_OK && j == i);
+            }
+        }
+    }
+    ch_drop(chan);
+}
+
+int
+main(void) {
+    srand(time(NULL));
+
+    channel_token t;
+    ch_token_init(&t);
+    channel *unbuf = ch_make(int, 0), *buf = ch_make(int, 1);
+    int i = 1;
+    assert(ch_csend(buf, &i, &t) == CH_OK);
+    assert(ch_timedcsend(buf, &i, 1000, &t) == CH_WBLOCK);
+    assert(ch_timedcrecv(unbuf, &i, 1000, &t) == CH_WBLOCK);
+
+    /* Only the operations registered on a token are woken. */
+    channel_token other;
+    ch_token_init(&other);
+    waiter ws[THREADC];
+    pthread_t threads[THREADC];
+    for (int i = 0; i < THREADC; i++) {
+        ws[i] = (waiter){
+            .c = i == 0 ? ch_dup(buf) : ch_make(int, i % 2),
+            .t = i == 0 ? &other : &t,
+            .op = i % 4 < 2 ? CH_SEND : CH_RECV,
+            .alt = i % 3 == 1,
+        };
+        if (i > 0 && ws[i].c->hdr.cap > 0 && ws[i].op == CH_SEND) {
+            assert(ch_send(ws[i].c, &i) == CH_OK); // Stays full
+        }
+        assert(pthread_create(threads + i, NULL, block, ws + i) == 0);
+    }
+    usleep(20000);
+    double start = now();
+    ch_cancel(&t);
+    for (int i = 1; i < THREADC; i++) {
+        void *rc;
+        assert(pthread_join(threads[i], &rc) == 0);
+        assert((channel_rc)(intptr_t)rc == CH_CANCELED);
+    }
+    assert(now() - start < 0.5);
+    assert(ch_canceled(&t) && !ch_canceled(&other));
+    assert(ch_crecv(buf, &i, &t) == CH_CANCELED);
+    ch_cancel(&t);
+
+    void *rc;
+    assert(ch_recv(buf, &i) == CH_OK);
+    assert(pthread_join(threads[0], &rc) == 0);
+    assert((channel_rc)(intptr_t)rc == CH_OK);
+    for (int i = 0; i < THREADC; i++) {
+        ch_drop(ws[i].c);
+    }
+    ch_token_destroy(&t);
+    ch_token_destroy(&other);
+    ch_drop(unbuf);
+    ch_drop(buf);
+
+    test_race(0);
+    test_race(1);
+    printf("All tests passed\n");
+    return 0;
+}
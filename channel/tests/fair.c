@@ -0,0 +1,163 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include "../channel.h"
+
+CHANNEL_EXTERN_DECL;
+
+#define THREADC 8
+#define LIM 20000
+
+typedef struct sender {
+    channel *c;
+    int id;
+} sender;
+
+void *
+send_id(void *arg) {
+    sender *s = (sender *)arg;
+    assert(ch_send(s->c, &s->id) == CH_OK);
+    return NULL;
+}
+
+void *
+recv_id(void *arg) {
+    int i;
+    assert(ch_recv((channel *)arg, &i) == CH_OK);
+    return (void *)(intptr_t)i;
+}
+
+/* Keeps trying to send until it gets in, which it can't while anyone is
+ * parked. */
+void *
+barge(void *arg) {
+    int i = THREADC;
+    while (ch_trysend((channel *)arg, &i) != CH_OK) {
+        sched_yield();
+    }
+    return NULL;
+}
+
+/* Waits until `n` operations are parked on `q`. */
+void
+await_parked(channel *c, channel_waiter_root_ *q, size_t n) {
+    for ( ; ; ) {
+        size_t len = 0;
+        ch_mutex_lock_(&c->buf.lock);
+        for (channel_waiter_ *w = ch_load_rlx_(&q->next);
+            &w->root != q; w = ch_load_rlx_(&w->root.next)) {
+            len++;
+        }
+        ch_mutex_unlock_(&c->buf.lock);
+        if (len == n) {
+            return;
+        }
+        sched_yield();
+    }
+}
+
+void *
+produce(void *arg) {
+    channel *chan = (channel *)arg;
+    for (int i = 1; i <= LIM; i++) {
+        if (i % 3 == 0) {
+            channel_case cases[] = {{.c = chan, .msg = &i, .op = CH_SEND}};
+            assert(ch_alt(cases, 1) == 0);
+        } else {
+            assert(ch_send(chan, &i) == CH_OK);
+        }
+    }
+    return NULL;
+}
+
+void *
+consume(void *arg) {
+    channel *chan = (channel *)arg;
+    long long sum = 0;
+    int i;
+    for (int n = 0; ; n++) {
+        if (n % 3 == 0) {
+            channel_case cases[] = {{.c = chan, .msg = &i, .op = CH_RECV}};
+            if (ch_alt(cases, 1) == CH_CLOSED) {
+                break;
+            }
+        } else if (ch_recv(chan, &i) != CH_OK) {
+            break;
+        }
+        sum += i;
+    }
+    return (void *)(intptr_t)sum;
+}
+
+int
+main(void) {
+    /* Parked senders get the slots in the order that they arrived in, even
+     * with a sender that keeps trying to barge in. */
+    channel *chan = ch_setfair(ch_make(int, 1));
+    int i = -1;
+    assert(ch_send(chan, &i) == CH_OK);
+    pthread_t threads[THREADC], barger;
+    sender senders[THREADC];
+    for (int i = 0; i < THREADC; i++) {
+        senders[i] = (sender){chan, i};
+        assert(pthread_create(threads + i, NULL, send_id, senders + i) == 0);
+        await_parked(chan, &chan->buf.sendq, i + 1);
+    }
+    assert(ch_trysend(chan, &i) == CH_WBLOCK);
+    assert(pthread_create(&barger, NULL, barge, chan) == 0);
+    usleep(5000);
+    for (int i = -1, j; i <= THREADC; i++) {
+        assert(ch_recv(chan, &j) == CH_OK && j == i);
+    }
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(pthread_join(barger, NULL) == 0);
+    assert(ch_maxwait(chan) >= 5000);
+    assert(ch_maxwait(chan) == 0);
+
+    /* And so do parked receivers. */
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_create(threads + i, NULL, recv_id, chan) == 0);
+        await_parked(chan, &chan->buf.recvq, i + 1);
+    }
+    for (int i = 0; i < THREADC; i++) {
+        assert(ch_send(chan, &i) == CH_OK);
+    }
+    for (int i = 0; i < THREADC; i++) {
+        void *j;
+        assert(pthread_join(threads[i], &j) == 0);
+        assert((intptr_t)j == i);
+    }
+    assert(ch_timedsend(chan, &i, 1000) == CH_OK);
+    assert(ch_timedsend(chan, &i, 1000) == CH_WBLOCK);
+    ch_drop(chan);
+
+    /* Nothing is lost or duplicated under contention. */
+    chan = ch_setfair(ch_make(int, 4));
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_create(
+            threads + i, NULL, i % 2 ? consume : produce, chan) == 0);
+    }
+    for (int i = 0; i < THREADC; i += 2) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    ch_close(chan);
+    long long sum = 0;
+    for (int i = 1; i < THREADC; i += 2) {
+        void *n;
+        assert(pthread_join(threads[i], &n) == 0);
+        sum += (intptr_t)n;
+    }
+    assert(sum == (long long)(THREADC / 2) * LIM * (LIM + 1) / 2);
+    ch_drop(chan);
+
+    /* Unbuffered channels track waits too. */
+    chan = ch_make(int, 0);
+    assert(ch_timedrecv(chan, &i, 2000) == CH_WBLOCK);
+    assert(ch_maxwait(chan) >= 1000);
+    ch_drop(chan);
+
+    printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,158 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include "../channel.h"
+
+CHANNEL_EXTERN_DECL;
+
+#define THREADC 4
+#define LIM 20000
+
+typedef struct request {
+    int i;
+    channel *reply;
+} request;
+
+void *
+serve(void *arg) {
+    channel *reqs = (channel *)arg;
+    request req;
+    while (ch_recv(reqs, &req) == CH_OK) {
+        int i = req.i * 2;
+        assert(ch_send(req.reply, &i) == CH_OK);
+        ch_drop(req.reply);
+    }
+    return NULL;
+}
+
+void *
+send_later(void *arg) {
+    usleep(10000);
+    int i = 7;
+    assert(ch_send((channel *)arg, &i) == CH_OK);
+    return NULL;
+}
+
+void *
+send_race(void *arg) {
+    int i = 1;
+    assert(ch_send((channel *)arg, &i) == CH_OK);
+    return NULL;
+}
+
+void *
+close_later(void *arg) {
+    usleep(10000);
+    ch_close((channel *)arg);
+    return NULL;
+}
+
+int freed;
+
+void
+count(void *msg) {
+    assert(*(int *)msg == 5);
+    freed++;
+}
+
+int
+main(void) {
+    /* One send and one receive. */
+    channel *chan = ch_oneshot(int);
+    int i = 5, j;
+    assert(ch_tryrecv(chan, &j) == CH_WBLOCK);
+    assert(ch_timedrecv(chan, &j, 1000) == CH_WBLOCK);
+    assert(ch_send(chan, &i) == CH_OK);
+    assert(ch_trysend(chan, &i) == CH_CLOSED);
+    assert(ch_recv(chan, &j) == CH_OK && j == 5);
+    assert(ch_tryrecv(chan, &j) == CH_CLOSED);
+    ch_drop(chan);
+
+    /* Parked receivers get the message handed to them. */
+    pthread_t thread;
+    chan = ch_oneshot(int);
+    assert(pthread_create(&thread, NULL, send_later, chan) == 0);
+    assert(ch_recv(chan, &j) == CH_OK && j == 7);
+    assert(pthread_join(thread, NULL) == 0);
+    ch_drop(chan);
+
+    /* Closing wakes the receiver but keeps a message that was sent. */
+    chan = ch_oneshot(int);
+    assert(pthread_create(&thread, NULL, close_later, chan) == 0);
+    assert(ch_recv(chan, &j) == CH_CLOSED);
+    assert(pthread_join(thread, NULL) == 0);
+    assert(ch_send(chan, &i) == CH_CLOSED);
+    ch_drop(chan);
+    chan = ch_oneshot(int);
+    assert(ch_send(chan, &i) == CH_OK);
+    ch_close(chan);
+    assert(ch_recv(chan, &j) == CH_OK && j == 5);
+    assert(ch_recv(chan, &j) == CH_CLOSED);
+    ch_drop(chan);
+    chan = ch_oneshot(int);
+    assert(ch_send(chan, &i) == CH_OK);
+    ch_fndrop(chan, count);
+    assert(freed == 1);
+
+    /* Oneshots work in alternations, and a message whose alternation was
+     * claimed by another case stays put. */
+    channel *never = ch_make(int, 0);
+    for (int n = 0; n < 1000; n++) {
+        channel *a = ch_oneshot(int), *b = ch_oneshot(int);
+        channel_case cases[] = {
+            {.c = never, .msg = &i, .op = CH_RECV},
+            {.c = a, .msg = &j, .op = CH_RECV},
+            {.c = b, .msg = &j, .op = CH_RECV},
+        };
+        pthread_t threads[2];
+        assert(pthread_create(threads, NULL, send_race, a) == 0);
+        assert(pthread_create(threads + 1, NULL, send_race, b) == 0);
+        size_t rc = ch_alt(cases, 3);
+        assert((rc == 1 || rc == 2) && j == 1);
+        assert(pthread_join(threads[0], NULL) == 0);
+        assert(pthread_join(threads[1], NULL) == 0);
+        assert(ch_tryrecv(cases[3 - rc].c, &j) == CH_OK && j == 1);
+        ch_drop(a);
+        ch_drop(b);
+    }
+    chan = ch_oneshot(int);
+    channel_case cases[] = {
+        {.c = never, .msg = &i, .op = CH_RECV},
+        {.c = chan, .msg = &j, .op = CH_RECV},
+    };
+    assert(ch_timedalt(cases, 2, 1000) == CH_WBLOCK);
+    channel_token t;
+    ch_token_init(&t);
+    assert(pthread_create(&thread, NULL, send_later, chan) == 0);
+    assert(ch_calt(cases, 2, &t) == 1 && j == 7);
+    assert(pthread_join(thread, NULL) == 0);
+    ch_drop(chan);
+    ch_cancel(&t);
+    chan = ch_oneshot(int);
+    assert(ch_crecv(chan, &j, &t) == CH_CANCELED);
+    ch_token_destroy(&t);
+    ch_drop(chan);
+    ch_drop(never);
+
+    /* Request and reply. */
+    channel *reqs = ch_make(request, 16);
+    pthread_t threads[THREADC];
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_create(threads + i, NULL, serve, reqs) == 0);
+    }
+    for (int i = 0; i < LIM; i++) {
+        request req = {i, ch_oneshot(int)};
+        ch_dup(req.reply);
+        assert(ch_send(reqs, &req) == CH_OK);
+        assert(ch_recv(req.reply, &j) == CH_OK && j == i * 2);
+        ch_drop(req.reply);
+    }
+    ch_close(reqs);
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    ch_drop(reqs);
+
+    printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include "../channel.h"
+
+CHANNEL_EXTERN_DECL;
+
+#define THREADC 4
+#define RATE 2000.0
+#define BURST 20
+#define LIM 100
+
+double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *
+sender(void *arg) {
+    channel *chan = (channel *)arg;
+    for (int i = 1; i <= LIM; i++) {
+        assert(ch_send(chan, &i) == CH_OK);
+    }
+    return NULL;
+}
+
+void *
+blocked(void *arg) {
+    int i = 0;
+    return (void *)(intptr_t)ch_send((channel *)arg, &i);
+}
+
+/* Senders share the bucket so the whole group is limited to the rate. */
+void
+test_rate(size_t cap) {
+    channel *chan = ch_setrate(ch_make(int, cap), RATE, BURST);
+    pthread_t threads[THREADC];
+    double start = now();
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_create(threads + i, NULL, sender, chan) == 0);
+    }
+    long long sum = 0;
+    for (int i = 0, j; i < THREADC * LIM; i++) {
+        assert(ch_recv(chan, &j) == CH_OK);
+        sum += j;
+    }
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    double elapsed = now() - start;
+    assert(sum == THREADC * (LIM * (LIM + 1)) / 2);
+    assert(elapsed >= (THREADC * LIM - BURST) / RATE * 0.95);
+    assert(elapsed < (THREADC * LIM) / RATE * 5);
+    ch_drop(chan);
+}
+
+int
+main(void) {
+    test_rate(0);
+    test_rate(1);
+    test_rate(THREADC * LIM);
+
+    /* Try and timed sends only take a turn that is close enough. */
+    channel *chan = ch_setrate(ch_make(int, 64), 100.0, 2);
+    int i = 0;
+    assert(ch_trysend(chan, &i) == CH_OK);
+    assert(ch_trysend(chan, &i) == CH_OK);
+    assert(ch_trysend(chan, &i) == CH_WBLOCK);
+    assert(ch_timedsend(chan, &i, 1000) == CH_WBLOCK);
+    double start = now();
+    assert(ch_timedsend(chan, &i, 50000) == CH_OK);
+    assert(now() - start > 0.005);
+
+    /* A full channel hands the turn back. */
+    channel *full = ch_setrate(ch_make(int, 1), 10.0, 2);
+    assert(ch_trysend(full, &i) == CH_OK);
+    assert(ch_trysend(full, &i) == CH_WBLOCK);
+    assert(ch_recv(full, &i) == CH_OK);
+    assert(ch_trysend(full, &i) == CH_OK);
+    ch_drop(full);
+
+    /* Closing wakes parked senders. */
+    ch_drop(chan);
+    chan = ch_setrate(ch_make(int, 64), 1.0, 1);
+    assert(ch_send(chan, &i) == CH_OK);
+    pthread_t threads[THREADC];
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_create(threads + i, NULL, blocked, chan) == 0);
+    }
+    usleep(10000);
+    start = now();
+    ch_close(chan);
+    for (int i = 0; i < THREADC; i++) {
+        void *rc;
+        assert(pthread_join(threads[i], &rc) == 0);
+        assert((channel_rc)(intptr_t)rc == CH_CLOSED);
+    }
+    assert(now() - start < 0.5);
+    assert(ch_send(chan, &i) == CH_CLOSED);
+    ch_drop(chan);
+
+    printf("All tests passed\n");
+    return 0;
+}
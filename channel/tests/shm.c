@@ -0,0 +1,139 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "../channel.h"
+
+CHANNEL_EXTERN_DECL;
+
+#define PROCC 4
+#define LIM 100000ll
+
+void
+produce(channel *chan) {
+    for (int i = 1; i <= LIM; i++) {
+        assert(ch_send(chan, &i) == CH_OK);
+    }
+    ch_close(chan);
+    ch_drop(chan);
+    exit(0);
+}
+
+long long
+consume(channel *chan) {
+    long long sum = 0;
+    int i;
+    for (unsigned n = 0; ; n++) {
+        channel_rc rc = n % 2 == 0 ?
+            ch_recv(chan, &i) : ch_timedrecv(chan, &i, 100);
+        if (rc == CH_CLOSED) {
+            break;
+        } else if (rc == CH_OK) {
+            sum += i;
+        }
+    }
+    return sum;
+}
+
+void
+join(pid_t pids[static PROCC]) {
+    for (int i = 0; i < PROCC; i++) {
+        int status;
+        assert(waitpid(pids[i], &status, 0) == pids[i]);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+}
+
+/* Waiting on a shared memory channel in an alternation fails an assertion,
+ * even while the channel is open. */
+void
+expect_abort(channel *chan, bool cancellable) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        assert(freopen("/dev/null", "w", stderr));
+        int i;
+        if (cancellable) {
+            channel_token t;
+            ch_token_init(&t);
+            ch_timedcrecv(chan, &i, 1000, &t);
+        } else {
+            channel_case cases[] = {{.c = chan, .msg = &i, .op = CH_RECV}};
+            ch_timedalt(cases, 1, 1000);
+        }
+        exit(0);
+    }
+    assert(pid > 0);
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+int
+main(void) {
+    /* Anonymous regions are shared with forked children. */
+    channel *chan = ch_shm_make(int, 16, NULL);
+    assert(chan);
+    pid_t pids[PROCC];
+    for (int i = 0; i < PROCC; i++) {
+        ch_open(chan);
+        if ((pids[i] = fork()) == 0) {
+            produce(chan);
+        }
+        assert(pids[i] > 0);
+    }
+    ch_close(chan);
+    long long sum = consume(chan);
+    join(pids);
+    printf("%lld\n", sum);
+    assert(sum == ((LIM * (LIM + 1)) / 2) * PROCC);
+    ch_drop(chan);
+
+    chan = ch_shm_make(int, 1, NULL);
+    assert(chan);
+    expect_abort(chan, false);
+    expect_abort(chan, true);
+    ch_drop(chan);
+
+    /* Named regions can be opened by unrelated processes. */
+    char name[64];
+    snprintf(name, sizeof(name), "/channel-test-%ld", (long)getpid());
+    chan = ch_shm_make(int, 1, name);
+    assert(chan && !ch_shm_make(int, 1, name) && errno == EEXIST);
+    int i = 0;
+    assert(ch_send(chan, &i) == CH_OK);
+    assert(ch_timedsend(chan, &i, 1000) == CH_WBLOCK);
+    assert(ch_recv(chan, &i) == CH_OK && i == 0);
+    for (int i = 0; i < PROCC; i++) {
+        if ((pids[i] = fork()) == 0) {
+            channel *chan1 = ch_shm_open(name);
+            assert(chan1);
+            produce(ch_open(chan1));
+        }
+        assert(pids[i] > 0);
+    }
+    sum = 0;
+    for (int n = 0; n < PROCC * LIM; n++) {
+        assert(ch_recv(chan, &i) == CH_OK);
+        sum += i;
+    }
+    join(pids);
+    assert(ch_tryrecv(chan, &i) == CH_WBLOCK);
+    ch_close(chan);
+    assert(ch_recv(chan, &i) == CH_CLOSED);
+    ch_drop(chan);
+    assert(shm_unlink(name) == 0);
+    assert(!ch_shm_open(name) && errno == ENOENT);
+
+    /* A region that its creator hasn't sized yet is empty. */
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    assert(fd >= 0 && close(fd) == 0);
+    errno = 0;
+    assert(!ch_shm_open(name) && errno == EINVAL);
+    assert(shm_unlink(name) == 0);
+    printf("%lld\n", sum);
+    assert(sum == ((LIM * (LIM + 1)) / 2) * PROCC);
+
+    printf("All tests passed\n");
+    return 0;
+}
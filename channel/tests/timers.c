@@ -0,0 +1,97 @@
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include "../channel.h"
+
+CHANNEL_EXTERN_DECL;
+
+#define TIMERC 5000
+#define SPREAD 100000 // Microseconds
+#define TICK 1000
+
+uint64_t
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int
+main(void) {
+    srand(time(NULL));
+
+    uint64_t start = now(), stamp;
+    channel *after = ch_after(20000);
+    assert(ch_recv(after, &stamp) == CH_OK);
+    assert(stamp >= start + 20000);
+    assert(ch_tryrecv(after, &stamp) == CH_WBLOCK);
+    ch_drop(after);
+
+    /* Lots of timers spread over several slots of the second level. Each
+     * one is due somewhere between `due[i]` and `due1[i]`, so one that is
+     * due a whole tick before another must not fire after it. */
+    channel **timers = malloc(TIMERC * sizeof(*timers));
+    uint64_t *due = malloc(TIMERC * sizeof(*due));
+    uint64_t *due1 = malloc(TIMERC * sizeof(*due1));
+    uint64_t *stamps = malloc(TIMERC * sizeof(*stamps));
+    for (size_t i = 0; i < TIMERC; i++) {
+        uint64_t timeout = (uint64_t)rand() % SPREAD;
+        due[i] = now() + timeout;
+        timers[i] = ch_after(timeout);
+        due1[i] = now() + timeout + TICK;
+    }
+    ch_drop(ch_after(SPREAD)); // Never received from
+    for (size_t i = 0; i < TIMERC; i++) {
+        assert(ch_recv(timers[i], stamps + i) == CH_OK);
+        assert(stamps[i] + 1 >= due[i]);
+        assert(ch_tryrecv(timers[i], &stamp) == CH_WBLOCK);
+        ch_drop(timers[i]);
+    }
+    for (size_t i = 0; i < TIMERC; i++) {
+        for (size_t j = 0; j < TIMERC; j++) {
+            assert(due1[i] + TICK > due[j] || stamps[i] <= stamps[j]);
+        }
+    }
+    free(timers);
+    free(due);
+    free(due1);
+    free(stamps);
+
+    /* Timers work as alternation cases. */
+    channel *never = ch_make(int, 0);
+    int i;
+    start = now();
+    after = ch_after(10000);
+    channel_case cases[] = {
+        {.c = never, .msg = &i, .op = CH_RECV},
+        {.c = after, .msg = &stamp, .op = CH_RECV},
+    };
+    assert(ch_alt(cases, 2) == 1);
+    assert(stamp >= start + 10000);
+    ch_drop(after);
+    ch_drop(never);
+
+    /* Tickers keep their phase and stop once closed. */
+    channel *ticker = ch_ticker(5000);
+    uint64_t prev = start = now();
+    for (int i = 0; i < 10; i++) {
+        assert(ch_recv(ticker, &stamp) == CH_OK);
+        assert(stamp >= prev);
+        prev = stamp;
+    }
+    assert(stamp >= start + 45000);
+
+    /* Only one tick is kept while nobody is receiving. The ticker is due
+     * before `after`, so by the time `after` fires it has ticked at least
+     * once more and no tick can come in once it is closed. */
+    after = ch_after(20000);
+    assert(ch_recv(after, &stamp) == CH_OK);
+    ch_drop(after);
+    ch_close(ticker);
+    assert(ch_tryrecv(ticker, &stamp) == CH_OK);
+    assert(ch_recv(ticker, &stamp) == CH_CLOSED);
+    ch_drop(ticker);
+
+    printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include "../channel.h"
+
+CHANNEL_EXTERN_DECL;
+
+#define THREADC 8
+#define LIM 20000ll
+
+channel *chans[2];
+
+void *
+sender(void *arg) {
+    int which = (int)(intptr_t)arg;
+    for (int i = 1; i <= LIM; ) {
+        if (which % 2 == 0) {
+            assert(ch_send(chans[which % 2], &i) == CH_OK);
+            i++;
+        } else if (ch_timedsend(chans[which % 2], &i, 50) == CH_OK) {
+            i++;
+        }
+    }
+    return NULL;
+}
+
+/* Mixes blocking, timed, and alternated receives. Every mode can make progress
+ * on both channels so receivers never get stuck behind one of them. */
+void *
+receiver(void *arg) {
+    (void)arg;
+    long long sum = 0;
+    int i, j;
+    channel_case cases[] = {
+        {.c = chans[0], .msg = &i, .op = CH_RECV},
+        {.c = chans[1], .msg = &j, .op = CH_RECV},
+    };
+    for (unsigned n = 0; ; n++) {
+        switch (n % 3) {
+        case 0:
+            switch (ch_alt(cases, 2)) {
+            case CH_CLOSED: goto done;
+            case 0: sum += i; break;
+            case 1: sum += j;
+            }
+            break;
+        case 1:
+            switch (ch_timedrecv(chans[1], &j, 50)) {
+            case CH_CLOSED: goto done;
+            case CH_OK: sum += j;
+            }
+            break;
+        case 2:
+            switch (ch_timedalt(cases, 2, 50)) {
+            case CH_CLOSED: goto done;
+            case CH_WBLOCK: break;
+            case 0: sum += i; break;
+            case 1: sum += j;
+            }
+        }
+    }
+done:;
+    long long *ret = malloc(sizeof(*ret));
+    *ret = sum;
+    return ret;
+}
+
+int
+main(void) {
+    srand(time(NULL));
+
+    chans[0] = ch_make(int, 0);
+    chans[1] = ch_make(int, 0);
+    pthread_t senders[THREADC], recvers[THREADC];
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_create(
+            senders + i, NULL, sender, (void *)(intptr_t)i) == 0);
+        assert(pthread_create(recvers + i, NULL, receiver, NULL) == 0);
+    }
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_join(senders[i], NULL) == 0);
+    }
+    ch_close(chans[0]);
+    ch_close(chans[1]);
+    long long sum = 0, *r;
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_join(recvers[i], (void **)&r) == 0);
+        sum += *r;
+        free(r);
+    }
+    printf("%lld\n", sum);
+    assert(sum == ((LIM * (LIM + 1)) / 2) * THREADC);
+    ch_drop(chans[0]);
+    ch_drop(chans[1]);
+
+    /* Closing wakes every blocked receiver. */
+    channel *chan = ch_make(int, 0);
+    chans[0] = chans[1] = chan;
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_create(recvers + i, NULL, receiver, NULL) == 0);
+    }
+    usleep(10000);
+    ch_close(chan);
+    for (int i = 0; i < THREADC; i++) {
+        assert(pthread_join(recvers[i], (void **)&r) == 0);
+        assert(*r == 0);
+        free(r);
+    }
+    ch_drop(chan);
+
+    printf("All tests passed\n");
+    return 0;
+}
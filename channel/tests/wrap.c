@@ -0,0 +1,99 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include "../channel.h"
+
+CHANNEL_EXTERN_DECL;
+
+#define THREADC 4
+#define LIM 50000
+
+/* Makes a channel whose laps are `laps` trips around the ring away from
+ * wrapping around. */
+channel *
+make_wrapping(size_t cap, uint32_t laps) {
+    channel *c = ch_make(int, cap);
+    uint32_t lap = (uint32_t)0 - 2 * laps;
+    ch_store_rlx_(&c->buf.write.u64, (uint64_t)lap << 32);
+    ch_store_rlx_(&c->buf.read.u64, (uint64_t)(lap + 1) << 32);
+    for (size_t i = 0; i < cap; i++) {
+        char *cell = c->buf.buf + (i * ch_cellsize_(sizeof(int)));
+        ch_store_rlx_(ch_cell_lap_(cell), lap);
+    }
+    return c;
+}
+
+void *
+produce(void *arg) {
+    channel *chan = (channel *)arg;
+    for (int i = 1; i <= LIM; i++) {
+        assert(ch_send(chan, &i) == CH_OK);
+    }
+    return NULL;
+}
+
+void *
+consume(void *arg) {
+    channel *chan = (channel *)arg;
+    long long sum = 0;
+    int i;
+    for (int n = 0; ; n++) {
+        if (n % 2) {
+            channel_case cases[] = {{.c = chan, .msg = &i, .op = CH_RECV}};
+            if (ch_alt(cases, 1) == CH_CLOSED) {
+                break;
+            }
+        } else if (ch_recv(chan, &i) != CH_OK) {
+            break;
+        }
+        sum += i;
+    }
+    return (void *)(intptr_t)sum;
+}
+
+int
+main(void) {
+    /* Full and empty are still told apart on either side of the wrap. */
+    for (uint32_t laps = 0; laps < 3; laps++) {
+        channel *chan = make_wrapping(2, laps);
+        for (int n = 0; n < 8; n++) {
+            int i = n, j;
+            assert(ch_tryrecv(chan, &j) == CH_WBLOCK);
+            assert(ch_trysend(chan, &i) == CH_OK);
+            assert(ch_trysend(chan, &i) == CH_OK);
+            assert(ch_trysend(chan, &i) == CH_WBLOCK);
+            channel_case cases[] = {{.c = chan, .msg = &i, .op = CH_SEND}};
+            assert(ch_tryalt(cases, 1) == CH_WBLOCK);
+            assert(ch_recv(chan, &j) == CH_OK && j == n);
+            assert(ch_recv(chan, &j) == CH_OK && j == n);
+        }
+        ch_drop(chan);
+    }
+
+    /* Blocking senders and receivers across the wrap. */
+    for (size_t cap = 1; cap <= 3; cap++) {
+        channel *chan = make_wrapping(cap, LIM / cap / 2);
+        pthread_t threads[THREADC];
+        for (int i = 0; i < THREADC; i++) {
+            assert(pthread_create(
+                threads + i, NULL, i % 2 ? consume : produce, chan) == 0);
+        }
+        for (int i = 0; i < THREADC; i += 2) {
+            assert(pthread_join(threads[i], NULL) == 0);
+        }
+        ch_close(chan);
+        long long sum = 0;
+        for (int i = 1; i < THREADC; i += 2) {
+            void *n;
+            assert(pthread_join(threads[i], &n) == 0);
+            sum += (intptr_t)n;
+        }
+        assert(sum == (long long)(THREADC / 2) * LIM * (LIM + 1) / 2);
+        channel_un64_ read = {ch_load_rlx_(&chan->buf.read.u64)};
+        assert(read.lap < UINT32_MAX / 2); // It did wrap around
+        ch_drop(chan);
+    }
+
+    printf("All tests passed\n");
+    return 0;
+}
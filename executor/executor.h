@@ -0,0 +1,433 @@
+/* executor.h v0.0.0
+ * Copyright 2018 iriri. All rights reserved. Use of this source code is
+ * governed by a BSD-style license which can be found in the LICENSE file.
+ *
+ * The work-stealing deque is based on "Correct and Efficient Work-Stealing for
+ * Weak Memory Models" by N.M. Lê, A. Pop, A. Cohen, and F. Zappa Nardelli,
+ * which is in turn based on "Dynamic Circular Work-Stealing Deque" by D. Chase
+ * and Y. Lev. */
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../channel/channel.h"
+
+/* ------------------------------- Interface ------------------------------- */
+#define EXECUTOR_H_VERSION 0l // 0.0.0
+
+typedef struct executor executor;
+typedef struct executor_task executor_task;
+typedef void (*executor_fn)(void *);
+
+/* Exported "functions" */
+#define ex_make(threadc) executor_make(threadc)
+#define ex_drop(ex) executor_drop(ex)
+
+#define ex_spawn(ex, fn, env) executor_spawn(ex, fn, env, sizeof(*env), false)
+#define ex_go(ex, fn, env) \
+    ((void)executor_spawn(ex, fn, env, sizeof(*env), true))
+#define ex_join(t, env) executor_join(t, env, sizeof(*env))
+#define ex_detach(t) executor_detach(t)
+
+/* These declarations must be present in exactly one compilation unit. Note
+ * that `CHANNEL_EXTERN_DECL` must also be present. */
+#define EXECUTOR_EXTERN_DECL \
+    _Thread_local executor_worker_ *executor_self_; \
+    extern inline void executor_assert_( \
+        const char *, unsigned, const char *) __attribute__((noreturn)); \
+    extern inline void executor_deque_init_(executor_deque_ *, size_t); \
+    extern inline void executor_deque_destroy_(executor_deque_ *); \
+    extern inline void executor_deque_push_( \
+        executor_deque_ *, executor_task *); \
+    extern inline executor_task *executor_deque_take_(executor_deque_ *); \
+    extern inline executor_task *executor_deque_steal_( \
+        executor_deque_ *, bool *); \
+    extern inline void executor_release_(executor_task *); \
+    extern inline void executor_run_(executor_task *); \
+    extern inline executor_task *executor_find_(executor_worker_ *); \
+    extern inline void *executor_worker_main_(void *); \
+    extern inline executor *executor_make(size_t); \
+    extern inline executor *executor_drop(executor *); \
+    extern inline executor_task *executor_spawn( \
+        executor *, executor_fn, void *, size_t, bool); \
+    extern inline void executor_join(executor_task *, void *, size_t); \
+    extern inline void executor_detach(executor_task *)
+
+/* ---------------------------- Implementation ---------------------------- */
+struct executor_task {
+    executor *ex;
+    executor_fn fn;
+    size_t envsize;
+    _Atomic uint32_t refc;
+    _Atomic bool done, joining;
+    alignas(max_align_t) char env[];
+};
+
+typedef struct executor_deque_buf_ {
+    struct executor_deque_buf_ *prev; // Retired buffers are freed on drop
+    size_t cap;
+    executor_task *_Atomic tasks[];
+} executor_deque_buf_;
+
+/* `top` and `bottom` are signed as `bottom` is allowed to briefly dip below
+ * `top` in `executor_deque_take_`. */
+typedef struct executor_deque_ {
+    _Atomic int64_t top;
+    char pad[64 - sizeof(int64_t)]; // Cache line padding
+    _Atomic int64_t bottom;
+    executor_deque_buf_ *_Atomic buf;
+    char pad1[64 - sizeof(int64_t) - sizeof(executor_deque_buf_ *)];
+} executor_deque_;
+
+typedef struct executor_worker_ {
+    executor_deque_ q;
+    executor *ex;
+    pthread_t thread;
+    uint64_t seed;
+} executor_worker_;
+
+struct executor {
+    channel *inject;
+    size_t threadc;
+    _Atomic size_t idlec;
+    pthread_mutex_t lock; // Only used by blocked joiners
+    pthread_cond_t cond;
+    executor_worker_ workers[];
+};
+
+extern _Thread_local executor_worker_ *executor_self_;
+
+#define EXECUTOR_INJECT_CAP_ 256
+#define EXECUTOR_DEQUE_CAP_ 64
+
+#define ex_load_rlx_(obj) atomic_load_explicit(obj, memory_order_relaxed)
+#define ex_load_acq_(obj) atomic_load_explicit(obj, memory_order_acquire)
+#define ex_load_seq_(obj) atomic_load_explicit(obj, memory_order_seq_cst)
+#define ex_store_rlx_(obj, des) \
+    atomic_store_explicit(obj, des, memory_order_relaxed)
+#define ex_store_rel_(obj, des) \
+    atomic_store_explicit(obj, des, memory_order_release)
+#define ex_store_seq_(obj, des) \
+    atomic_store_explicit(obj, des, memory_order_seq_cst)
+#define ex_faa_seq_(obj, arg) \
+    atomic_fetch_add_explicit(obj, arg, memory_order_seq_cst)
+#define ex_fas_rlx_(obj, arg) \
+    atomic_fetch_sub_explicit(obj, arg, memory_order_relaxed)
+#define ex_fas_acr_(obj, arg) \
+    atomic_fetch_sub_explicit(obj, arg, memory_order_acq_rel)
+#define ex_cas_s_seq_rlx_(obj, exp, des) \
+    atomic_compare_exchange_strong_explicit( \
+        obj, exp, des, memory_order_seq_cst, memory_order_relaxed)
+
+/* `ex_assert_` never becomes a noop, even when `NDEBUG` is set. */
+#define ex_assert_(pred) \
+    (__builtin_expect(!(pred), 0) ? \
+        executor_assert_(__FILE__, __LINE__, #pred) : (void)0)
+
+__attribute__((noreturn)) inline void
+executor_assert_(const char *file, unsigned line, const char *pred) {
+    fprintf(stderr, "Failed assertion: %s, %u, %s\n", file, line, pred);
+    abort();
+}
+
+inline void
+executor_deque_init_(executor_deque_ *q, size_t cap) {
+    executor_deque_buf_ *buf;
+    ex_assert_((buf = malloc(
+        offsetof(executor_deque_buf_, tasks) + (cap * sizeof(buf->tasks[0])))));
+    buf->prev = NULL;
+    buf->cap = cap;
+    ex_store_rlx_(&q->top, 0);
+    ex_store_rlx_(&q->bottom, 0);
+    ex_store_rlx_(&q->buf, buf);
+}
+
+inline void
+executor_deque_destroy_(executor_deque_ *q) {
+    executor_deque_buf_ *buf = ex_load_rlx_(&q->buf);
+    while (buf) {
+        executor_deque_buf_ *prev = buf->prev;
+        free(buf);
+        buf = prev;
+    }
+}
+
+/* Only ever called by the owner of the deque. The old buffer can't be freed
+ * when growing as a thief may still be reading from it. */
+inline void
+executor_deque_push_(executor_deque_ *q, executor_task *t) {
+    int64_t b = ex_load_rlx_(&q->bottom);
+    int64_t top = ex_load_acq_(&q->top);
+    executor_deque_buf_ *buf = ex_load_rlx_(&q->buf);
+    if ((size_t)(b - top) >= buf->cap) {
+        executor_deque_buf_ *buf1;
+        ex_assert_(buf->cap < SIZE_MAX / (2 * sizeof(buf->tasks[0])));
+        ex_assert_((buf1 = malloc(offsetof(executor_deque_buf_, tasks) +
+            (2 * buf->cap * sizeof(buf->tasks[0])))));
+        buf1->prev = buf;
+        buf1->cap = 2 * buf->cap;
+        for (int64_t i = top; i < b; i++) {
+            ex_store_rlx_(&buf1->tasks[i % buf1->cap],
+                ex_load_rlx_(&buf->tasks[i % buf->cap]));
+        }
+        ex_store_rel_(&q->buf, buf1);
+        buf = buf1;
+    }
+    ex_store_rlx_(&buf->tasks[b % buf->cap], t);
+    ex_store_rel_(&q->bottom, b + 1);
+}
+
+/* Only ever called by the owner of the deque. Pops from the bottom. */
+inline executor_task *
+executor_deque_take_(executor_deque_ *q) {
+    int64_t b = ex_load_rlx_(&q->bottom) - 1;
+    executor_deque_buf_ *buf = ex_load_rlx_(&q->buf);
+    ex_store_rlx_(&q->bottom, b);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = ex_load_rlx_(&q->top);
+    if (top > b) {
+        ex_store_rlx_(&q->bottom, b + 1);
+        return NULL;
+    }
+
+    executor_task *t = ex_load_rlx_(&buf->tasks[b % buf->cap]);
+    if (top == b) { // Last task, so race the thieves for it
+        if (!ex_cas_s_seq_rlx_(&q->top, &top, top + 1)) {
+            t = NULL;
+        }
+        ex_store_rlx_(&q->bottom, b + 1);
+    }
+    return t;
+}
+
+/* Steals from the top. Sets `contended` if the deque may not have been empty
+ * but another thread won the race for the task. */
+inline executor_task *
+executor_deque_steal_(executor_deque_ *q, bool *contended) {
+    int64_t top = ex_load_acq_(&q->top);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = ex_load_acq_(&q->bottom);
+    if (top >= b) {
+        return NULL;
+    }
+
+    executor_deque_buf_ *buf = ex_load_acq_(&q->buf);
+    executor_task *t = ex_load_rlx_(&buf->tasks[top % buf->cap]);
+    if (!ex_cas_s_seq_rlx_(&q->top, &top, top + 1)) {
+        *contended = true;
+        return NULL;
+    }
+    return t;
+}
+
+inline void
+executor_release_(executor_task *t) {
+    if (ex_fas_acr_(&t->refc, 1) == 1) {
+        free(t);
+    }
+}
+
+inline void
+executor_run_(executor_task *t) {
+    t->fn(t->env);
+    ex_store_seq_(&t->done, true);
+    if (ex_load_seq_(&t->joining)) {
+        pthread_mutex_lock(&t->ex->lock);
+        pthread_cond_broadcast(&t->ex->cond);
+        pthread_mutex_unlock(&t->ex->lock);
+    }
+    executor_release_(t);
+}
+
+/* Checks the local deque first, then the injection channel, and then tries to
+ * steal from the other workers, starting from a random victim. `NULL` messages
+ * on the injection channel are only used to wake idle workers. */
+inline executor_task *
+executor_find_(executor_worker_ *w) {
+    executor *ex = w->ex;
+    executor_task *t;
+    if ((t = executor_deque_take_(&w->q))) {
+        return t;
+    }
+    while (ch_tryrecv(ex->inject, &t) == CH_OK) {
+        if (t) {
+            return t;
+        }
+    }
+
+    for (int i = 0; i < 4; i++) {
+        bool contended = false;
+        w->seed ^= w->seed << 13;
+        w->seed ^= w->seed >> 7;
+        w->seed ^= w->seed << 17;
+        for (size_t j = 0, k = w->seed % ex->threadc; j < ex->threadc; j++) {
+            executor_worker_ *victim = ex->workers + ((j + k) % ex->threadc);
+            if (victim != w &&
+                (t = executor_deque_steal_(&victim->q, &contended))) {
+                return t;
+            }
+        }
+        if (!contended) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+inline void *
+executor_worker_main_(void *arg) {
+    executor_worker_ *w = (executor_worker_ *)arg;
+    executor *ex = w->ex;
+    executor_self_ = w;
+    for ( ; ; ) {
+        executor_task *t = executor_find_(w);
+        if (t) {
+            executor_run_(t);
+            continue;
+        }
+
+        /* Look once more after announcing that we're idle so that a spawn
+         * which missed the announcement is still picked up. */
+        ex_faa_seq_(&ex->idlec, 1);
+        channel_rc rc = CH_OK;
+        if (!(t = executor_find_(w))) {
+            rc = ch_recv(ex->inject, &t);
+        }
+        ex_fas_rlx_(&ex->idlec, 1);
+        if (rc == CH_CLOSED && !(t = executor_find_(w))) {
+            break;
+        }
+        if (t) {
+            executor_run_(t);
+        }
+    }
+    executor_self_ = NULL;
+    return NULL;
+}
+
+/* Allocates and initializes a new executor with `threadc` worker threads. */
+inline executor *
+executor_make(size_t threadc) {
+    executor *ex;
+    ex_assert_(0 < threadc && threadc < SIZE_MAX / sizeof(ex->workers[0]));
+    ex_assert_((ex = calloc(
+        1, offsetof(executor, workers) + (threadc * sizeof(ex->workers[0])))));
+    ex->inject = ch_make(executor_task *, EXECUTOR_INJECT_CAP_);
+    ex->threadc = threadc;
+    ex_store_rlx_(&ex->idlec, 0);
+    ex_assert_(pthread_mutex_init(&ex->lock, NULL) == 0);
+    ex_assert_(pthread_cond_init(&ex->cond, NULL) == 0);
+    for (size_t i = 0; i < threadc; i++) {
+        executor_worker_ *w = ex->workers + i;
+        executor_deque_init_(&w->q, EXECUTOR_DEQUE_CAP_);
+        w->ex = ex;
+        w->seed = (uint64_t)(uintptr_t)w | 1;
+    }
+    for (size_t i = 0; i < threadc; i++) {
+        executor_worker_ *w = ex->workers + i;
+        ex_assert_(pthread_create(
+            &w->thread, NULL, executor_worker_main_, w) == 0);
+    }
+    return ex;
+}
+
+/* Waits for all spawned tasks, including those spawned by other tasks, to
+ * complete and then deallocates all resources associated with the executor.
+ * Returns `NULL`. */
+inline executor *
+executor_drop(executor *ex) {
+    ch_close(ex->inject);
+    for (size_t i = 0; i < ex->threadc; i++) {
+        ex_assert_(pthread_join(ex->workers[i].thread, NULL) == 0);
+    }
+    for (size_t i = 0; i < ex->threadc; i++) {
+        executor_deque_destroy_(&ex->workers[i].q);
+    }
+    ex->inject = ch_drop(ex->inject);
+    pthread_cond_destroy(&ex->cond);
+    pthread_mutex_destroy(&ex->lock);
+    free(ex);
+    return NULL;
+}
+
+/* Copies `envsize` bytes of `env` into a new task and schedules `fn` to be run
+ * with a pointer to the copy. Tasks spawned from a worker go on that worker's
+ * deque. All others go through the injection channel, which blocks if it is
+ * full. Returns a handle that must be passed to either `executor_join` or
+ * `executor_detach` unless `detached` is set, in which case `NULL` is
+ * returned. */
+inline executor_task *
+executor_spawn(
+    executor *ex, executor_fn fn, void *env, size_t envsize, bool detached
+) {
+    executor_task *t;
+    ex_assert_(envsize < SIZE_MAX - sizeof(*t));
+    ex_assert_((t = malloc(sizeof(*t) + envsize)));
+    t->ex = ex;
+    t->fn = fn;
+    t->envsize = envsize;
+    ex_store_rlx_(&t->refc, detached ? 1 : 2);
+    ex_store_rlx_(&t->done, false);
+    ex_store_rlx_(&t->joining, false);
+    memcpy(t->env, env, envsize);
+
+    executor_worker_ *self = executor_self_;
+    if (self && self->ex == ex) {
+        executor_deque_push_(&self->q, t);
+        /* Pairs with the idle count increment in `executor_worker_main_` so
+         * that either the push is seen by its second look or the increment
+         * is seen here. The push is only a release store. */
+        atomic_thread_fence(memory_order_seq_cst);
+        if (ex_load_seq_(&ex->idlec) > 0) {
+            executor_task *nil = NULL;
+            ch_trysend(ex->inject, &nil);
+        }
+    } else {
+        ex_assert_(ch_send(ex->inject, &t) == CH_OK);
+    }
+    return detached ? NULL : t;
+}
+
+/* Waits for the task to complete, copies its environment back into `env`, and
+ * releases the handle. Workers of the same executor run other tasks while
+ * waiting instead of blocking so that tasks can safely join tasks that they
+ * spawned. */
+inline void
+executor_join(executor_task *t, void *env, size_t envsize) {
+    ex_assert_(envsize == t->envsize);
+    executor_worker_ *self = executor_self_;
+    if (self && self->ex == t->ex) {
+        while (!ex_load_acq_(&t->done)) {
+            executor_task *t1 = executor_find_(self);
+            if (t1) {
+                executor_run_(t1);
+            } else {
+                sched_yield();
+            }
+        }
+    } else if (!ex_load_acq_(&t->done)) {
+        ex_store_seq_(&t->joining, true);
+        pthread_mutex_lock(&t->ex->lock);
+        while (!ex_load_seq_(&t->done)) {
+            pthread_cond_wait(&t->ex->cond, &t->ex->lock);
+        }
+        pthread_mutex_unlock(&t->ex->lock);
+    }
+    memcpy(env, t->env, envsize);
+    executor_release_(t);
+}
+
+/* Releases the handle without waiting for the task to complete. */
+inline void
+executor_detach(executor_task *t) {
+    executor_release_(t);
+}
+#endif
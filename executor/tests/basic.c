@@ -0,0 +1,102 @@
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include "../executor.h"
+
+CHANNEL_EXTERN_DECL;
+EXECUTOR_EXTERN_DECL;
+
+#define THREADC 4
+
+struct square {
+    long in, out;
+};
+
+void
+square(void *arg) {
+    struct square *s = (struct square *)arg;
+    s->out = s->in * s->in;
+}
+
+struct fib {
+    executor *ex;
+    long n, out;
+};
+
+void
+fib(void *arg) {
+    struct fib *f = (struct fib *)arg;
+    if (f->n < 2) {
+        f->out = f->n;
+        return;
+    }
+    struct fib f1 = {f->ex, f->n - 1, 0}, f2 = {f->ex, f->n - 2, 0};
+    executor_task *t = ex_spawn(f->ex, fib, &f1);
+    fib(&f2);
+    ex_join(t, &f1);
+    f->out = f1.out + f2.out;
+}
+
+_Atomic long total;
+
+void
+add(void *arg) {
+    atomic_fetch_add_explicit(&total, *(long *)arg, memory_order_relaxed);
+}
+
+struct fanout {
+    executor *ex;
+    long n;
+};
+
+void
+fanout(void *arg) {
+    struct fanout *f = (struct fanout *)arg;
+    for (long i = 1; i <= f->n; i++) {
+        ex_go(f->ex, add, &i);
+    }
+}
+
+int
+main(void) {
+    executor *ex = ex_make(THREADC);
+
+    /* Tasks own a copy of their environment which is copied back out on
+     * join. */
+    executor_task *tasks[1000];
+    for (long i = 0; i < 1000; i++) {
+        struct square s = {i, 0};
+        tasks[i] = ex_spawn(ex, square, &s);
+    }
+    for (long i = 0; i < 1000; i++) {
+        struct square s;
+        ex_join(tasks[i], &s);
+        assert(s.in == i && s.out == i * i);
+    }
+
+    /* Joining from within a task runs other tasks instead of blocking. */
+    struct fib f = {ex, 24, 0};
+    ex_join(ex_spawn(ex, fib, &f), &f);
+    printf("%ld\n", f.out);
+    assert(f.out == 46368);
+
+    struct square s = {3, 0};
+    ex_detach(ex_spawn(ex, square, &s));
+
+    /* Spawning from a task goes through its worker's deque, which grows past
+     * its initial capacity here. */
+    struct fanout fo = {ex, 100000};
+    ex_go(ex, fanout, &fo);
+    for (long i = 1; i <= 1000; i++) {
+        ex_go(ex, add, &i);
+    }
+
+    /* Dropping waits for every task, including those spawned by tasks. */
+    ex = ex_drop(ex);
+    long sum = atomic_load(&total);
+    printf("%ld\n", sum);
+    assert(sum == ((100000l * 100001l) / 2) + ((1000l * 1001l) / 2));
+
+    printf("All tests passed\n");
+    return 0;
+}
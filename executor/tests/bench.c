@@ -0,0 +1,117 @@
+/* Compares the executor against the naive pool from
+ * `channel/examples/pool.c`, in which every worker contends on a single
+ * `ch_recv`, on a workload of many tiny tasks. */
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+#include "../executor.h"
+
+CHANNEL_EXTERN_DECL;
+EXECUTOR_EXTERN_DECL;
+
+#define POOL_THREADC 128
+#define THREADC 8
+#define TASKC 1000000l
+#define FANOUT 1000l
+
+_Atomic long total;
+
+void
+work(void *arg) {
+    atomic_fetch_add_explicit(&total, *(long *)arg, memory_order_relaxed);
+}
+
+double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+struct closure {
+    executor_fn fn;
+    long arg;
+};
+
+void *
+pool_worker(void *arg) {
+    channel *c = (channel *)arg;
+    struct closure cl;
+    while (ch_recv(c, &cl) == CH_OK) {
+        cl.fn(&cl.arg);
+    }
+    return NULL;
+}
+
+double
+bench_pool(void) {
+    pthread_t pool[POOL_THREADC];
+    channel *work_queue = ch_make(struct closure, 16);
+    double start = now();
+    for (int i = 0; i < POOL_THREADC; i++) {
+        assert(pthread_create(pool + i, NULL, pool_worker, work_queue) == 0);
+    }
+    for (long i = 0; i < TASKC; i++) {
+        struct closure cl = {work, 1};
+        assert(ch_send(work_queue, &cl) == CH_OK);
+    }
+    ch_close(work_queue);
+    for (int i = 0; i < POOL_THREADC; i++) {
+        assert(pthread_join(pool[i], NULL) == 0);
+    }
+    ch_drop(work_queue);
+    return now() - start;
+}
+
+double
+bench_executor(void) {
+    double start = now();
+    executor *ex = ex_make(THREADC);
+    for (long i = 0; i < TASKC; i++) {
+        long one = 1;
+        ex_go(ex, work, &one);
+    }
+    ex_drop(ex);
+    return now() - start;
+}
+
+struct fanout {
+    executor *ex;
+};
+
+void
+fanout(void *arg) {
+    struct fanout *f = (struct fanout *)arg;
+    for (long i = 0; i < FANOUT; i++) {
+        long one = 1;
+        ex_go(f->ex, work, &one);
+    }
+}
+
+double
+bench_executor_fanout(void) {
+    double start = now();
+    executor *ex = ex_make(THREADC);
+    struct fanout f = {ex};
+    for (long i = 0; i < TASKC / FANOUT; i++) {
+        ex_go(ex, fanout, &f);
+    }
+    ex_drop(ex);
+    return now() - start;
+}
+
+int
+main(void) {
+    double t = bench_pool();
+    assert(atomic_exchange(&total, 0) == TASKC);
+    printf("naive pool, %d threads: %.3fs\n", POOL_THREADC, t);
+    t = bench_executor();
+    assert(atomic_exchange(&total, 0) == TASKC);
+    printf("executor, %d threads, injected: %.3fs\n", THREADC, t);
+    t = bench_executor_fanout();
+    assert(atomic_exchange(&total, 0) == TASKC);
+    printf("executor, %d threads, spawned by tasks: %.3fs\n", THREADC, t);
+    return 0;
+}
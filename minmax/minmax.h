@@ -7,7 +7,6 @@
  * Sack, N. Santoro, and T. Strothott. */
 #ifndef MINMAX_H
 #define MINMAX_H
-#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -25,13 +24,32 @@ typedef int (*minmax_cmpfn)(void *restrict, void *restrict);
 #define mm_drop(m) minmax_drop(m)
 #define mm_fromarr(T, len, cap, cmpfn, arr) \
     minmax_fromarr(sizeof(T), len, cap, cmpfn, arr)
+#define mm_make_keyed(T, cap, offset, K) \
+    minmax_make_keyed(sizeof(T), cap, offset, sizeof(K), mm_keykind_(K))
+#define mm_fromarr_keyed(T, len, cap, offset, K, arr) \
+    minmax_fromarr_keyed( \
+        sizeof(T), len, cap, offset, sizeof(K), mm_keykind_(K), arr)
 #define mm_shrink(m) minmax_shrink(m)
+#define mm_addressable(m) minmax_addressable(m)
+#define mm_at(m, T, handle) ((T *)minmax_at(m, sizeof(T), handle))
+#define mm_update(m, handle) minmax_update(m, handle)
+#define mm_remove(m, handle) minmax_remove(m, handle)
 
 #define mm_len(m) ((m)->len)
 
 /* `__COUNTER__`, unfortunately, is an extension. `__LINE__` is mostly good
  * enough except when nesting similar macros in one another. */
 #define mm_insert(m, T, elt) mm_insert_(m, T, elt, __LINE__)
+#define mm_inserth(m, T, elt, handle) \
+    mm_inserth_(m, T, elt, handle, __LINE__)
+#define mm_insertn(m, T, arr, n) ( \
+    mm_assert_(sizeof(T) == sizeof(*(arr))), \
+    minmax_insertn(m, sizeof(T), arr, n, NULL) \
+)
+#define mm_insertnh(m, T, arr, n, handles) ( \
+    mm_assert_(sizeof(T) == sizeof(*(arr))), \
+    minmax_insertn(m, sizeof(T), arr, n, handles) \
+)
 
 #define mm_peekmin(m, T, elt) ( \
     mm_assert_(sizeof(T) == sizeof(*elt)), \
@@ -49,6 +67,26 @@ typedef int (*minmax_cmpfn)(void *restrict, void *restrict);
     mm_assert_(sizeof(T) == sizeof(*elt)), \
     minmax_peekmax(m, sizeof(T), elt, true) \
 )
+#define mm_peekminn(m, T, elts, k) ( \
+    mm_assert_(sizeof(T) == sizeof(*(elts))), \
+    minmax_peekminn(m, sizeof(T), elts, k, false) \
+)
+#define mm_pollminn(m, T, elts, k) ( \
+    mm_assert_(sizeof(T) == sizeof(*(elts))), \
+    minmax_peekminn(m, sizeof(T), elts, k, true) \
+)
+#define mm_peekmaxn(m, T, elts, k) ( \
+    mm_assert_(sizeof(T) == sizeof(*(elts))), \
+    minmax_peekmaxn(m, sizeof(T), elts, k, false) \
+)
+#define mm_pollmaxn(m, T, elts, k) ( \
+    mm_assert_(sizeof(T) == sizeof(*(elts))), \
+    minmax_peekmaxn(m, sizeof(T), elts, k, true) \
+)
+
+/* Heaps specialized for a type and comparison are defined with
+ * `MINMAX_DEFINE(name, T, less)`, which is further down as it expands to
+ * implementation details. */
 
 /* These declarations must be present in exactly one compilation unit. */
 #define MINMAX_EXTERN_DECL \
@@ -56,33 +94,113 @@ typedef int (*minmax_cmpfn)(void *restrict, void *restrict);
         const char *, unsigned, const char *) __attribute__((noreturn)); \
     extern inline minmax *minmax_make( \
         size_t, size_t, minmax_cmpfn); \
+    extern inline minmax *minmax_keyed_( \
+        minmax *, size_t, size_t, unsigned); \
+    extern inline minmax *minmax_make_keyed( \
+        size_t, size_t, size_t, size_t, unsigned); \
+    extern inline minmax *minmax_addressable(minmax *); \
     extern inline minmax *minmax_drop(minmax *); \
     extern inline void minmax_shrink(minmax *); \
+    extern inline void minmax_reserve_(minmax *, size_t, size_t); \
+    extern inline size_t minmax_handle_(minmax *, size_t); \
+    extern inline void minmax_release_(minmax *, size_t); \
     extern inline void *minmax_push_(minmax *, size_t); \
+    extern inline uint64_t minmax_key_(minmax *, const char *); \
     extern inline size_t minmax_parent_(size_t); \
     extern inline bool minmax_level_type_max_(size_t); \
-    extern inline void minmax_swap_elts_( \
-        void *restrict, void *restrict, size_t); \
-    extern inline void minmax_bubble_up_min_(minmax *, size_t, size_t); \
-    extern inline void minmax_bubble_up_max_(minmax *, size_t, size_t); \
+    extern inline int minmax_cmp_(minmax *, size_t, size_t, bool, size_t); \
+    extern inline void minmax_move_(minmax *, size_t, size_t, bool, size_t); \
+    extern inline int minmax_cmp_held_( \
+        minmax *, size_t, void *, uint64_t, bool, size_t); \
+    extern inline uint64_t minmax_hold_( \
+        minmax *, size_t, void *, bool, size_t); \
+    extern inline void minmax_place_( \
+        minmax *, size_t, void *, uint64_t, bool, size_t); \
+    extern inline void minmax_bubble_up_min_( \
+        minmax *, size_t, void *, uint64_t, bool, size_t); \
+    extern inline void minmax_bubble_up_max_( \
+        minmax *, size_t, void *, uint64_t, bool, size_t); \
+    extern inline void minmax_bubble_up_as_(minmax *, size_t, bool, size_t); \
     extern inline void minmax_bubble_up_(minmax *, size_t, size_t); \
+    extern inline size_t minmax_insert_(minmax *, size_t, size_t); \
     extern inline size_t minmax_child_(size_t); \
-    extern inline void minmax_trickle_down_min_(minmax *, size_t, size_t); \
-    extern inline void minmax_trickle_down_max_(minmax *, size_t, size_t); \
-    extern inline void minmax_trickle_down_(minmax *, size_t, size_t); \
+    extern inline size_t minmax_pick_( \
+        const uint64_t *, size_t, size_t, bool); \
+    extern inline size_t minmax_select_keys_( \
+        const uint64_t *, size_t, size_t, bool); \
+    extern inline void minmax_prefetch_(const uint64_t *, size_t, size_t); \
+    extern inline void minmax_trickle_down_min_( \
+        minmax *, size_t, size_t, bool, size_t); \
+    extern inline void minmax_trickle_down_max_( \
+        minmax *, size_t, size_t, bool, size_t); \
+    extern inline void minmax_trickle_down_as_( \
+        minmax *, size_t, size_t, bool, size_t); \
+    extern inline void minmax_trickle_down_( \
+        minmax *, size_t, size_t, size_t); \
+    extern inline void minmax_heapify_(minmax *, size_t, size_t); \
     extern inline minmax *minmax_fromarr( \
         size_t, size_t, size_t, minmax_cmpfn, void *); \
+    extern inline minmax *minmax_fromarr_keyed( \
+        size_t, size_t, size_t, size_t, size_t, unsigned, void *); \
+    extern inline void minmax_insertn( \
+        minmax *, size_t, const void *, size_t, size_t *); \
+    extern inline bool minmax_before_( \
+        minmax *, size_t, size_t, bool, bool, size_t); \
+    extern inline void minmax_delete_(minmax *, size_t, bool, size_t); \
+    extern inline void minmax_poll_keyed_(minmax *, size_t, bool, size_t); \
+    extern inline void minmax_poll_(minmax *, size_t, bool, size_t); \
+    extern inline size_t minmax_maxindex_(minmax *, size_t); \
     extern inline bool minmax_peekmin(minmax *, size_t, void *, bool); \
-    extern inline bool minmax_peekmax(minmax *, size_t, void *, bool)
+    extern inline bool minmax_peekmax(minmax *, size_t, void *, bool); \
+    extern inline void minmax_cand_push_( \
+        minmax *, size_t *, size_t, size_t, bool, size_t); \
+    extern inline void minmax_cand_pop_( \
+        minmax *, size_t *, size_t, bool, size_t); \
+    extern inline void minmax_select_( \
+        minmax *, size_t, bool, size_t *, size_t *, size_t); \
+    extern inline size_t minmax_peekn_( \
+        minmax *, size_t, void *, size_t, bool, bool); \
+    extern inline size_t minmax_peekminn( \
+        minmax *, size_t, void *, size_t, bool); \
+    extern inline size_t minmax_peekmaxn( \
+        minmax *, size_t, void *, size_t, bool); \
+    extern inline size_t minmax_index_(minmax *, size_t); \
+    extern inline void *minmax_at(minmax *, size_t, size_t); \
+    extern inline void minmax_fix_(minmax *, size_t, size_t); \
+    extern inline void minmax_update(minmax *, size_t); \
+    extern inline void minmax_remove(minmax *, size_t)
 
 /* ---------------------------- Implementation ---------------------------- */
+/* Keyed heaps keep the key of every element in `keys`, at the same index as
+ * the element, and compare those instead of calling `cmpfn`. Keys are stored
+ * as unsigned integers that sort in the same order as the original keys, so
+ * comparisons don't look at the elements at all.
+ *
+ * Addressable heaps likewise keep the handle of every element in `handles`.
+ * `pos` maps each of the `hlen` handles handed out so far to the index of its
+ * element, or, once its element is gone, to the next free handle after it,
+ * starting from `hfree`. Handles are reused before new ones are handed out,
+ * so `pos` only grows as large as the heap has been. */
 struct minmax {
     char *heap;
     size_t eltsize, len, cap;
-    /* Is this a good idea? Could do offset + keylen instead. */
     minmax_cmpfn cmpfn;
+    uint64_t *keys;
+    size_t keyoff;
+    unsigned keysize, keykind;
+    size_t *handles, *pos;
+    size_t hlen, hcap, hfree;
 };
 
+#define MINMAX_UNSIGNED_ 0u
+#define MINMAX_SIGNED_ 1u
+#define MINMAX_FLOAT_ 2u
+
+/* Works out what kind of arithmetic type `K` is without `_Generic`. */
+#define mm_keykind_(K) \
+    ((K)0.5 != 0 ? MINMAX_FLOAT_ : \
+        (K)-1 < (K)1 ? MINMAX_SIGNED_ : MINMAX_UNSIGNED_)
+
 /* Almost hygenic... */
 #define mm_sym_(sym, id) MM_##sym##id##_
 
@@ -91,7 +209,16 @@ struct minmax {
         mm_assert_(sizeof(T) == sizeof(elt)); \
         minmax *mm_sym_(m, id) = m; \
         *(T *)minmax_push_(mm_sym_(m, id), sizeof(T)) = elt; \
-        minmax_bubble_up_(mm_sym_(m, id), mm_sym_(m, id)->len++, sizeof(T)); \
+        minmax_insert_(mm_sym_(m, id), mm_sym_(m, id)->len++, sizeof(T)); \
+    } while (0)
+
+#define mm_inserth_(m, T, elt, handle, id) \
+    do { \
+        mm_assert_(sizeof(T) == sizeof(elt)); \
+        minmax *mm_sym_(m, id) = m; \
+        *(T *)minmax_push_(mm_sym_(m, id), sizeof(T)) = elt; \
+        *(handle) = minmax_insert_( \
+            mm_sym_(m, id), mm_sym_(m, id)->len++, sizeof(T)); \
     } while (0)
 
 /* `mm_assert_` never becomes a noop, even when `NDEBUG` is set. */
@@ -116,42 +243,160 @@ minmax_make(size_t eltsize, size_t cap, minmax_cmpfn cmpfn) {
     mm_assert_(0 < cap && cap < SIZE_MAX / eltsize);
     minmax *m = malloc(sizeof(*m));
     mm_assert_(m);
-    *m = (minmax) {malloc(cap * eltsize), eltsize, 0, cap, cmpfn};
+    *m = (minmax) {
+        .heap = malloc(cap * eltsize), .eltsize = eltsize, .cap = cap,
+        .cmpfn = cmpfn,
+    };
     mm_assert_(m->heap);
     return m;
 }
 
+inline minmax *
+minmax_keyed_(minmax *m, size_t keyoff, size_t keysize, unsigned keykind) {
+    mm_assert_(keysize <= m->eltsize && keyoff <= m->eltsize - keysize);
+    mm_assert_(keykind == MINMAX_FLOAT_ ?
+        keysize == 4 || keysize == 8 :
+        keysize == 1 || keysize == 2 || keysize == 4 || keysize == 8);
+    mm_assert_((m->keys = malloc(m->cap * sizeof(*m->keys))));
+    m->keyoff = keyoff;
+    m->keysize = keysize;
+    m->keykind = keykind;
+    return m;
+}
+
+/* Allocates and initializes a new min-max heap that orders its elements by
+ * the integer or floating point key of size `keysize` at offset `keyoff`. */
+inline minmax *
+minmax_make_keyed(
+    size_t eltsize, size_t cap, size_t keyoff, size_t keysize, unsigned keykind
+) {
+    return minmax_keyed_(
+        minmax_make(eltsize, cap, NULL), keyoff, keysize, keykind);
+}
+
+/* Makes the elements of an empty heap addressable through handles that are
+ * given out as they are inserted and stay the same as they move around. */
+inline minmax *
+minmax_addressable(minmax *m) {
+    mm_assert_(m->len == 0 && !m->handles);
+    mm_assert_((m->handles = malloc(m->cap * sizeof(*m->handles))));
+    mm_assert_((m->pos = malloc(m->cap * sizeof(*m->pos))));
+    m->hcap = m->cap;
+    m->hfree = SIZE_MAX;
+    return m;
+}
+
 /* Deallocates all resources associated with the heap and returns `NULL`. */
 inline minmax *
 minmax_drop(minmax *m) {
     free(m->heap);
+    free(m->keys);
+    free(m->handles);
+    free(m->pos);
     free(m);
     return NULL;
 }
 
-/* Shrinks the allocation of the heap to twice its length if it is currently
- * more than 75% empty. Does nothing otherwise. This is the only way to shrink
- * the allocation of the heap--it never shrinks itself automatically. */
+/* Shrinks the allocation of the heap to twice its length, or to room for one
+ * element if it is empty, if it is currently more than 75% empty. Does nothing
+ * otherwise. This is the only way to shrink the allocation of the heap--it
+ * never shrinks itself automatically. */
 inline void
 minmax_shrink(minmax *m) {
     if (m->len * 4 > m->cap) {
         return;
     }
-    mm_assert_((m->heap = realloc(
-        m->heap, (m->cap = 2 * m->len) * m->eltsize)));
+    m->cap = m->len > 0 ? 2 * m->len : 1;
+    mm_assert_((m->heap = realloc(m->heap, m->cap * m->eltsize)));
+    if (m->keys) {
+        mm_assert_((m->keys = realloc(m->keys, m->cap * sizeof(*m->keys))));
+    }
+    if (m->handles) {
+        mm_assert_((m->handles = realloc(
+            m->handles, m->cap * sizeof(*m->handles))));
+    }
 }
 
-inline void *
-minmax_push_(minmax *m, size_t eltsize) {
-    mm_assert_(eltsize == m->eltsize);
-    if (m->len == m->cap) {
+/* Makes room for `n` more elements, doubling the capacity as many times as
+ * needed but only reallocating once. */
+inline void
+minmax_reserve_(minmax *m, size_t n, size_t eltsize) {
+    if (m->cap - m->len >= n) {
+        return;
+    }
+    mm_assert_(n <= SIZE_MAX - m->len);
+    while (m->cap < m->len + n) {
         mm_assert_(m->cap < SIZE_MAX - m->cap &&
             (m->cap *= 2) < SIZE_MAX / eltsize);
-        mm_assert_((m->heap = realloc(m->heap, m->cap * eltsize)));
     }
+    mm_assert_((m->heap = realloc(m->heap, m->cap * eltsize)));
+    if (m->keys) {
+        mm_assert_((m->keys = realloc(m->keys, m->cap * sizeof(*m->keys))));
+    }
+    if (m->handles) {
+        mm_assert_((m->handles = realloc(
+            m->handles, m->cap * sizeof(*m->handles))));
+    }
+}
+
+/* Hands the element at `index` the most recently freed handle, or a new one
+ * if there are none. */
+inline size_t
+minmax_handle_(minmax *m, size_t index) {
+    size_t handle = m->hfree;
+    if (handle != SIZE_MAX) {
+        m->hfree = m->pos[handle];
+    } else {
+        if (m->hlen == m->hcap) {
+            mm_assert_(m->hcap < SIZE_MAX / 2 / sizeof(*m->pos));
+            mm_assert_((m->pos = realloc(
+                m->pos, (m->hcap *= 2) * sizeof(*m->pos))));
+        }
+        handle = m->hlen++;
+    }
+    m->handles[index] = handle;
+    m->pos[handle] = index;
+    return handle;
+}
+
+inline void
+minmax_release_(minmax *m, size_t handle) {
+    m->pos[handle] = m->hfree;
+    m->hfree = handle;
+}
+
+inline void *
+minmax_push_(minmax *m, size_t eltsize) {
+    mm_assert_(eltsize == m->eltsize);
+    minmax_reserve_(m, 1, eltsize);
     return mm_elt_(m->len);
 }
 
+/* Reads the key of `elt` and flips its bits around so that unsigned integer
+ * comparison puts it in the right order. Signed keys have their sign bit
+ * flipped. Negative floating point keys have all of their bits flipped, and
+ * the rest just their sign bit, which leaves NaNs at either end. */
+inline uint64_t
+minmax_key_(minmax *m, const char *elt) {
+    const char *key = elt + m->keyoff;
+    uint64_t u;
+    uint32_t u32;
+    uint16_t u16;
+    uint8_t u8;
+    switch (m->keysize) {
+    case 1: memcpy(&u8, key, 1); u = u8; break;
+    case 2: memcpy(&u16, key, 2); u = u16; break;
+    case 4: memcpy(&u32, key, 4); u = u32; break;
+    default: memcpy(&u, key, 8);
+    }
+    uint64_t sign = (uint64_t)1 << (m->keysize * 8 - 1);
+    switch (m->keykind) {
+    case MINMAX_SIGNED_: return u ^ sign;
+    case MINMAX_FLOAT_: return u & sign ? ~u & (sign | (sign - 1)) : u | sign;
+    default: return u;
+    }
+}
+
 inline size_t
 minmax_parent_(size_t index) {
     if (index == 0 || index == SIZE_MAX) {
@@ -160,67 +405,159 @@ minmax_parent_(size_t index) {
     return (index - 1) / 2;
 }
 
+/* The level of an index is the position of the highest set bit of
+ * `index + 1`. Sifting moves two levels at a time, so this only has to be
+ * worked out where an operation starts and not at all for polls, which are
+ * told whether they remove the minimum or the maximum. */
 inline bool
 minmax_level_type_max_(size_t index) {
-    return (unsigned)(log2(index + 1)) % 2; // Is this okay lol
+    return (unsigned)(63 - __builtin_clzll((unsigned long long)index + 1)) % 2;
+}
+
+/* The helpers that might look at keys are told whether the heap is keyed by
+ * their callers. The sifting loops below are inlined once for keyed heaps and
+ * once for the rest with `keyed` a constant, so neither checks it at every
+ * step. */
+inline int
+minmax_cmp_(
+    minmax *m, size_t index, size_t index1, bool keyed, size_t eltsize
+) {
+    if (keyed) {
+        uint64_t key = m->keys[index], key1 = m->keys[index1];
+        return (key > key1) - (key < key1);
+    }
+    return m->cmpfn(mm_elt_(index), mm_elt_(index1));
 }
 
 inline void
-minmax_swap_elts_(void *restrict elt, void *restrict elt1, size_t eltsize) {
-    char tmp[eltsize]; // Time to blow the stack lmao
-    memcpy(tmp, elt, eltsize);
-    memcpy(elt, elt1, eltsize);
-    memcpy(elt1, tmp, eltsize);
+minmax_move_(minmax *m, size_t dst, size_t src, bool keyed, size_t eltsize) {
+    memcpy(mm_elt_(dst), mm_elt_(src), eltsize);
+    if (keyed) {
+        m->keys[dst] = m->keys[src];
+    }
+    if (m->handles) {
+        m->pos[m->handles[dst] = m->handles[src]] = dst;
+    }
+}
+
+/* Sifting moves a hole through the heap instead of swapping elements at
+ * every step. The element being sifted is held in `elt`, with its key in
+ * `key` if the heap is keyed, and only written once it has found its place.
+ * This compares an element in the heap with the held one. */
+inline int
+minmax_cmp_held_(
+    minmax *m, size_t index, void *elt, uint64_t key, bool keyed, size_t eltsize
+) {
+    if (keyed) {
+        uint64_t key1 = m->keys[index];
+        return (key1 > key) - (key1 < key);
+    }
+    return m->cmpfn(mm_elt_(index), elt);
+}
+
+/* Held elements have room for their handle right after them. */
+inline uint64_t
+minmax_hold_(minmax *m, size_t index, void *elt, bool keyed, size_t eltsize) {
+    memcpy(elt, mm_elt_(index), eltsize);
+    if (m->handles) {
+        memcpy((char *)elt + eltsize, m->handles + index, sizeof(size_t));
+    }
+    return keyed ? m->keys[index] : 0;
 }
 
 inline void
-minmax_bubble_up_min_(minmax *m, size_t index, size_t eltsize) {
+minmax_place_(
+    minmax *m, size_t index, void *elt, uint64_t key, bool keyed, size_t eltsize
+) {
+    memcpy(mm_elt_(index), elt, eltsize);
+    if (keyed) {
+        m->keys[index] = key;
+    }
+    if (m->handles) {
+        memcpy(m->handles + index, (char *)elt + eltsize, sizeof(size_t));
+        m->pos[m->handles[index]] = index;
+    }
+}
+
+__attribute__((always_inline)) inline void
+minmax_bubble_up_min_(
+    minmax *m, size_t index, void *elt, uint64_t key, bool keyed, size_t eltsize
+) {
     size_t pindex;
-    char *elt, *parent;
     while ((pindex = minmax_parent_(minmax_parent_(index))) != SIZE_MAX &&
-        m->cmpfn((elt = mm_elt_(index)), (parent = mm_elt_(pindex))) < 0) {
-        minmax_swap_elts_(elt, parent, eltsize);
+        minmax_cmp_held_(m, pindex, elt, key, keyed, eltsize) > 0) {
+        minmax_move_(m, index, pindex, keyed, eltsize);
         index = pindex;
     }
+    minmax_place_(m, index, elt, key, keyed, eltsize);
 }
 
-inline void
-minmax_bubble_up_max_(minmax *m, size_t index, size_t eltsize) {
+__attribute__((always_inline)) inline void
+minmax_bubble_up_max_(
+    minmax *m, size_t index, void *elt, uint64_t key, bool keyed, size_t eltsize
+) {
     size_t pindex;
-    char *elt, *parent;
     while ((pindex = minmax_parent_(minmax_parent_(index))) != SIZE_MAX &&
-        m->cmpfn((elt = mm_elt_(index)), (parent = mm_elt_(pindex))) > 0) {
-        minmax_swap_elts_(elt, parent, eltsize);
+        minmax_cmp_held_(m, pindex, elt, key, keyed, eltsize) < 0) {
+        minmax_move_(m, index, pindex, keyed, eltsize);
         index = pindex;
     }
+    minmax_place_(m, index, elt, key, keyed, eltsize);
 }
 
-/* Duplicating the min and max versions yields slightly better performance. */
-inline void
-minmax_bubble_up_(minmax *m, size_t index, size_t eltsize) {
+/* Duplicating the min and max versions yields slightly better performance.
+ * The parent and grandparent are checked before the element is taken out of
+ * the heap, as most inserted elements stay where they are. An element that
+ * belongs above its parent continues up the levels of the other type. */
+__attribute__((always_inline)) inline void
+minmax_bubble_up_as_(minmax *m, size_t index, bool keyed, size_t eltsize) {
     size_t pindex;
     if ((pindex = minmax_parent_(index)) == SIZE_MAX) {
         return;
     }
 
-    char *elt = mm_elt_(index);
-    char *parent = mm_elt_(pindex);
-    if (minmax_level_type_max_(index)) {
-        if (m->cmpfn(elt, parent) < 0) {
-            minmax_swap_elts_(elt, parent, eltsize);
-            minmax_bubble_up_min_(m, pindex, eltsize);
+    bool max = minmax_level_type_max_(index);
+    int cmp = minmax_cmp_(m, index, pindex, keyed, eltsize);
+    bool flip = max ? cmp < 0 : cmp > 0;
+    if (!flip) {
+        if ((pindex = minmax_parent_(pindex)) == SIZE_MAX) {
             return;
         }
-        minmax_bubble_up_max_(m, index, eltsize);
+        cmp = minmax_cmp_(m, index, pindex, keyed, eltsize);
+        if (max ? cmp <= 0 : cmp >= 0) {
+            return;
+        }
+    }
+
+    char elt[eltsize + sizeof(size_t)];
+    uint64_t key = minmax_hold_(m, index, elt, keyed, eltsize);
+    minmax_move_(m, index, pindex, keyed, eltsize);
+    if (max != flip) {
+        minmax_bubble_up_max_(m, pindex, elt, key, keyed, eltsize);
         return;
     }
+    minmax_bubble_up_min_(m, pindex, elt, key, keyed, eltsize);
+}
 
-    if (m->cmpfn(elt, parent) > 0) {
-        minmax_swap_elts_(elt, parent, eltsize);
-        minmax_bubble_up_max_(m, pindex, eltsize);
+inline void
+minmax_bubble_up_(minmax *m, size_t index, size_t eltsize) {
+    if (m->keys) {
+        minmax_bubble_up_as_(m, index, true, eltsize);
         return;
     }
-    minmax_bubble_up_min_(m, index, eltsize);
+    minmax_bubble_up_as_(m, index, false, eltsize);
+}
+
+/* Fills in the key and handle of a freshly pushed element before bubbling it
+ * up. Returns the handle, or `SIZE_MAX` if the heap isn't addressable. */
+inline size_t
+minmax_insert_(minmax *m, size_t index, size_t eltsize) {
+    if (m->keys) {
+        m->keys[index] = minmax_key_(m, mm_elt_(index));
+    }
+    size_t handle = m->handles ? minmax_handle_(m, index) : SIZE_MAX;
+    minmax_bubble_up_(m, index, eltsize);
+    return handle;
 }
 
 inline size_t
@@ -231,98 +568,212 @@ minmax_child_(size_t index) {
     return (2 * index) + 1;
 }
 
-inline void
-minmax_trickle_down_min_(minmax *m, size_t index, size_t eltsize) {
-    for ( ; ; ) {
-        size_t cindex = minmax_child_(index);
-        if (cindex >= m->len) {
-            return;
-        }
+/* Picks whichever of the keys at `index` and `index1` comes first. This is
+ * done with a mask as compilers turn the equivalent conditional into a
+ * branch. */
+inline size_t
+minmax_pick_(const uint64_t *keys, size_t index, size_t index1, bool max) {
+    size_t mask = -(size_t)(max ?
+        keys[index1] > keys[index] : keys[index1] < keys[index]);
+    return index ^ ((index ^ index1) & mask);
+}
 
+/* Picks the smallest or largest of the two children at `cindex` and the four
+ * grandchildren at `gindex` of a keyed heap as a tree of masked selections.
+ * Scanning them in order mispredicts a branch or two at every level. */
+inline size_t
+minmax_select_keys_(
+    const uint64_t *keys, size_t cindex, size_t gindex, bool max
+) {
+    size_t gbest = minmax_pick_(
+        keys,
+        minmax_pick_(keys, gindex, gindex + 1, max),
+        minmax_pick_(keys, gindex + 2, gindex + 3, max),
+        max);
+    return minmax_pick_(
+        keys, minmax_pick_(keys, cindex, cindex + 1, max), gbest, max);
+}
+
+/* Starts loading the keys of the children and grandchildren of the four
+ * grandchildren at `gindex` while the current step of sifting down compares
+ * theirs, as the next step looks at one of those families. This makes the
+ * huge keyed queue in `tests/bench.c` about a quarter faster. Heaps with a
+ * `cmpfn` gained nothing from fetching their elements the same way. It has to
+ * be inlined, as GCC decides that a call to it does nothing and drops it. */
+__attribute__((always_inline)) inline void
+minmax_prefetch_(const uint64_t *keys, size_t len, size_t gindex) {
+    size_t far = (4 * gindex) + 3;
+    if (gindex < len / 4 && far + 16 <= len) {
+        __builtin_prefetch(keys + (2 * gindex) + 1);
+        __builtin_prefetch(keys + far);
+        __builtin_prefetch(keys + far + 8);
+    }
+}
+
+/* Sifts the element at `from` down from `index`, which is either the same
+ * index or a hole left by removing an element. When the element drops past a
+ * max level whose element is smaller, the two trade places and the one from
+ * the max level is carried the rest of the way instead.
+ *
+ * The children and the four grandchildren each sit next to each other, so a
+ * step touches about two cache lines however large the heap is. Laying the
+ * heap out in blocks of subtrees or giving nodes four or eight children were
+ * both slower on the huge heaps that `tests/bench.c` runs them on. */
+__attribute__((always_inline)) inline void
+minmax_trickle_down_min_(
+    minmax *m, size_t index, size_t from, bool keyed, size_t eltsize
+) {
+    size_t cindex = minmax_child_(index);
+    if (cindex >= m->len && from == index) {
+        return;
+    }
+
+    char buf[2 * (eltsize + sizeof(size_t))];
+    char *elt = buf, *tmp = buf + eltsize + sizeof(size_t);
+    uint64_t key = minmax_hold_(m, from, elt, keyed, eltsize);
+    for ( ; cindex < m->len; cindex = minmax_child_(index)) {
         size_t gindex = minmax_child_(cindex);
-        if (cindex + 1 < m->len) {
-            if (m->cmpfn(mm_elt_(cindex), mm_elt_((cindex + 1))) > 0) {
+        if (keyed) {
+            minmax_prefetch_(m->keys, m->len, gindex);
+        }
+        if (keyed && gindex < m->len && m->len - gindex > 3) {
+            cindex = minmax_select_keys_(m->keys, cindex, gindex, false);
+        } else if (cindex + 1 < m->len) {
+            if (minmax_cmp_(m, cindex, cindex + 1, keyed, eltsize) > 0) {
                 cindex++;
             }
             if (gindex < m->len) {
                 for (size_t i = 0; gindex + i < m->len && i < 4; i++) {
-                    if (m->cmpfn(mm_elt_(cindex), mm_elt_((gindex + i))) > 0) {
+                    if (minmax_cmp_(
+                        m, cindex, gindex + i, keyed, eltsize) > 0) {
                         cindex = gindex + i;
                     }
                 }
             }
         }
 
-        char *elt = mm_elt_(index);
-        char *child = mm_elt_(cindex);
-        if (cindex < gindex) {
-            if (m->cmpfn(child, elt) < 0) {
-                minmax_swap_elts_(child, elt, eltsize);
-            }
-            return;
+        if (minmax_cmp_held_(m, cindex, elt, key, keyed, eltsize) >= 0) {
+            break;
         }
-        if (m->cmpfn(child, elt) >= 0) {
-            return;
+        minmax_move_(m, index, cindex, keyed, eltsize);
+        index = cindex;
+        if (cindex < gindex) {
+            break;
         }
-        minmax_swap_elts_(child, elt, eltsize);
-        char *parent = mm_elt_(minmax_parent_(cindex));
-        if (m->cmpfn(child, parent) > 0) {
-            minmax_swap_elts_(child, parent, eltsize);
+        size_t pindex = minmax_parent_(cindex);
+        if (minmax_cmp_held_(m, pindex, elt, key, keyed, eltsize) < 0) {
+            uint64_t key1 = minmax_hold_(m, pindex, tmp, keyed, eltsize);
+            minmax_place_(m, pindex, elt, key, keyed, eltsize);
+            char *t = elt;
+            elt = tmp;
+            tmp = t;
+            key = key1;
         }
-        index = cindex;
     }
+    minmax_place_(m, index, elt, key, keyed, eltsize);
 }
 
-inline void
-minmax_trickle_down_max_(minmax *m, size_t index, size_t eltsize) {
-    for ( ; ; ) {
-        size_t cindex = minmax_child_(index);
-        if (cindex >= m->len) {
-            return;
-        }
+__attribute__((always_inline)) inline void
+minmax_trickle_down_max_(
+    minmax *m, size_t index, size_t from, bool keyed, size_t eltsize
+) {
+    size_t cindex = minmax_child_(index);
+    if (cindex >= m->len && from == index) {
+        return;
+    }
 
+    char buf[2 * (eltsize + sizeof(size_t))];
+    char *elt = buf, *tmp = buf + eltsize + sizeof(size_t);
+    uint64_t key = minmax_hold_(m, from, elt, keyed, eltsize);
+    for ( ; cindex < m->len; cindex = minmax_child_(index)) {
         size_t gindex = minmax_child_(cindex);
-        if (cindex + 1 < m->len) {
-            if (m->cmpfn(mm_elt_(cindex), mm_elt_((cindex + 1))) < 0) {
+        if (keyed) {
+            minmax_prefetch_(m->keys, m->len, gindex);
+        }
+        if (keyed && gindex < m->len && m->len - gindex > 3) {
+            cindex = minmax_select_keys_(m->keys, cindex, gindex, true);
+        } else if (cindex + 1 < m->len) {
+            if (minmax_cmp_(m, cindex, cindex + 1, keyed, eltsize) < 0) {
                 cindex++;
             }
             if (gindex < m->len) {
                 for (size_t i = 0; gindex + i < m->len && i < 4; i++) {
-                    if (m->cmpfn(mm_elt_(cindex), mm_elt_((gindex + i))) < 0) {
+                    if (minmax_cmp_(
+                        m, cindex, gindex + i, keyed, eltsize) < 0) {
                         cindex = gindex + i;
                     }
                 }
             }
         }
 
-        char *elt = mm_elt_(index);
-        char *child = mm_elt_(cindex);
-        if (cindex < gindex) {
-            if (m->cmpfn(child, elt) > 0) {
-                minmax_swap_elts_(child, elt, eltsize);
-            }
-            return;
+        if (minmax_cmp_held_(m, cindex, elt, key, keyed, eltsize) <= 0) {
+            break;
         }
-        if (m->cmpfn(child, elt) <= 0) {
-            return;
+        minmax_move_(m, index, cindex, keyed, eltsize);
+        index = cindex;
+        if (cindex < gindex) {
+            break;
         }
-        minmax_swap_elts_(child, elt, eltsize);
-        char *parent = mm_elt_(minmax_parent_(cindex));
-        if (m->cmpfn(child, parent) < 0) {
-            minmax_swap_elts_(child, parent, eltsize);
+        size_t pindex = minmax_parent_(cindex);
+        if (minmax_cmp_held_(m, pindex, elt, key, keyed, eltsize) > 0) {
+            uint64_t key1 = minmax_hold_(m, pindex, tmp, keyed, eltsize);
+            minmax_place_(m, pindex, elt, key, keyed, eltsize);
+            char *t = elt;
+            elt = tmp;
+            tmp = t;
+            key = key1;
         }
-        index = cindex;
     }
+    minmax_place_(m, index, elt, key, keyed, eltsize);
 }
 
 /* Duplicating the min and max versions yields slightly better performance. */
-inline void
-minmax_trickle_down_(minmax *m, size_t index, size_t eltsize) {
+__attribute__((always_inline)) inline void
+minmax_trickle_down_as_(
+    minmax *m, size_t index, size_t from, bool keyed, size_t eltsize
+) {
     if (minmax_level_type_max_(index)) {
-        minmax_trickle_down_max_(m, index, eltsize);
+        minmax_trickle_down_max_(m, index, from, keyed, eltsize);
         return;
     }
-    minmax_trickle_down_min_(m, index, eltsize);
+    minmax_trickle_down_min_(m, index, from, keyed, eltsize);
+}
+
+inline void
+minmax_trickle_down_(minmax *m, size_t index, size_t from, size_t eltsize) {
+    if (m->keys) {
+        minmax_trickle_down_as_(m, index, from, true, eltsize);
+        return;
+    }
+    minmax_trickle_down_as_(m, index, from, false, eltsize);
+}
+
+/* Restores the heap after the elements from `index` on have been appended
+ * with Floyd's bottom-up construction, but only over the new elements and
+ * their ancestors. Each round moves up a level and covers the parents of the
+ * last round's range, minus the ones that range already covered, so indices
+ * only ever go down and children always go before their parents. Building a
+ * heap from scratch is the special case where `index` is 0, which takes a
+ * single round. */
+inline void
+minmax_heapify_(minmax *m, size_t index, size_t eltsize) {
+    if (m->len < 2 || index >= m->len) {
+        return;
+    }
+    size_t lo = index, hi = m->len - 1;
+    size_t last = minmax_parent_(m->len - 1); // The rest are leaves
+    for ( ; ; ) {
+        size_t i = hi < last ? hi : last;
+        for ( ; i >= lo && i != SIZE_MAX; i--) {
+            minmax_trickle_down_(m, i, i, eltsize);
+        }
+        if (lo == 0) {
+            return;
+        }
+        size_t phi = minmax_parent_(hi);
+        hi = phi < lo ? phi : lo - 1;
+        lo = minmax_parent_(lo);
+    }
 }
 
 /* Heapifies and takes ownership of an existing array. `arr` *must* be
@@ -333,13 +784,159 @@ minmax_fromarr(
 ) {
     minmax *m = malloc(sizeof(*m));
     mm_assert_(cap > 0 && m);
-    *m = (minmax) {arr, eltsize, len, cap, cmpfn};
-    for (size_t i = len / 2; i != SIZE_MAX; i--) {
-        minmax_trickle_down_(m, i, eltsize);
+    *m = (minmax) {
+        .heap = arr, .eltsize = eltsize, .len = len, .cap = cap,
+        .cmpfn = cmpfn,
+    };
+    minmax_heapify_(m, 0, eltsize);
+    return m;
+}
+
+/* Like `minmax_fromarr` but for keyed heaps. */
+inline minmax *
+minmax_fromarr_keyed(
+    size_t eltsize,
+    size_t len,
+    size_t cap,
+    size_t keyoff,
+    size_t keysize,
+    unsigned keykind,
+    void *arr
+) {
+    minmax *m = minmax_keyed_(
+        minmax_fromarr(eltsize, 0, cap, NULL, arr), keyoff, keysize, keykind);
+    m->len = len;
+    for (size_t i = 0; i < len; i++) {
+        m->keys[i] = minmax_key_(m, mm_elt_(i));
     }
+    minmax_heapify_(m, 0, eltsize);
     return m;
 }
 
+/* Appends the `n` elements of `arr` to the heap, reallocating at most once.
+ * Batches at least an eighth the size of the heap they're added to are
+ * heapified bottom-up, which takes linear time however they're ordered.
+ * Smaller ones are bubbled up one at a time, as heapifying them would mostly
+ * be spent going over their ancestors. If `handles` isn't `NULL`, the handle
+ * of `arr[i]` is stored in `handles[i]`. */
+inline void
+minmax_insertn(
+    minmax *m, size_t eltsize, const void *arr, size_t n, size_t *handles
+) {
+    mm_assert_(eltsize == m->eltsize);
+    if (n == 0) {
+        return;
+    }
+    minmax_reserve_(m, n, eltsize);
+    size_t index = m->len;
+    memcpy(mm_elt_(index), arr, n * eltsize);
+    m->len += n;
+    if (m->keys) {
+        for (size_t i = index; i < m->len; i++) {
+            m->keys[i] = minmax_key_(m, mm_elt_(i));
+        }
+    }
+    if (m->handles) {
+        for (size_t i = index; i < m->len; i++) {
+            size_t handle = minmax_handle_(m, i);
+            if (handles) {
+                handles[i - index] = handle;
+            }
+        }
+    } else if (handles) {
+        for (size_t i = 0; i < n; i++) {
+            handles[i] = SIZE_MAX;
+        }
+    }
+    if (n >= index / 8) {
+        minmax_heapify_(m, index, eltsize);
+        return;
+    }
+    for (size_t i = index; i < m->len; i++) {
+        minmax_bubble_up_(m, i, eltsize);
+    }
+}
+
+/* Whether the element at `index` comes out before the one at `index1`. */
+inline bool
+minmax_before_(
+    minmax *m, size_t index, size_t index1, bool max, bool keyed, size_t eltsize
+) {
+    int cmp = minmax_cmp_(m, index, index1, keyed, eltsize);
+    return max ? cmp > 0 : cmp < 0;
+}
+
+/* Removes the element at `index`, which comes before all of its descendants,
+ * by moving the hole it leaves down to a leaf. Each step fills the hole with
+ * whichever grandchild, or child that has no children, comes first, without
+ * comparing it to the element that will end up filling the hole. That is the
+ * last element in the heap, which is then bubbled up from the leaf like a new
+ * one and rarely goes far. This takes about half the comparisons of
+ * trickling the last element down from `index`, but always goes all the way
+ * down, so it only pays off when comparisons go through `cmpfn`. */
+inline void
+minmax_delete_(minmax *m, size_t index, bool max, size_t eltsize) {
+    size_t child;
+    while ((child = minmax_child_(index)) < m->len) {
+        size_t best = SIZE_MAX;
+        for (size_t i = 0; i < 2 && child < m->len; i++, child++) {
+            size_t gchild = minmax_child_(child), n = 2;
+            if (gchild >= m->len) {
+                gchild = child;
+                n = 1;
+            }
+            for ( ; n > 0 && gchild < m->len; n--, gchild++) {
+                if (best == SIZE_MAX ||
+                    minmax_before_(m, gchild, best, max, false, eltsize)) {
+                    best = gchild;
+                }
+            }
+        }
+        minmax_move_(m, index, best, false, eltsize);
+        index = best;
+    }
+    if (index != --m->len) {
+        minmax_move_(m, index, m->len, false, eltsize);
+        minmax_bubble_up_(m, index, eltsize);
+    }
+}
+
+/* Trickles the last element of a keyed heap down from `index`, which it is
+ * replacing, into the heap. This is kept out of `minmax_poll_` so that the
+ * rest of it stays small enough to inline. */
+inline void
+minmax_poll_keyed_(minmax *m, size_t index, bool max, size_t eltsize) {
+    if (max) {
+        minmax_trickle_down_max_(m, index, m->len, true, eltsize);
+        return;
+    }
+    minmax_trickle_down_min_(m, index, m->len, true, eltsize);
+}
+
+/* Removes the element at `index`, which is the maximum if `max` is `true`
+ * and the minimum otherwise. */
+inline void
+minmax_poll_(minmax *m, size_t index, bool max, size_t eltsize) {
+    if (m->handles) {
+        minmax_release_(m, m->handles[index]);
+    }
+    if (!m->keys) {
+        minmax_delete_(m, index, max, eltsize);
+    } else if (index < --m->len) {
+        minmax_poll_keyed_(m, index, max, eltsize);
+    }
+}
+
+/* Finds the maximum element, which is in one of the children of the root
+ * unless there are fewer than two. */
+inline size_t
+minmax_maxindex_(minmax *m, size_t eltsize) {
+    if (m->len < 3) {
+        return m->len - 1;
+    }
+    return minmax_cmp_(m, 1, 2, m->keys != NULL, eltsize) > 0 ? 1 : 2;
+}
+
 /* Peeks at the minimum element in the heap or removes it instead if `poll` is
  * `true`. */
 inline bool
@@ -349,9 +946,8 @@ minmax_peekmin(minmax *m, size_t eltsize, void *elt, bool poll) {
         return false;
     }
     memcpy(elt, m->heap, eltsize);
-    if (poll && --m->len > 0) {
-        memcpy(m->heap, mm_elt_(m->len), eltsize);
-        minmax_trickle_down_(m, 0, eltsize);
+    if (poll) {
+        minmax_poll_(m, 0, false, eltsize);
     }
     return true;
 }
@@ -364,18 +960,560 @@ minmax_peekmax(minmax *m, size_t eltsize, void *elt, bool poll) {
     if (m->len == 0) {
         return false;
     }
-    if (m->len < 3) {
-        memcpy(elt, mm_elt_(poll ? --m->len : m->len - 1), eltsize);
-        return true;
-    }
-
-    size_t index = m->cmpfn(mm_elt_(1), mm_elt_(2)) > 0 ?
-            1 : 2;
+    size_t index = minmax_maxindex_(m, eltsize);
     memcpy(elt, mm_elt_(index), eltsize);
-    if (poll && --m->len > 0) {
-        memcpy(mm_elt_(index), mm_elt_(m->len), eltsize);
-        minmax_trickle_down_(m, index, eltsize);
+    if (poll) {
+        minmax_poll_(m, index, true, eltsize);
     }
     return true;
 }
+
+/* Adds an index to `cand`, a binary heap of `n` indices that is ordered by
+ * the elements at those indices. */
+inline void
+minmax_cand_push_(
+    minmax *m, size_t *cand, size_t n, size_t index, bool max, size_t eltsize
+) {
+    size_t pindex;
+    bool keyed = m->keys != NULL;
+    while (n > 0 && minmax_before_(
+        m, index, cand[pindex = (n - 1) / 2], max, keyed, eltsize)) {
+        cand[n] = cand[pindex];
+        n = pindex;
+    }
+    cand[n] = index;
+}
+
+/* Removes the first index from `cand`, which holds `n` indices. */
+inline void
+minmax_cand_pop_(minmax *m, size_t *cand, size_t n, bool max, size_t eltsize) {
+    size_t index = cand[--n], hole = 0, child;
+    bool keyed = m->keys != NULL;
+    while ((child = (2 * hole) + 1) < n) {
+        if (child + 1 < n && minmax_before_(
+            m, cand[child + 1], cand[child], max, keyed, eltsize)) {
+            child++;
+        }
+        if (!minmax_before_(m, cand[child], index, max, keyed, eltsize)) {
+            break;
+        }
+        cand[hole] = cand[child];
+        hole = child;
+    }
+    cand[hole] = index;
+}
+
+/* Finds the indices of the `k` smallest elements, or the largest if `max` is
+ * set, in order and without moving anything. An element on a level of the
+ * type being looked for comes before all of its descendants, so taking it
+ * makes its children and grandchildren candidates. Elements on the other
+ * levels are beaten by their children, which are already candidates by the
+ * time they are, so taking them adds nothing. `cand` needs room for `5k + 3`
+ * indices. */
+inline void
+minmax_select_(
+    minmax *m, size_t k, bool max, size_t *sel, size_t *cand, size_t eltsize
+) {
+    size_t n = 0;
+    for (size_t i = 0; i < (max ? 3 : 1) && i < m->len; i++) {
+        minmax_cand_push_(m, cand, n++, i, max, eltsize);
+    }
+    for (size_t j = 0; j < k; j++) {
+        size_t index = sel[j] = cand[0];
+        minmax_cand_pop_(m, cand, n--, max, eltsize);
+        if (minmax_level_type_max_(index) != max) {
+            continue;
+        }
+        size_t child = minmax_child_(index);
+        size_t gchild = minmax_child_(child);
+        for (size_t i = 0; i < 2 && child + i < m->len; i++) {
+            minmax_cand_push_(m, cand, n++, child + i, max, eltsize);
+        }
+        for (size_t i = 0; i < 4 && gchild + i < m->len; i++) {
+            minmax_cand_push_(m, cand, n++, gchild + i, max, eltsize);
+        }
+    }
+}
+
+inline size_t
+minmax_peekn_(
+    minmax *m, size_t eltsize, void *elts, size_t k, bool max, bool poll
+) {
+    mm_assert_(eltsize == m->eltsize);
+    if ((k = k < m->len ? k : m->len) == 0) {
+        return 0;
+    }
+    char *elt = elts;
+    if (poll) {
+        for (size_t j = 0; j < k; j++, elt += eltsize) {
+            size_t index = max ? minmax_maxindex_(m, eltsize) : 0;
+            memcpy(elt, mm_elt_(index), eltsize);
+            minmax_poll_(m, index, max, eltsize);
+        }
+        return k;
+    }
+
+    mm_assert_(k < (SIZE_MAX / sizeof(size_t) - 3) / 6);
+    size_t *sel = malloc(((6 * k) + 3) * sizeof(*sel));
+    mm_assert_(sel);
+    minmax_select_(m, k, max, sel, sel + k, eltsize);
+    for (size_t j = 0; j < k; j++, elt += eltsize) {
+        memcpy(elt, mm_elt_(sel[j]), eltsize);
+    }
+    free(sel);
+    return k;
+}
+
+/* Copies up to `k` of the smallest elements in the heap into `elts` in
+ * ascending order, and removes them too if `poll` is `true`. Returns how
+ * many were copied. */
+inline size_t
+minmax_peekminn(minmax *m, size_t eltsize, void *elts, size_t k, bool poll) {
+    return minmax_peekn_(m, eltsize, elts, k, false, poll);
+}
+
+/* Copies up to `k` of the largest elements in the heap into `elts` in
+ * descending order, and removes them too if `poll` is `true`. Returns how
+ * many were copied. */
+inline size_t
+minmax_peekmaxn(minmax *m, size_t eltsize, void *elts, size_t k, bool poll) {
+    return minmax_peekn_(m, eltsize, elts, k, true, poll);
+}
+
+inline size_t
+minmax_index_(minmax *m, size_t handle) {
+    mm_assert_(m->handles && handle < m->hlen);
+    size_t index = m->pos[handle];
+    mm_assert_(index < m->len && m->handles[index] == handle);
+    return index;
+}
+
+/* Returns a pointer to the element with the handle `handle`. It is only valid
+ * until the heap next changes, and `minmax_update` has to be called after
+ * changing the element through it. */
+inline void *
+minmax_at(minmax *m, size_t eltsize, size_t handle) {
+    mm_assert_(eltsize == m->eltsize);
+    return mm_elt_(minmax_index_(m, handle));
+}
+
+/* Restores the heap after the element at `index` has been replaced. It is
+ * trickled down and then bubbled up from wherever that left it, as it might
+ * belong either above or below its old place but only moves one way. */
+inline void
+minmax_fix_(minmax *m, size_t index, size_t eltsize) {
+    size_t handle = m->handles[index];
+    minmax_trickle_down_(m, index, index, eltsize);
+    minmax_bubble_up_(m, m->pos[handle], eltsize);
+}
+
+/* Moves the element with the handle `handle` to its new place after it has
+ * been changed through `minmax_at`. */
+inline void
+minmax_update(minmax *m, size_t handle) {
+    size_t index = minmax_index_(m, handle), eltsize = m->eltsize;
+    if (m->keys) {
+        m->keys[index] = minmax_key_(m, mm_elt_(index));
+    }
+    minmax_fix_(m, index, eltsize);
+}
+
+/* Removes the element with the handle `handle` from the heap. The handle may
+ * be handed out again to an element inserted later. */
+inline void
+minmax_remove(minmax *m, size_t handle) {
+    size_t index = minmax_index_(m, handle), eltsize = m->eltsize;
+    minmax_release_(m, handle);
+    if (index != --m->len) {
+        minmax_move_(m, index, m->len, m->keys != NULL, eltsize);
+        minmax_fix_(m, index, eltsize);
+    }
+}
+
+/* Defines `name`, a min-max heap of `T` that compares elements with
+ * `less(a, b)` instead of a `minmax_cmpfn`. `less` may be a function or a
+ * macro, is passed elements by value, and must be true if `a` is less than
+ * `b`. All of the functions are generated as `static inline` and named after
+ * the heap, e.g. `name_insert(m, elt)`, so comparisons and moves are inlined
+ * for the concrete type. */
+#define MINMAX_DEFINE(name, T, less) \
+    typedef struct name { \
+        T *heap; \
+        size_t len, cap; \
+    } name; \
+    \
+    static inline name * \
+    name##_make(size_t cap) { \
+        mm_assert_(0 < cap && cap < SIZE_MAX / sizeof(T)); \
+        name *m = malloc(sizeof(*m)); \
+        mm_assert_(m); \
+        *m = (name){malloc(cap * sizeof(T)), 0, cap}; \
+        mm_assert_(m->heap); \
+        return m; \
+    } \
+    \
+    static inline name * \
+    name##_drop(name *m) { \
+        free(m->heap); \
+        free(m); \
+        return NULL; \
+    } \
+    \
+    static inline void \
+    name##_shrink(name *m) { \
+        if (m->len * 4 > m->cap) { \
+            return; \
+        } \
+        m->cap = m->len > 0 ? 2 * m->len : 1; \
+        mm_assert_((m->heap = realloc(m->heap, m->cap * sizeof(T)))); \
+    } \
+    \
+    static inline void \
+    name##_reserve_(name *m, size_t n) { \
+        if (m->cap - m->len >= n) { \
+            return; \
+        } \
+        mm_assert_(n <= SIZE_MAX - m->len); \
+        while (m->cap < m->len + n) { \
+            mm_assert_(m->cap < SIZE_MAX - m->cap && \
+                (m->cap *= 2) < SIZE_MAX / sizeof(T)); \
+        } \
+        mm_assert_((m->heap = realloc(m->heap, m->cap * sizeof(T)))); \
+    } \
+    \
+    static inline void \
+    name##_bubble_up_min_(name *m, size_t index, T elt) { \
+        size_t pindex; \
+        while ((pindex = minmax_parent_(minmax_parent_(index))) != SIZE_MAX && \
+            less(elt, m->heap[pindex])) { \
+            m->heap[index] = m->heap[pindex]; \
+            index = pindex; \
+        } \
+        m->heap[index] = elt; \
+    } \
+    \
+    static inline void \
+    name##_bubble_up_max_(name *m, size_t index, T elt) { \
+        size_t pindex; \
+        while ((pindex = minmax_parent_(minmax_parent_(index))) != SIZE_MAX && \
+            less(m->heap[pindex], elt)) { \
+            m->heap[index] = m->heap[pindex]; \
+            index = pindex; \
+        } \
+        m->heap[index] = elt; \
+    } \
+    \
+    static inline void \
+    name##_bubble_up_(name *m, size_t index, T elt) { \
+        size_t pindex; \
+        if ((pindex = minmax_parent_(index)) == SIZE_MAX) { \
+            m->heap[index] = elt; \
+            return; \
+        } \
+    \
+        if (minmax_level_type_max_(index)) { \
+            if (less(elt, m->heap[pindex])) { \
+                m->heap[index] = m->heap[pindex]; \
+                name##_bubble_up_min_(m, pindex, elt); \
+                return; \
+            } \
+            name##_bubble_up_max_(m, index, elt); \
+            return; \
+        } \
+    \
+        if (less(m->heap[pindex], elt)) { \
+            m->heap[index] = m->heap[pindex]; \
+            name##_bubble_up_max_(m, pindex, elt); \
+            return; \
+        } \
+        name##_bubble_up_min_(m, index, elt); \
+    } \
+    \
+    static inline void \
+    name##_trickle_down_min_(name *m, size_t index, T elt) { \
+        T *h = m->heap; \
+        size_t cindex; \
+        while ((cindex = minmax_child_(index)) < m->len) { \
+            size_t gindex = minmax_child_(cindex); \
+            if (cindex + 1 < m->len) { \
+                if (less(h[cindex + 1], h[cindex])) { \
+                    cindex++; \
+                } \
+                for (size_t i = 0; gindex + i < m->len && i < 4; i++) { \
+                    if (less(h[gindex + i], h[cindex])) { \
+                        cindex = gindex + i; \
+                    } \
+                } \
+            } \
+    \
+            if (!less(h[cindex], elt)) { \
+                break; \
+            } \
+            h[index] = h[cindex]; \
+            index = cindex; \
+            if (cindex < gindex) { \
+                break; \
+            } \
+            size_t pindex = minmax_parent_(cindex); \
+            if (less(h[pindex], elt)) { \
+                T tmp = h[pindex]; \
+                h[pindex] = elt; \
+                elt = tmp; \
+            } \
+        } \
+        h[index] = elt; \
+    } \
+    \
+    static inline void \
+    name##_trickle_down_max_(name *m, size_t index, T elt) { \
+        T *h = m->heap; \
+        size_t cindex; \
+        while ((cindex = minmax_child_(index)) < m->len) { \
+            size_t gindex = minmax_child_(cindex); \
+            if (cindex + 1 < m->len) { \
+                if (less(h[cindex], h[cindex + 1])) { \
+                    cindex++; \
+                } \
+                for (size_t i = 0; gindex + i < m->len && i < 4; i++) { \
+                    if (less(h[cindex], h[gindex + i])) { \
+                        cindex = gindex + i; \
+                    } \
+                } \
+            } \
+    \
+            if (!less(elt, h[cindex])) { \
+                break; \
+            } \
+            h[index] = h[cindex]; \
+            index = cindex; \
+            if (cindex < gindex) { \
+                break; \
+            } \
+            size_t pindex = minmax_parent_(cindex); \
+            if (less(elt, h[pindex])) { \
+                T tmp = h[pindex]; \
+                h[pindex] = elt; \
+                elt = tmp; \
+            } \
+        } \
+        h[index] = elt; \
+    } \
+    \
+    static inline void \
+    name##_trickle_down_(name *m, size_t index) { \
+        if (minmax_level_type_max_(index)) { \
+            name##_trickle_down_max_(m, index, m->heap[index]); \
+            return; \
+        } \
+        name##_trickle_down_min_(m, index, m->heap[index]); \
+    } \
+    \
+    static inline void \
+    name##_heapify_(name *m, size_t index) { \
+        if (m->len < 2 || index >= m->len) { \
+            return; \
+        } \
+        size_t lo = index, hi = m->len - 1; \
+        size_t last = minmax_parent_(m->len - 1); \
+        for ( ; ; ) { \
+            size_t i = hi < last ? hi : last; \
+            for ( ; i >= lo && i != SIZE_MAX; i--) { \
+                name##_trickle_down_(m, i); \
+            } \
+            if (lo == 0) { \
+                return; \
+            } \
+            size_t phi = minmax_parent_(hi); \
+            hi = phi < lo ? phi : lo - 1; \
+            lo = minmax_parent_(lo); \
+        } \
+    } \
+    \
+    static inline name * \
+    name##_fromarr(size_t len, size_t cap, T *arr) { \
+        name *m = malloc(sizeof(*m)); \
+        mm_assert_(cap > 0 && m); \
+        *m = (name){arr, len, cap}; \
+        name##_heapify_(m, 0); \
+        return m; \
+    } \
+    \
+    static inline void \
+    name##_insert(name *m, T elt) { \
+        name##_reserve_(m, 1); \
+        name##_bubble_up_(m, m->len++, elt); \
+    } \
+    \
+    static inline void \
+    name##_insertn(name *m, const T *arr, size_t n) { \
+        if (n == 0) { \
+            return; \
+        } \
+        name##_reserve_(m, n); \
+        size_t index = m->len; \
+        memcpy(m->heap + index, arr, n * sizeof(T)); \
+        m->len += n; \
+        if (n >= index / 8) { \
+            name##_heapify_(m, index); \
+            return; \
+        } \
+        for (size_t i = index; i < m->len; i++) { \
+            name##_bubble_up_(m, i, m->heap[i]); \
+        } \
+    } \
+    \
+    static inline bool \
+    name##_before_(name *m, size_t index, size_t index1, bool max) { \
+        return max ? \
+            less(m->heap[index1], m->heap[index]) : \
+            less(m->heap[index], m->heap[index1]); \
+    } \
+    \
+    static inline void \
+    name##_poll_(name *m, size_t index, bool max) { \
+        if (index < --m->len) { \
+            if (max) { \
+                name##_trickle_down_max_(m, index, m->heap[m->len]); \
+            } else { \
+                name##_trickle_down_min_(m, index, m->heap[m->len]); \
+            } \
+        } \
+    } \
+    \
+    static inline bool \
+    name##_peekmin(name *m, T *elt) { \
+        if (m->len == 0) { \
+            return false; \
+        } \
+        *elt = m->heap[0]; \
+        return true; \
+    } \
+    \
+    static inline bool \
+    name##_pollmin(name *m, T *elt) { \
+        if (m->len == 0) { \
+            return false; \
+        } \
+        *elt = m->heap[0]; \
+        name##_poll_(m, 0, false); \
+        return true; \
+    } \
+    \
+    static inline size_t \
+    name##_maxindex_(name *m) { \
+        if (m->len < 3) { \
+            return m->len - 1; \
+        } \
+        return less(m->heap[2], m->heap[1]) ? 1 : 2; \
+    } \
+    \
+    static inline bool \
+    name##_peekmax(name *m, T *elt) { \
+        if (m->len == 0) { \
+            return false; \
+        } \
+        *elt = m->heap[name##_maxindex_(m)]; \
+        return true; \
+    } \
+    \
+    static inline bool \
+    name##_pollmax(name *m, T *elt) { \
+        if (m->len == 0) { \
+            return false; \
+        } \
+        size_t index = name##_maxindex_(m); \
+        *elt = m->heap[index]; \
+        name##_poll_(m, index, true); \
+        return true; \
+    } \
+    \
+    static inline void \
+    name##_cand_push_( \
+        name *m, size_t *cand, size_t n, size_t index, bool max \
+    ) { \
+        size_t pindex; \
+        while (n > 0 && \
+            name##_before_(m, index, cand[pindex = (n - 1) / 2], max)) { \
+            cand[n] = cand[pindex]; \
+            n = pindex; \
+        } \
+        cand[n] = index; \
+    } \
+    \
+    static inline void \
+    name##_cand_pop_(name *m, size_t *cand, size_t n, bool max) { \
+        size_t index = cand[--n], hole = 0, child; \
+        while ((child = (2 * hole) + 1) < n) { \
+            if (child + 1 < n && \
+                name##_before_(m, cand[child + 1], cand[child], max)) { \
+                child++; \
+            } \
+            if (!name##_before_(m, cand[child], index, max)) { \
+                break; \
+            } \
+            cand[hole] = cand[child]; \
+            hole = child; \
+        } \
+        cand[hole] = index; \
+    } \
+    \
+    static inline size_t \
+    name##_peekn_(name *m, T *elts, size_t k, bool max, bool poll) { \
+        if ((k = k < m->len ? k : m->len) == 0) { \
+            return 0; \
+        } \
+        if (poll) { \
+            for (size_t j = 0; j < k; j++) { \
+                size_t index = max ? name##_maxindex_(m) : 0; \
+                elts[j] = m->heap[index]; \
+                name##_poll_(m, index, max); \
+            } \
+            return k; \
+        } \
+    \
+        mm_assert_(k < (SIZE_MAX / sizeof(size_t) - 3) / 5); \
+        size_t *cand = malloc(((5 * k) + 3) * sizeof(*cand)), n = 0; \
+        mm_assert_(cand); \
+        for (size_t i = 0; i < (max ? 3 : 1) && i < m->len; i++) { \
+            name##_cand_push_(m, cand, n++, i, max); \
+        } \
+        for (size_t j = 0; j < k; j++) { \
+            size_t index = cand[0]; \
+            elts[j] = m->heap[index]; \
+            name##_cand_pop_(m, cand, n--, max); \
+            if (minmax_level_type_max_(index) != max) { \
+                continue; \
+            } \
+            size_t child = minmax_child_(index); \
+            size_t gchild = minmax_child_(child); \
+            for (size_t i = 0; i < 2 && child + i < m->len; i++) { \
+                name##_cand_push_(m, cand, n++, child + i, max); \
+            } \
+            for (size_t i = 0; i < 4 && gchild + i < m->len; i++) { \
+                name##_cand_push_(m, cand, n++, gchild + i, max); \
+            } \
+        } \
+        free(cand); \
+        return k; \
+    } \
+    \
+    static inline size_t \
+    name##_peekminn(name *m, T *elts, size_t k) { \
+        return name##_peekn_(m, elts, k, false, false); \
+    } \
+    \
+    static inline size_t \
+    name##_pollminn(name *m, T *elts, size_t k) { \
+        return name##_peekn_(m, elts, k, false, true); \
+    } \
+    \
+    static inline size_t \
+    name##_peekmaxn(name *m, T *elts, size_t k) { \
+        return name##_peekn_(m, elts, k, true, false); \
+    } \
+    \
+    static inline size_t \
+    name##_pollmaxn(name *m, T *elts, size_t k) { \
+        return name##_peekn_(m, elts, k, true, true); \
+    }
 #endif
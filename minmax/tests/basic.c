@@ -39,6 +39,14 @@ int
 main(void) {
     srand(time(NULL));
 
+    /* Levels are right at both ends, including where `log2` would round
+     * `index + 1` up to the next power of two. */
+    for (unsigned k = 0; k < sizeof(size_t) * 8 - 1; k++) {
+        size_t first = ((size_t)1 << k) - 1, last = first * 2;
+        assert(minmax_level_type_max_(first) == k % 2);
+        assert(minmax_level_type_max_(last) == k % 2);
+    }
+
     minmax *m = mm_make(int, 1, cmp_int);
     for (int i = -999; i < 1000; i++) {
         mm_insert(m, int, i);
@@ -58,6 +66,12 @@ main(void) {
         assert(a >= b);
         b = a;
     }
+    /* An empty heap keeps room for one element and can still grow. */
+    mm_shrink(m);
+    for (int i = 0; i < 3; i++) {
+        mm_insert(m, int, i);
+    }
+    assert(mm_pollmax(m, int, &a) && a == 2);
     m = mm_drop(m);
 
     m = mm_make(int, 512, cmp_int);
@@ -0,0 +1,480 @@
+/* Compares heaps that go through `minmax_cmpfn` against keyed heaps and
+ * ones defined with `MINMAX_DEFINE` on 8-byte keys, both for bulk loads and
+ * drains of small and large heaps and for a scheduler-like queue that stays
+ * the same size, both small and past the size of the caches, and on the same
+ * queue with 64-byte entries. The queue past the size of the caches is also
+ * run on the layouts that `minmax.h` doesn't use. Also compares loading heaps
+ * an element at a time with loading them in batches, and looking at the
+ * smallest few elements by taking them out and putting them back with peeking
+ * at them. Rescheduling tasks through handles is compared with leaving stale
+ * copies of them in the heap. */
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include "../minmax.h"
+
+MINMAX_EXTERN_DECL;
+
+#define BULK 1000000
+#define LARGE 8000000
+#define QUEUE 65536
+#define HUGE 16000000
+#define HOLDS 4000000
+
+typedef struct entry {
+    uint64_t key;
+    char payload[56];
+} entry;
+
+typedef struct timer {
+    uint64_t deadline;
+    uint32_t id, gen;
+} timer;
+
+#define u64_less(a, b) ((a) < (b))
+#define entry_less(a, b) ((a).key < (b).key)
+
+MINMAX_DEFINE(u64heap, uint64_t, u64_less)
+MINMAX_DEFINE(entryheap, entry, entry_less)
+
+int
+cmp_u64(void *restrict u, void *restrict u1) {
+    uint64_t u_ = *(uint64_t *)u, u1_ = *(uint64_t *)u1;
+    return u_ > u1_ ? 1 : u_ < u1_ ? -1 : 0;
+}
+
+int
+cmp_entry(void *restrict e, void *restrict e1) {
+    return cmp_u64(&((entry *)e)->key, &((entry *)e1)->key);
+}
+
+int
+cmp_timer(void *restrict t, void *restrict t1) {
+    return cmp_u64(&((timer *)t)->deadline, &((timer *)t1)->deadline);
+}
+
+double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+uint64_t seed = 88172645463325252ull;
+
+uint64_t
+xorshift(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    return seed ^= seed << 17;
+}
+
+double
+bench_bulk(minmax *m, int n) {
+    double start = now();
+    for (int i = 0; i < n; i++) {
+        mm_insert(m, uint64_t, xorshift());
+    }
+    uint64_t u;
+    for (int i = 0; i < n; i++) {
+        assert(i % 2 ?
+            mm_pollmax(m, uint64_t, &u) : mm_pollmin(m, uint64_t, &u));
+    }
+    double t = now() - start;
+    mm_drop(m);
+    return t;
+}
+
+double
+bench_bulk_typed(int n) {
+    u64heap *m = u64heap_make(16);
+    double start = now();
+    for (int i = 0; i < n; i++) {
+        u64heap_insert(m, xorshift());
+    }
+    uint64_t u;
+    for (int i = 0; i < n; i++) {
+        assert(i % 2 ? u64heap_pollmax(m, &u) : u64heap_pollmin(m, &u));
+    }
+    double t = now() - start;
+    u64heap_drop(m);
+    return t;
+}
+
+/* Every task that runs schedules another one a random amount later. */
+double
+bench_queue(minmax *m, int n) {
+    for (int i = 0; i < n; i++) {
+        mm_insert(m, uint64_t, xorshift() % (1u << 30));
+    }
+    double start = now();
+    uint64_t u;
+    for (int i = 0; i < HOLDS; i++) {
+        assert(mm_pollmin(m, uint64_t, &u));
+        mm_insert(m, uint64_t, u + (xorshift() % (1u << 30)));
+    }
+    double t = now() - start;
+    mm_drop(m);
+    return t;
+}
+
+double
+bench_queue_typed(int n) {
+    u64heap *m = u64heap_make(n);
+    for (int i = 0; i < n; i++) {
+        u64heap_insert(m, xorshift() % (1u << 30));
+    }
+    double start = now();
+    uint64_t u;
+    for (int i = 0; i < HOLDS; i++) {
+        assert(u64heap_pollmin(m, &u));
+        u64heap_insert(m, u + (xorshift() % (1u << 30)));
+    }
+    double t = now() - start;
+    u64heap_drop(m);
+    return t;
+}
+
+/* Bare min-max heaps of `uint64_t` in the layouts that `minmax.h` passed
+ * over. Nodes have `1 << shift` children, and `blocked` puts the two children
+ * and four grandchildren of each node on a min level together in a 64-byte
+ * block, with the root alone in the first one. They only do what the queue
+ * needs. */
+typedef struct layout {
+    uint64_t *heap;
+    size_t len;
+} layout;
+
+__attribute__((always_inline)) static inline uint64_t *
+layout_at(layout *l, size_t index, bool blocked) {
+    if (!blocked || index == 0) {
+        return l->heap + index;
+    }
+    unsigned level = 63 - __builtin_clzll((unsigned long long)index + 1);
+    size_t top, off;
+    if (level % 2) {
+        top = (index - 1) / 2;
+        off = index - (2 * top) - 1;
+        level--;
+    } else {
+        top = (index - 3) / 4;
+        off = index - (4 * top) - 1;
+        level -= 2;
+    }
+    size_t first = ((size_t)1 << level) - 1;
+    return l->heap + 8 + (8 * ((first / 3) + top - first)) + off;
+}
+
+__attribute__((always_inline)) static inline bool
+layout_max(size_t index, unsigned shift) {
+    size_t n = ((((size_t)1 << shift) - 1) * index) + 1;
+    return ((63 - __builtin_clzll((unsigned long long)n)) / shift) % 2;
+}
+
+__attribute__((always_inline)) static inline void
+layout_insert(layout *l, uint64_t u, unsigned shift, bool blocked) {
+    size_t index = l->len++;
+    if (index > 0) {
+        size_t pindex = (index - 1) >> shift;
+        bool max = layout_max(index, shift);
+        uint64_t *p = layout_at(l, pindex, blocked);
+        if (max ? u < *p : u > *p) {
+            *layout_at(l, index, blocked) = *p;
+            index = pindex;
+            max = !max;
+        }
+        while (index > ((size_t)1 << shift)) {
+            size_t gindex = (((index - 1) >> shift) - 1) >> shift;
+            uint64_t *g = layout_at(l, gindex, blocked);
+            if (max ? u <= *g : u >= *g) {
+                break;
+            }
+            *layout_at(l, index, blocked) = *g;
+            index = gindex;
+        }
+    }
+    *layout_at(l, index, blocked) = u;
+}
+
+/* With `prefetch` set, each step of a binary heap also fetches the three
+ * cache lines that hold the children and grandchildren of all four
+ * grandchildren, one of which the next step looks at. */
+__attribute__((always_inline)) static inline uint64_t
+layout_pollmin(layout *l, unsigned shift, bool blocked, bool prefetch) {
+    uint64_t min = *layout_at(l, 0, blocked);
+    uint64_t u = *layout_at(l, --l->len, blocked);
+    size_t index = 0, cindex, d = (size_t)1 << shift;
+    while ((cindex = (index << shift) + 1) < l->len) {
+        size_t best = cindex, gindex = (cindex << shift) + 1;
+        if (prefetch && gindex < l->len) {
+            size_t next = (gindex << shift) + 1;
+            __builtin_prefetch(layout_at(l, next, blocked));
+            __builtin_prefetch(layout_at(l, (next << shift) + 1, blocked));
+            __builtin_prefetch(layout_at(l, (next << shift) + 9, blocked));
+        }
+        for (size_t i = cindex + 1; i < cindex + d && i < l->len; i++) {
+            if (*layout_at(l, i, blocked) < *layout_at(l, best, blocked)) {
+                best = i;
+            }
+        }
+        for (size_t i = gindex; i < gindex + (d * d) && i < l->len; i++) {
+            if (*layout_at(l, i, blocked) < *layout_at(l, best, blocked)) {
+                best = i;
+            }
+        }
+
+        uint64_t *b = layout_at(l, best, blocked);
+        if (*b >= u) {
+            break;
+        }
+        *layout_at(l, index, blocked) = *b;
+        index = best;
+        if (best < gindex) {
+            break;
+        }
+        uint64_t *p = layout_at(l, (best - 1) >> shift, blocked);
+        if (*p < u) {
+            uint64_t t = *p;
+            *p = u;
+            u = t;
+        }
+    }
+    *layout_at(l, index, blocked) = u;
+    return min;
+}
+
+/* The queue from `bench_queue` on one of the layouts above. The blocked
+ * layout leaves gaps and needs up to about 2.7 slots per element. */
+__attribute__((always_inline)) static inline double
+bench_layout(int n, unsigned shift, bool blocked, bool prefetch) {
+    size_t cap = ((blocked ? 3 : 1) * (size_t)n) + 16;
+    layout l = {malloc(cap * sizeof(uint64_t)), 0};
+    assert(l.heap);
+    for (int i = 0; i < n; i++) {
+        layout_insert(&l, xorshift() % (1u << 30), shift, blocked);
+    }
+    double start = now();
+    uint64_t u, last = 0;
+    for (int i = 0; i < HOLDS; i++) {
+        u = layout_pollmin(&l, shift, blocked, prefetch);
+        assert(u >= last);
+        last = u;
+        layout_insert(&l, u + (xorshift() % (1u << 30)), shift, blocked);
+    }
+    double t = now() - start;
+    free(l.heap);
+    return t;
+}
+
+double
+bench_wide(minmax *m) {
+    entry e = {0};
+    for (int i = 0; i < QUEUE; i++) {
+        e.key = xorshift() % (1u << 30);
+        mm_insert(m, entry, e);
+    }
+    double start = now();
+    for (int i = 0; i < HOLDS; i++) {
+        assert(mm_pollmin(m, entry, &e));
+        e.key += xorshift() % (1u << 30);
+        mm_insert(m, entry, e);
+    }
+    double t = now() - start;
+    mm_drop(m);
+    return t;
+}
+
+double
+bench_wide_typed(void) {
+    entryheap *m = entryheap_make(QUEUE);
+    entry e = {0};
+    for (int i = 0; i < QUEUE; i++) {
+        e.key = xorshift() % (1u << 30);
+        entryheap_insert(m, e);
+    }
+    double start = now();
+    for (int i = 0; i < HOLDS; i++) {
+        assert(entryheap_pollmin(m, &e));
+        e.key += xorshift() % (1u << 30);
+        entryheap_insert(m, e);
+    }
+    double t = now() - start;
+    entryheap_drop(m);
+    return t;
+}
+
+/* Loads `n` random or ascending elements in batches of `batch`, or one at a
+ * time if `batch` is 0. */
+double
+bench_batch(int n, int batch, bool ascending) {
+    uint64_t *arr = malloc(n * sizeof(*arr));
+    for (int i = 0; i < n; i++) {
+        arr[i] = ascending ? (uint64_t)i : xorshift();
+    }
+    minmax *m = mm_make(uint64_t, 16, cmp_u64);
+    double start = now();
+    if (batch == 0) {
+        for (int i = 0; i < n; i++) {
+            mm_insert(m, uint64_t, arr[i]);
+        }
+    } else {
+        for (int i = 0; i < n; i += batch) {
+            mm_insertn(m, uint64_t, arr + i, n - i < batch ? n - i : batch);
+        }
+    }
+    double t = now() - start;
+    assert(mm_len(m) == (size_t)n);
+    mm_drop(m);
+    free(arr);
+    return t;
+}
+
+/* Looks at the `k` smallest elements of a heap, either by polling them and
+ * inserting them again or by peeking at them. */
+double
+bench_peekn(size_t k, bool peek) {
+    minmax *m = mm_make(uint64_t, QUEUE, cmp_u64);
+    for (int i = 0; i < QUEUE; i++) {
+        mm_insert(m, uint64_t, xorshift());
+    }
+    uint64_t *elts = malloc(k * sizeof(*elts)), sum = 0;
+    double start = now();
+    for (size_t i = 0; i < HOLDS / k; i++) {
+        if (peek) {
+            assert(mm_peekminn(m, uint64_t, elts, k) == k);
+        } else {
+            assert(mm_pollminn(m, uint64_t, elts, k) == k);
+            mm_insertn(m, uint64_t, elts, k);
+        }
+        sum += elts[k - 1];
+    }
+    double t = now() - start;
+    assert(sum > 0);
+    free(elts);
+    mm_drop(m);
+    return t;
+}
+
+/* Alternates between moving a random task to a new deadline and running the
+ * next one, either through handles or by inserting a new copy of the task and
+ * skipping the copies that have gone stale. Returns the final length of the
+ * heap in `len`. */
+double
+bench_reschedule(bool handles, size_t *len) {
+    minmax *m = mm_make(timer, QUEUE, cmp_timer);
+    if (handles) {
+        mm_addressable(m);
+    }
+    uint32_t *gens = calloc(QUEUE, sizeof(*gens));
+    size_t *hs = malloc(QUEUE * sizeof(*hs));
+    for (uint32_t i = 0; i < QUEUE; i++) {
+        mm_inserth(m, timer, ((timer){xorshift() % (1u << 30), i, 0}), hs + i);
+    }
+    double start = now();
+    uint64_t clock = 0;
+    for (int i = 0; i < HOLDS; i++) {
+        uint32_t id = xorshift() % QUEUE;
+        uint64_t deadline = clock + (xorshift() % (1u << 30));
+        if (handles) {
+            mm_at(m, timer, hs[id])->deadline = deadline;
+            mm_update(m, hs[id]);
+        } else {
+            mm_insert(m, timer, ((timer){deadline, id, ++gens[id]}));
+        }
+
+        timer t;
+        do {
+            assert(mm_pollmin(m, timer, &t));
+        } while (!handles && t.gen != gens[t.id]);
+        clock = t.deadline;
+        t.deadline += xorshift() % (1u << 30);
+        t.gen = handles ? 0 : ++gens[t.id];
+        mm_inserth(m, timer, t, hs + t.id);
+    }
+    double t = now() - start;
+    *len = mm_len(m);
+    free(gens);
+    free(hs);
+    mm_drop(m);
+    return t;
+}
+
+/* How levels used to be worked out. */
+bool
+level_log2(size_t index) {
+    return (unsigned)(log2(index + 1)) % 2;
+}
+
+double
+bench_level(bool (*level)(size_t)) {
+    double start = now();
+    size_t maxc = 0;
+    for (size_t i = 0; i < 16 * LARGE; i++) {
+        maxc += level(i ^ (i >> 3));
+    }
+    double t = now() - start;
+    assert(maxc > 0);
+    return t;
+}
+
+void
+report(const char *name, double cmpfn, double keyed, double typed) {
+    printf("%-6s cmpfn %.3fs, keyed %.3fs (%.1fx), typed %.3fs (%.1fx)\n",
+        name, cmpfn, keyed, cmpfn / keyed, typed, cmpfn / typed);
+}
+
+int
+main(void) {
+    report("bulk:",
+        bench_bulk(mm_make(uint64_t, 16, cmp_u64), BULK),
+        bench_bulk(mm_make_keyed(uint64_t, 16, 0, uint64_t), BULK),
+        bench_bulk_typed(BULK));
+    report("large:",
+        bench_bulk(mm_make(uint64_t, 16, cmp_u64), LARGE),
+        bench_bulk(mm_make_keyed(uint64_t, 16, 0, uint64_t), LARGE),
+        bench_bulk_typed(LARGE));
+    report("queue:",
+        bench_queue(mm_make(uint64_t, QUEUE, cmp_u64), QUEUE),
+        bench_queue(mm_make_keyed(uint64_t, QUEUE, 0, uint64_t), QUEUE),
+        bench_queue_typed(QUEUE));
+    report("huge:",
+        bench_queue(mm_make(uint64_t, HUGE, cmp_u64), HUGE),
+        bench_queue(mm_make_keyed(uint64_t, HUGE, 0, uint64_t), HUGE),
+        bench_queue_typed(HUGE));
+    double binary = bench_layout(HUGE, 1, false, false);
+    double fetched = bench_layout(HUGE, 1, false, true);
+    double blocked = bench_layout(HUGE, 1, true, false);
+    double four = bench_layout(HUGE, 2, false, false);
+    double eight = bench_layout(HUGE, 3, false, false);
+    printf("layout: binary %.3fs, prefetch %.3fs (%.1fx), blocked %.3fs "
+        "(%.1fx), 4-ary %.3fs (%.1fx), 8-ary %.3fs (%.1fx)\n", binary,
+        fetched, binary / fetched, blocked, binary / blocked, four,
+        binary / four, eight, binary / eight);
+    report("wide:",
+        bench_wide(mm_make(entry, QUEUE, cmp_entry)),
+        bench_wide(mm_make_keyed(entry, QUEUE, 0, uint64_t)),
+        bench_wide_typed());
+    for (int ascending = 0; ascending < 2; ascending++) {
+        double one = bench_batch(LARGE, 0, ascending);
+        double all = bench_batch(LARGE, LARGE, ascending);
+        double some = bench_batch(LARGE, QUEUE, ascending);
+        printf("%-6s insert %.3fs, insertn %.3fs (%.1fx), "
+            "insertn by %d %.3fs (%.1fx)\n", ascending ? "asc:" : "rand:",
+            one, all, one / all, QUEUE, some, one / some);
+    }
+    for (size_t k = 4; k <= 256; k *= 8) {
+        double poll = bench_peekn(k, false), peek = bench_peekn(k, true);
+        printf("peek %-3zu poll and insert %.3fs, peekminn %.3fs (%.1fx)\n",
+            k, poll, peek, poll / peek);
+    }
+    size_t stale, live;
+    double tomb = bench_reschedule(false, &stale);
+    double hand = bench_reschedule(true, &live);
+    printf("resched: stale copies %.3fs (%zu left), handles %.3fs (%zu, "
+        "%.1fx)\n", tomb, stale, hand, live, tomb / hand);
+    double libm = bench_level(level_log2);
+    double clz = bench_level(minmax_level_type_max_);
+    printf("levels: log2 %.3fs, clz %.3fs (%.1fx)\n", libm, clz, libm / clz);
+    return 0;
+}
@@ -0,0 +1,175 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include "../minmax.h"
+
+MINMAX_EXTERN_DECL;
+
+#define LIM 200000
+#define HANDLES 4096
+
+typedef struct task {
+    int deadline;
+    size_t handle;
+} task;
+
+int
+cmp_task(void *restrict t, void *restrict t1) {
+    int d = ((task *)t)->deadline, d1 = ((task *)t1)->deadline;
+    return d > d1 ? 1 : d < d1 ? -1 : 0;
+}
+
+void
+verify_task_heap(minmax *m) {
+    task *heap = (task *)m->heap;
+    for (size_t i = 1; i < mm_len(m); i++) {
+        int parent = heap[minmax_parent_(i)].deadline;
+        int self = heap[i].deadline;
+        if (minmax_level_type_max_(i)) {
+            assert(self >= parent);
+        } else {
+            assert(self <= parent);
+        }
+        assert(self >= heap[0].deadline);
+    }
+}
+
+/* Runs random operations on an addressable heap and checks every element
+ * against `deadlines`, indexed by handle, where -1 means there is none. */
+void
+test_handles(minmax *m) {
+    int deadlines[HANDLES];
+    size_t live = 0, maxlive = 0;
+    for (size_t h = 0; h < HANDLES; h++) {
+        deadlines[h] = -1;
+    }
+    for (int i = 0; i < LIM; i++) {
+        size_t h = (size_t)rand() % HANDLES;
+        task t;
+        switch (rand() % 8) {
+        case 0:
+        case 1:
+        case 2:
+        case 3:
+            if (live == HANDLES) {
+                break;
+            }
+            t.deadline = rand() % 1000;
+            mm_inserth(m, task, t, &h);
+            assert(h < HANDLES && deadlines[h] == -1);
+            mm_at(m, task, h)->handle = h;
+            deadlines[h] = t.deadline;
+            maxlive = ++live > maxlive ? live : maxlive;
+            break;
+        case 4:
+        case 5:
+            if (deadlines[h] != -1) {
+                task *tp = mm_at(m, task, h);
+                assert(tp->deadline == deadlines[h] && tp->handle == h);
+                tp->deadline = deadlines[h] = rand() % 1000;
+                mm_update(m, h);
+            }
+            break;
+        case 6:
+            if (deadlines[h] != -1) {
+                mm_remove(m, h);
+                deadlines[h] = -1;
+                live--;
+            }
+            break;
+        default:
+            if (rand() % 2 ?
+                mm_pollmin(m, task, &t) : mm_pollmax(m, task, &t)) {
+                assert(deadlines[t.handle] == t.deadline);
+                deadlines[t.handle] = -1;
+                live--;
+            }
+        }
+        assert(mm_len(m) == live);
+        if (i % 1000 == 0) {
+            verify_task_heap(m);
+            for (size_t h1 = 0; h1 < HANDLES; h1++) {
+                if (deadlines[h1] != -1) {
+                    assert(mm_at(m, task, h1)->deadline == deadlines[h1]);
+                }
+            }
+        }
+    }
+
+    /* Removed elements don't leave anything behind. */
+    assert(m->hlen == maxlive);
+    for (size_t h = 0; h < HANDLES; h++) {
+        if (deadlines[h] != -1) {
+            mm_remove(m, h);
+        }
+    }
+    assert(mm_len(m) == 0);
+    mm_drop(m);
+}
+
+int
+main(void) {
+    srand(time(NULL));
+
+    test_handles(mm_addressable(mm_make(task, 1, cmp_task)));
+    test_handles(mm_addressable(
+        mm_make_keyed(task, 1, offsetof(task, deadline), int)));
+
+    /* Decreasing and increasing deadlines moves them to either end. */
+    minmax *m = mm_addressable(mm_make(task, 16, cmp_task));
+    size_t handles[100];
+    for (int i = 0; i < 100; i++) {
+        mm_inserth(m, task, ((task){.deadline = i}), handles + i);
+        mm_at(m, task, handles[i])->handle = handles[i];
+    }
+    mm_at(m, task, handles[50])->deadline = -1;
+    mm_update(m, handles[50]);
+    mm_at(m, task, handles[0])->deadline = 1000;
+    mm_update(m, handles[0]);
+    task t;
+    assert(mm_peekmin(m, task, &t) && t.handle == handles[50]);
+    assert(mm_peekmax(m, task, &t) && t.handle == handles[0]);
+    task ts[3];
+    assert(mm_pollminn(m, task, ts, 3) == 3);
+    assert(ts[0].deadline == -1 && ts[1].deadline == 1 && ts[2].deadline == 2);
+    mm_remove(m, handles[3]);
+    assert(mm_pollmin(m, task, &t) && t.deadline == 4);
+    verify_task_heap(m);
+    mm_drop(m);
+
+    /* Batches hand out a handle per element whether they're heapified or
+     * bubbled up. */
+    m = mm_addressable(mm_make(task, 1, cmp_task));
+    task batch[64];
+    size_t bhandles[64];
+    for (int n = 0; n < 40; n++) {
+        size_t k = n % 2 ? 64 : (size_t)rand() % 4;
+        for (size_t i = 0; i < k; i++) {
+            batch[i].deadline = rand() % 1000;
+        }
+        mm_insertnh(m, task, batch, k, bhandles);
+        for (size_t i = 0; i < k; i++) {
+            task *tp = mm_at(m, task, bhandles[i]);
+            assert(tp->deadline == batch[i].deadline);
+            tp->handle = bhandles[i];
+        }
+        verify_task_heap(m);
+    }
+    assert(m->hlen == mm_len(m));
+    while (mm_len(m) > 0) {
+        assert(mm_peekmax(m, task, &t));
+        mm_remove(m, t.handle);
+        verify_task_heap(m);
+    }
+    mm_drop(m);
+
+    m = mm_make(task, 1, cmp_task);
+    bhandles[0] = 0;
+    mm_insertnh(m, task, batch, 1, bhandles);
+    assert(bhandles[0] == SIZE_MAX);
+    mm_drop(m);
+
+    printf("All tests passed\n");
+    return 0;
+}
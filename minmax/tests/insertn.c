@@ -0,0 +1,114 @@
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include "../minmax.h"
+
+MINMAX_EXTERN_DECL;
+
+#define LIM 300
+
+#define int_less(a, b) ((a) < (b))
+
+MINMAX_DEFINE(intheap, int, int_less)
+
+int
+cmp_int(void *restrict i, void *restrict i1) {
+    int i_ = *(int *)i, i1_ = *(int *)i1;
+    return i_ > i1_ ? 1 : i_ < i1_ ? -1 : 0;
+}
+
+int
+cmp_sort(const void *i, const void *i1) {
+    return cmp_int((void *)i, (void *)i1);
+}
+
+void
+verify_int_heap(int *heap, size_t len) {
+    for (size_t i = 1; i < len; i++) {
+        int parent = heap[minmax_parent_(i)], self = heap[i];
+        if (minmax_level_type_max_(i)) {
+            assert(self >= parent);
+        } else {
+            assert(self <= parent);
+        }
+        assert(self >= heap[0]);
+    }
+}
+
+/* Fills `arr` with random, ascending or descending elements. */
+void
+fill(int *arr, size_t n, int order) {
+    for (size_t i = 0; i < n; i++) {
+        arr[i] = order == 0 ? rand() % 1000 :
+            order == 1 ? (int)i : -(int)i;
+    }
+}
+
+/* Every element that went in comes back out in order. */
+void
+drain(minmax *m, intheap *t, int *sorted, size_t len) {
+    qsort(sorted, len, sizeof(int), cmp_sort);
+    int i;
+    for (size_t j = 0; j < len; j++) {
+        assert(mm_pollmin(m, int, &i) && i == sorted[j]);
+        assert(intheap_pollmin(t, &i) && i == sorted[j]);
+    }
+    assert(!mm_pollmin(m, int, &i) && !intheap_pollmin(t, &i));
+}
+
+int
+main(void) {
+    srand(time(NULL));
+
+    /* Batches of every size, both smaller and larger than the heap, so that
+     * both the bubbling and heapifying paths are taken. */
+    int *arr = malloc(LIM * sizeof(int));
+    int *sorted = malloc(4 * LIM * sizeof(int));
+    for (size_t len = 0; len < LIM; len += 1 + len / 4) {
+        for (size_t n = 0; n < LIM; n += 1 + n / 8) {
+            for (int order = 0; order < 3; order++) {
+                minmax *m = mm_make(int, 1, cmp_int);
+                intheap *t = intheap_make(1);
+                fill(sorted, len, (order + 1) % 3);
+                for (size_t i = 0; i < len; i++) {
+                    mm_insert(m, int, sorted[i]);
+                    intheap_insert(t, sorted[i]);
+                }
+                fill(arr, n, order);
+                mm_insertn(m, int, arr, n);
+                intheap_insertn(t, arr, n);
+                assert(mm_len(m) == len + n && mm_len(t) == len + n);
+                assert(m->cap >= len + n && t->cap >= len + n);
+                verify_int_heap((int *)m->heap, mm_len(m));
+                verify_int_heap(t->heap, mm_len(t));
+                memcpy(sorted + len, arr, n * sizeof(int));
+                drain(m, t, sorted, len + n);
+                m = mm_drop(m);
+                t = intheap_drop(t);
+            }
+        }
+    }
+
+    /* Keyed heaps fill in the keys of the whole batch. */
+    for (size_t n = 1; n < LIM; n *= 3) {
+        minmax *m = mm_make_keyed(int, 1, 0, int);
+        intheap *t = intheap_make(1);
+        size_t len = 0;
+        for (int round = 0; round < 4; round++) {
+            fill(arr, n, round % 3);
+            mm_insertn(m, int, arr, n);
+            intheap_insertn(t, arr, n);
+            memcpy(sorted + len, arr, n * sizeof(int));
+            len += n;
+            verify_int_heap((int *)m->heap, mm_len(m));
+        }
+        drain(m, t, sorted, len);
+        m = mm_drop(m);
+        t = intheap_drop(t);
+    }
+    free(arr);
+    free(sorted);
+
+    printf("All tests passed\n");
+    return 0;
+}
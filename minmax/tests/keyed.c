@@ -0,0 +1,121 @@
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include "../minmax.h"
+
+MINMAX_EXTERN_DECL;
+
+#define LIM 20000
+
+typedef struct entry {
+    char tag;
+    int8_t i8;
+    uint16_t u16;
+    int32_t i32;
+    uint64_t u64;
+    float f;
+    double d;
+    char payload[32];
+} entry;
+
+#define cmp(T, field) \
+    int \
+    cmp_##field(void *restrict e, void *restrict e1) { \
+        T k = ((entry *)e)->field, k1 = ((entry *)e1)->field; \
+        return k > k1 ? 1 : k < k1 ? -1 : 0; \
+    }
+
+cmp(int8_t, i8)
+cmp(uint16_t, u16)
+cmp(int32_t, i32)
+cmp(uint64_t, u64)
+cmp(float, f)
+cmp(double, d)
+
+uint64_t
+rand_u64(void) {
+    return ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ rand();
+}
+
+entry
+rand_entry(void) {
+    uint64_t u = rand_u64();
+    entry e = {
+        .tag = 'e',
+        .i8 = (int8_t)u,
+        .u16 = (uint16_t)u,
+        .i32 = (int32_t)u,
+        .u64 = u,
+        .f = (float)((int64_t)u % 2000000) / 7,
+        .d = (double)(int64_t)u / 3,
+    };
+    snprintf(e.payload, sizeof(e.payload), "%llu", (unsigned long long)u);
+    return e;
+}
+
+/* Runs the same operations on a keyed heap and a heap with a `cmpfn` for the
+ * same key, which have to agree on every key that comes out. */
+void
+test_keyed(minmax *m, minmax *m1, minmax_cmpfn cmpfn) {
+    entry e, e1;
+    for (int i = 0; i < LIM; i++) {
+        int op = rand() % 4;
+        if (op < 2) {
+            e = rand_entry();
+            mm_insert(m, entry, e);
+            mm_insert(m1, entry, e);
+            continue;
+        }
+        bool ok = op == 2 ?
+            mm_pollmin(m, entry, &e) : mm_pollmax(m, entry, &e);
+        assert(ok == (op == 2 ?
+            mm_pollmin(m1, entry, &e1) : mm_pollmax(m1, entry, &e1)));
+        if (ok) {
+            assert(cmpfn(&e, &e1) == 0 && e.tag == 'e');
+            assert(strtoull(e.payload, NULL, 10) == e.u64);
+        }
+    }
+    assert(mm_len(m) == mm_len(m1));
+    mm_shrink(m);
+    while (mm_pollmin(m, entry, &e)) {
+        assert(mm_pollmin(m1, entry, &e1) && cmpfn(&e, &e1) == 0);
+    }
+    mm_drop(m);
+    mm_drop(m1);
+}
+
+#define test(T, field) test_keyed( \
+    mm_make_keyed(entry, 1, offsetof(entry, field), T), \
+    mm_make(entry, 1, cmp_##field), \
+    cmp_##field)
+
+int
+main(void) {
+    srand(time(NULL));
+
+    test(int8_t, i8);
+    test(uint16_t, u16);
+    test(int32_t, i32);
+    test(uint64_t, u64);
+    test(float, f);
+    test(double, d);
+
+    /* Floating point keys sort like numbers, infinities included. */
+    double ds[] = {3.5, -0.25, INFINITY, 0.0, -1e300, -INFINITY, 1e-300, -7};
+    size_t len = sizeof(ds) / sizeof(*ds);
+    double *arr = malloc(sizeof(ds));
+    memcpy(arr, ds, sizeof(ds));
+    minmax *m = mm_fromarr_keyed(double, len, len, 0, double, arr);
+    double d, prev = -INFINITY;
+    assert(mm_peekmax(m, double, &d) && d == INFINITY);
+    while (mm_pollmin(m, double, &d)) {
+        assert(d >= prev);
+        prev = d;
+    }
+    mm_drop(m);
+
+    printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include "../minmax.h"
+
+MINMAX_EXTERN_DECL;
+
+#define LIM 2000
+
+#define int_less(a, b) ((a) < (b))
+
+MINMAX_DEFINE(intheap, int, int_less)
+
+int
+cmp_int(void *restrict i, void *restrict i1) {
+    int i_ = *(int *)i, i1_ = *(int *)i1;
+    return i_ > i1_ ? 1 : i_ < i1_ ? -1 : 0;
+}
+
+int
+cmp_sort(const void *i, const void *i1) {
+    return cmp_int((void *)i, (void *)i1);
+}
+
+void
+verify_int_heap(minmax *m) {
+    int *heap = (int *)m->heap;
+    for (size_t i = 1; i < mm_len(m); i++) {
+        int parent = heap[minmax_parent_(i)], self = heap[i];
+        if (minmax_level_type_max_(i)) {
+            assert(self >= parent);
+        } else {
+            assert(self <= parent);
+        }
+        assert(self >= heap[0]);
+    }
+}
+
+/* Copies the heap into `sorted` in ascending order. */
+void
+sort_heap(minmax *m, int *sorted) {
+    memcpy(sorted, m->heap, mm_len(m) * sizeof(int));
+    qsort(sorted, mm_len(m), sizeof(int), cmp_sort);
+}
+
+/* Takes `k` elements from either end of the heap and checks them against a
+ * sorted copy of it. */
+void
+test_n(minmax *m, size_t k, bool max, bool poll, int *sorted, int *elts) {
+    size_t len = mm_len(m);
+    sort_heap(m, sorted);
+    size_t n = max ?
+        poll ? mm_pollmaxn(m, int, elts, k) : mm_peekmaxn(m, int, elts, k) :
+        poll ? mm_pollminn(m, int, elts, k) : mm_peekminn(m, int, elts, k);
+    assert(n == (k < len ? k : len));
+    for (size_t j = 0; j < n; j++) {
+        assert(elts[j] == sorted[max ? len - 1 - j : j]);
+    }
+    assert(mm_len(m) == (poll ? len - n : len));
+    verify_int_heap(m);
+    if (poll) {
+        sort_heap(m, elts);
+        assert(memcmp(elts, max ? sorted : sorted + n,
+            mm_len(m) * sizeof(int)) == 0);
+    }
+}
+
+int
+main(void) {
+    srand(time(NULL));
+
+    int *sorted = malloc(LIM * sizeof(int));
+    int *elts = malloc(LIM * sizeof(int));
+    int i;
+    minmax *m = mm_make(int, 1, cmp_int);
+    assert(mm_peekminn(m, int, elts, 4) == 0);
+    assert(mm_pollmaxn(m, int, elts, 4) == 0);
+    mm_insert(m, int, 7);
+    assert(mm_pollmaxn(m, int, elts, 0) == 0 && mm_len(m) == 1);
+    assert(mm_pollmaxn(m, int, elts, 4) == 1 && elts[0] == 7);
+    m = mm_drop(m);
+
+    /* Every `k` up to past the length of the heap, from both ends. */
+    for (size_t len = 1; len < LIM; len += 1 + len / 2) {
+        for (size_t k = 1; k <= len + 1; k += 1 + k / 4) {
+            for (int op = 0; op < 4; op++) {
+                m = op % 2 ?
+                    mm_make(int, 1, cmp_int) : mm_make_keyed(int, 1, 0, int);
+                for (size_t j = 0; j < len; j++) {
+                    mm_insert(m, int, rand() % (op < 2 ? 100 : 100000));
+                }
+                test_n(m, k, op % 2, false, sorted, elts);
+                test_n(m, k, op / 2, true, sorted, elts);
+                m = mm_drop(m);
+            }
+        }
+    }
+
+    /* Typed heaps agree with the generic ones. */
+    int *elts1 = malloc(LIM * sizeof(int));
+    for (size_t len = 1; len < LIM; len += 1 + len / 2) {
+        m = mm_make(int, 1, cmp_int);
+        intheap *t = intheap_make(1);
+        for (size_t j = 0; j < len; j++) {
+            i = rand() % 1000;
+            mm_insert(m, int, i);
+            intheap_insert(t, i);
+        }
+        for (size_t k = 0; mm_len(m) > 0; k++) {
+            size_t n = mm_peekminn(m, int, elts, k);
+            assert(intheap_peekminn(t, elts1, k) == n);
+            assert(memcmp(elts, elts1, n * sizeof(int)) == 0);
+            n = mm_peekmaxn(m, int, elts, k);
+            assert(intheap_peekmaxn(t, elts1, k) == n);
+            assert(memcmp(elts, elts1, n * sizeof(int)) == 0);
+            n = k % 2 ?
+                mm_pollmaxn(m, int, elts, k) : mm_pollminn(m, int, elts, k);
+            assert(n == (k % 2 ?
+                intheap_pollmaxn(t, elts1, k) : intheap_pollminn(t, elts1, k)));
+            assert(memcmp(elts, elts1, n * sizeof(int)) == 0);
+            assert(mm_len(t) == mm_len(m));
+        }
+        m = mm_drop(m);
+        t = intheap_drop(t);
+    }
+    free(elts1);
+
+    /* A mix of batches and single elements going in and out. */
+    m = mm_make(int, 1, cmp_int);
+    for (int round = 0; round < 5000; round++) {
+        switch (rand() % 4) {
+        case 0:
+            test_n(m, rand() % 16, rand() % 2, true, sorted, elts);
+            break;
+        case 1:
+            if (mm_len(m) > 0) {
+                assert(rand() % 2 ?
+                    mm_pollmin(m, int, &i) : mm_pollmax(m, int, &i));
+            }
+            break;
+        default:
+            if (mm_len(m) + 16 < LIM) {
+                for (int j = 0; j < 16; j++) {
+                    elts[j] = rand() % 1000;
+                }
+                mm_insertn(m, int, elts, rand() % 16);
+            }
+        }
+    }
+    verify_int_heap(m);
+    m = mm_drop(m);
+    free(sorted);
+    free(elts);
+
+    printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include "../minmax.h"
+
+MINMAX_EXTERN_DECL;
+
+typedef struct task {
+    uint64_t deadline;
+    char name[56];
+} task;
+
+#define u64_less(a, b) ((a) < (b))
+#define task_less(a, b) ((a).deadline < (b).deadline)
+
+MINMAX_DEFINE(u64heap, uint64_t, u64_less)
+MINMAX_DEFINE(taskheap, task, task_less)
+
+int
+cmp_u64(void *restrict u, void *restrict u1) {
+    uint64_t u_ = *(uint64_t *)u, u1_ = *(uint64_t *)u1;
+    return u_ > u1_ ? 1 : u_ < u1_ ? -1 : 0;
+}
+
+void
+verify_u64_heap(u64heap *m) {
+    for (size_t i = 1; i < mm_len(m); i++) {
+        uint64_t parent = m->heap[minmax_parent_(i)], self = m->heap[i];
+        if (minmax_level_type_max_(i)) {
+            assert(self >= parent);
+        } else {
+            assert(self <= parent);
+        }
+        assert(self >= m->heap[0]);
+    }
+}
+
+uint64_t
+rand_u64(void) {
+    return ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+}
+
+int
+main(void) {
+    srand(time(NULL));
+
+    /* Same results as the generic heap for a random mix of operations. */
+    u64heap *m = u64heap_make(1);
+    minmax *m1 = mm_make(uint64_t, 1, cmp_u64);
+    uint64_t u = 0, u1 = 0;
+    bool ok;
+    assert(!u64heap_peekmin(m, &u) && !u64heap_pollmax(m, &u));
+    for (int i = 0; i < 200000; i++) {
+        switch (rand() % 5) {
+        case 0:
+            ok = u64heap_pollmin(m, &u);
+            assert(ok == mm_pollmin(m1, uint64_t, &u1) && (!ok || u == u1));
+            break;
+        case 1:
+            ok = u64heap_pollmax(m, &u);
+            assert(ok == mm_pollmax(m1, uint64_t, &u1) && (!ok || u == u1));
+            break;
+        default:
+            u = rand_u64() % 1000;
+            u64heap_insert(m, u);
+            mm_insert(m1, uint64_t, u);
+        }
+        assert(mm_len(m) == mm_len(m1));
+        if (i % 1000 == 0) {
+            verify_u64_heap(m);
+        }
+    }
+    verify_u64_heap(m);
+    u64heap_shrink(m);
+    assert(m->cap >= mm_len(m));
+    while (u64heap_peekmax(m, &u)) {
+        assert(mm_pollmax(m1, uint64_t, &u1) && u == u1);
+        assert(u64heap_pollmax(m, &u1) && u == u1);
+    }
+    assert(mm_len(m1) == 0);
+    m = u64heap_drop(m);
+    m1 = mm_drop(m1);
+
+    uint64_t *arr = malloc(100000 * sizeof(*arr));
+    for (size_t i = 0; i < 100000; i++) {
+        arr[i] = rand_u64();
+    }
+    m = u64heap_fromarr(100000, 100000, arr);
+    verify_u64_heap(m);
+    u1 = 0;
+    while (u64heap_pollmin(m, &u)) {
+        assert(u >= u1);
+        u1 = u;
+    }
+    m = u64heap_drop(m);
+
+    /* Payloads travel with their keys. */
+    taskheap *t = taskheap_make(16);
+    for (int i = 0; i < 10000; i++) {
+        task tk = {.deadline = rand_u64()};
+        snprintf(tk.name, sizeof(tk.name), "%llu",
+            (unsigned long long)tk.deadline);
+        taskheap_insert(t, tk);
+    }
+    task tk, prev = {.deadline = UINT64_MAX};
+    assert(taskheap_peekmax(t, &tk));
+    while (taskheap_pollmax(t, &tk)) {
+        assert(tk.deadline <= prev.deadline);
+        assert(strtoull(tk.name, NULL, 10) == tk.deadline);
+        prev = tk;
+    }
+    t = taskheap_drop(t);
+
+    printf("All tests passed\n");
+    return 0;
+}
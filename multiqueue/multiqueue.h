@@ -0,0 +1,244 @@
+/* multiqueue.h v0.0.0
+ * Copyright 2018 iriri. All rights reserved. Use of this source code is
+ * governed by a BSD-style license which can be found in the LICENSE file.
+ *
+ * The relaxed ordering is that of "MultiQueues: Simple Relaxed Concurrent
+ * Priority Queues" by H. Rihani, P. Sanders, and R. Dementiev, extended to
+ * both ends with min-max heaps from `minmax.h`. */
+#ifndef MULTIQUEUE_H
+#define MULTIQUEUE_H
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../minmax/minmax.h"
+
+/* ------------------------------- Interface ------------------------------- */
+#define MULTIQUEUE_H_VERSION 0l // 0.0.0
+
+typedef struct multiqueue multiqueue;
+
+/* Exported "functions" */
+#define mmq_make(T, shardc, cmpfn) multiqueue_make(sizeof(T), shardc, cmpfn)
+#define mmq_make_keyed(T, shardc, offset, K) \
+    multiqueue_make_keyed( \
+        sizeof(T), shardc, offset, sizeof(K), mm_keykind_(K))
+#define mmq_drop(q) multiqueue_drop(q)
+
+#define mmq_insert(q, T, elt) mmq_insert_(q, T, elt, __LINE__)
+#define mmq_pollmin(q, T, elt) ( \
+    mmq_assert_(sizeof(T) == sizeof(*elt)), \
+    multiqueue_poll(q, sizeof(T), elt, false) \
+)
+#define mmq_pollmax(q, T, elt) ( \
+    mmq_assert_(sizeof(T) == sizeof(*elt)), \
+    multiqueue_poll(q, sizeof(T), elt, true) \
+)
+
+/* These declarations must be present in exactly one compilation unit. Note
+ * that `MINMAX_EXTERN_DECL` must also be present. */
+#define MULTIQUEUE_EXTERN_DECL \
+    _Thread_local uint64_t multiqueue_seed_; \
+    extern inline void multiqueue_assert_( \
+        const char *, unsigned, const char *) __attribute__((noreturn)); \
+    extern inline multiqueue *multiqueue_make( \
+        size_t, size_t, minmax_cmpfn); \
+    extern inline multiqueue *multiqueue_make_keyed( \
+        size_t, size_t, size_t, size_t, unsigned); \
+    extern inline multiqueue *multiqueue_drop(multiqueue *); \
+    extern inline size_t multiqueue_rand_(size_t); \
+    extern inline multiqueue_shard_ *multiqueue_lock_(multiqueue *); \
+    extern inline void multiqueue_insert(multiqueue *, size_t, const void *); \
+    extern inline size_t multiqueue_top_(minmax *, bool); \
+    extern inline bool multiqueue_before_(minmax *, minmax *, bool); \
+    extern inline bool multiqueue_poll(multiqueue *, size_t, void *, bool)
+
+/* ---------------------------- Implementation ---------------------------- */
+/* Each shard is a heap behind its own lock. Shards are aligned to cache lines
+ * so that threads working on different shards don't contend. */
+typedef struct multiqueue_shard_ {
+    alignas(64) pthread_mutex_t lock;
+    minmax *m;
+} multiqueue_shard_;
+
+struct multiqueue {
+    size_t eltsize, shardc;
+    multiqueue_shard_ *shards;
+};
+
+extern _Thread_local uint64_t multiqueue_seed_;
+
+#define MULTIQUEUE_SHARD_CAP_ 64
+#define MULTIQUEUE_TRIES_ 4
+
+/* Almost hygenic... */
+#define mmq_sym_(sym, id) MMQ_##sym##id##_
+
+#define mmq_insert_(q, T, elt, id) \
+    do { \
+        mmq_assert_(sizeof(T) == sizeof(elt)); \
+        T mmq_sym_(e, id) = elt; \
+        multiqueue_insert(q, sizeof(T), &mmq_sym_(e, id)); \
+    } while (0)
+
+/* `mmq_assert_` never becomes a noop, even when `NDEBUG` is set. */
+#define mmq_assert_(pred) \
+    (__builtin_expect(!(pred), 0) ? \
+        multiqueue_assert_(__FILE__, __LINE__, #pred) : (void)0)
+
+__attribute__((noreturn)) inline void
+multiqueue_assert_(const char *file, unsigned line, const char *pred) {
+    fprintf(stderr, "Failed assertion: %s, %u, %s\n", file, line, pred);
+    abort();
+}
+
+/* Allocates and initializes a new queue of `shardc` heaps. `cmpfn` is as for
+ * `minmax_make`. */
+inline multiqueue *
+multiqueue_make(size_t eltsize, size_t shardc, minmax_cmpfn cmpfn) {
+    multiqueue *q;
+    mmq_assert_(0 < shardc && shardc < SIZE_MAX / sizeof(q->shards[0]));
+    mmq_assert_((q = malloc(sizeof(*q))));
+    mmq_assert_((q->shards = aligned_alloc(
+        alignof(multiqueue_shard_), shardc * sizeof(q->shards[0]))));
+    q->eltsize = eltsize;
+    q->shardc = shardc;
+    for (size_t i = 0; i < shardc; i++) {
+        mmq_assert_(pthread_mutex_init(&q->shards[i].lock, NULL) == 0);
+        q->shards[i].m = minmax_make(eltsize, MULTIQUEUE_SHARD_CAP_, cmpfn);
+    }
+    return q;
+}
+
+/* Like `multiqueue_make` but every shard is keyed as with
+ * `minmax_make_keyed`. */
+inline multiqueue *
+multiqueue_make_keyed(
+    size_t eltsize,
+    size_t shardc,
+    size_t keyoff,
+    size_t keysize,
+    unsigned keykind
+) {
+    multiqueue *q = multiqueue_make(eltsize, shardc, NULL);
+    for (size_t i = 0; i < shardc; i++) {
+        minmax_keyed_(q->shards[i].m, keyoff, keysize, keykind);
+    }
+    return q;
+}
+
+/* Deallocates all resources associated with the queue and returns `NULL`. No
+ * other thread may be using it. */
+inline multiqueue *
+multiqueue_drop(multiqueue *q) {
+    for (size_t i = 0; i < q->shardc; i++) {
+        pthread_mutex_destroy(&q->shards[i].lock);
+        minmax_drop(q->shards[i].m);
+    }
+    free(q->shards);
+    free(q);
+    return NULL;
+}
+
+/* Every thread has its own xorshift state, seeded from where it lives. */
+inline size_t
+multiqueue_rand_(size_t n) {
+    uint64_t seed = multiqueue_seed_;
+    if (seed == 0) {
+        seed = (uint64_t)(uintptr_t)&multiqueue_seed_ | 1;
+    }
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    multiqueue_seed_ = seed;
+    return seed % n;
+}
+
+/* Locks a random shard, moving on to another one while the ones it picks are
+ * busy and only waiting after a few tries. */
+inline multiqueue_shard_ *
+multiqueue_lock_(multiqueue *q) {
+    for (int i = 0; ; i++) {
+        multiqueue_shard_ *s = q->shards + multiqueue_rand_(q->shardc);
+        if (i == MULTIQUEUE_TRIES_) {
+            pthread_mutex_lock(&s->lock);
+            return s;
+        }
+        if (pthread_mutex_trylock(&s->lock) == 0) {
+            return s;
+        }
+    }
+}
+
+/* Inserts a copy of `elt` into a random shard. */
+inline void
+multiqueue_insert(multiqueue *q, size_t eltsize, const void *elt) {
+    mmq_assert_(eltsize == q->eltsize);
+    multiqueue_shard_ *s = multiqueue_lock_(q);
+    memcpy(minmax_push_(s->m, eltsize), elt, eltsize);
+    minmax_insert_(s->m, s->m->len++, eltsize);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* The index of the smallest or largest element of a non-empty heap. */
+inline size_t
+multiqueue_top_(minmax *m, bool max) {
+    return max ? minmax_maxindex_(m, m->eltsize) : 0;
+}
+
+/* Whether the smallest or largest element of `m` goes before that of `m1`.
+ * Empty heaps go after everything. */
+inline bool
+multiqueue_before_(minmax *m, minmax *m1, bool max) {
+    if (m->len == 0 || m1->len == 0) {
+        return m->len > 0;
+    }
+    size_t index = multiqueue_top_(m, max), index1 = multiqueue_top_(m1, max);
+    int cmp;
+    if (m->keys) {
+        uint64_t key = m->keys[index], key1 = m1->keys[index1];
+        cmp = (key > key1) - (key < key1);
+    } else {
+        cmp = m->cmpfn(
+            m->heap + (index * m->eltsize), m1->heap + (index1 * m->eltsize));
+    }
+    return max ? cmp > 0 : cmp < 0;
+}
+
+/* Takes the smallest or largest element of the better of two random shards.
+ * The second shard is skipped if it is busy. If both are empty, every shard is
+ * tried in turn, so `false` is only returned if each of them was empty when it
+ * was looked at. */
+inline bool
+multiqueue_poll(multiqueue *q, size_t eltsize, void *elt, bool max) {
+    mmq_assert_(eltsize == q->eltsize);
+    multiqueue_shard_ *s = multiqueue_lock_(q);
+    multiqueue_shard_ *s1 = q->shards + multiqueue_rand_(q->shardc);
+    if (s1 != s && pthread_mutex_trylock(&s1->lock) == 0) {
+        if (multiqueue_before_(s1->m, s->m, max)) {
+            multiqueue_shard_ *t = s;
+            s = s1;
+            s1 = t;
+        }
+        pthread_mutex_unlock(&s1->lock);
+    }
+
+    if (s->m->len == 0) {
+        size_t start = multiqueue_rand_(q->shardc);
+        for (size_t i = 0; s->m->len == 0 && i < q->shardc; i++) {
+            pthread_mutex_unlock(&s->lock);
+            s = q->shards + ((start + i) % q->shardc);
+            pthread_mutex_lock(&s->lock);
+        }
+    }
+    bool ok = max ?
+        minmax_peekmax(s->m, eltsize, elt, true) :
+        minmax_peekmin(s->m, eltsize, elt, true);
+    pthread_mutex_unlock(&s->lock);
+    return ok;
+}
+#endif
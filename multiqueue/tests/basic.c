@@ -0,0 +1,140 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include "../multiqueue.h"
+
+MINMAX_EXTERN_DECL;
+MULTIQUEUE_EXTERN_DECL;
+
+#define LIM 100000
+#define SHARDC 8
+#define PRODUCERC 4
+#define CONSUMERC 4
+
+typedef struct job {
+    int priority;
+    int id;
+} job;
+
+int
+cmp_int(void *restrict i, void *restrict i1) {
+    int i_ = *(int *)i, i1_ = *(int *)i1;
+    return i_ > i1_ ? 1 : i_ < i1_ ? -1 : 0;
+}
+
+int
+cmp_job(void *restrict j, void *restrict j1) {
+    return cmp_int(&((job *)j)->priority, &((job *)j1)->priority);
+}
+
+/* Every element goes in once and comes out once. */
+_Atomic int taken[PRODUCERC * LIM];
+_Atomic int takenc;
+
+struct producer {
+    multiqueue *q;
+    int first;
+};
+
+void *
+produce(void *arg) {
+    struct producer *p = (struct producer *)arg;
+    for (int i = p->first; i < p->first + LIM; i++) {
+        mmq_insert(p->q, job, ((job){(i * 37) % 1000, i}));
+    }
+    return NULL;
+}
+
+void *
+consume(void *arg) {
+    multiqueue *q = (multiqueue *)arg;
+    job j;
+    for (int i = 0; atomic_load(&takenc) < PRODUCERC * LIM; i++) {
+        if (i % 3 ? mmq_pollmin(q, job, &j) : mmq_pollmax(q, job, &j)) {
+            assert(atomic_fetch_add(&taken[j.id], 1) == 0);
+            atomic_fetch_add(&takenc, 1);
+        }
+    }
+    return NULL;
+}
+
+void
+test_threads(multiqueue *q) {
+    for (int i = 0; i < PRODUCERC * LIM; i++) {
+        atomic_store(&taken[i], 0);
+    }
+    atomic_store(&takenc, 0);
+    pthread_t producers[PRODUCERC], consumers[CONSUMERC];
+    struct producer ps[PRODUCERC];
+    for (int i = 0; i < PRODUCERC; i++) {
+        ps[i] = (struct producer){q, i * LIM};
+        assert(pthread_create(producers + i, NULL, produce, ps + i) == 0);
+    }
+    for (int i = 0; i < CONSUMERC; i++) {
+        assert(pthread_create(consumers + i, NULL, consume, q) == 0);
+    }
+    for (int i = 0; i < PRODUCERC; i++) {
+        assert(pthread_join(producers[i], NULL) == 0);
+    }
+    for (int i = 0; i < CONSUMERC; i++) {
+        assert(pthread_join(consumers[i], NULL) == 0);
+    }
+    job j;
+    assert(!mmq_pollmin(q, job, &j) && !mmq_pollmax(q, job, &j));
+    mmq_drop(q);
+}
+
+int
+main(void) {
+    srand(time(NULL));
+
+    /* A single shard is an ordinary min-max heap. */
+    multiqueue *q = mmq_make(int, 1, cmp_int);
+    int i;
+    assert(!mmq_pollmin(q, int, &i) && !mmq_pollmax(q, int, &i));
+    for (i = 0; i < 1000; i++) {
+        mmq_insert(q, int, rand() % 100);
+    }
+    int min = -1, max = 100;
+    for (int j = 0; j < 1000; j++) {
+        assert(j % 2 ? mmq_pollmin(q, int, &i) : mmq_pollmax(q, int, &i));
+        assert(j % 2 ? i >= min : i <= max);
+        *(j % 2 ? &min : &max) = i;
+    }
+    assert(!mmq_pollmin(q, int, &i));
+    q = mmq_drop(q);
+
+    /* With more shards, polls come close to either end and none of the
+     * elements are lost, even the last few that are spread thin. */
+    q = mmq_make_keyed(int, SHARDC, 0, int);
+    for (i = 0; i < LIM; i++) {
+        mmq_insert(q, int, i);
+    }
+    long err = 0;
+    for (int j = 0; j < LIM; j++) {
+        assert(mmq_pollmin(q, int, &i));
+        err += i - j > 0 ? i - j : j - i;
+    }
+    assert(err / LIM < 4 * SHARDC);
+    assert(!mmq_pollmax(q, int, &i));
+    for (i = 0; i < SHARDC; i++) {
+        mmq_insert(q, int, i);
+    }
+    int seen = 0;
+    while (mmq_pollmax(q, int, &i)) {
+        seen |= 1 << i;
+    }
+    assert(seen == (1 << SHARDC) - 1);
+    q = mmq_drop(q);
+
+    /* Producers and consumers at once, at both ends. */
+    test_threads(mmq_make(job, SHARDC, cmp_job));
+    test_threads(mmq_make_keyed(job, SHARDC, offsetof(job, priority), int));
+    test_threads(mmq_make(job, 1, cmp_job));
+
+    printf("All tests passed\n");
+    return 0;
+}
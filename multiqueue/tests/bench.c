@@ -0,0 +1,97 @@
+/* Compares a single heap behind one mutex against a multiqueue with a few
+ * shards per thread, with every thread inserting jobs and taking them from
+ * either end, the way a scheduler that also evicts stale jobs would. */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include "../multiqueue.h"
+
+MINMAX_EXTERN_DECL;
+MULTIQUEUE_EXTERN_DECL;
+
+#define THREADC 8
+#define SHARDS_PER_THREAD 4
+#define PREFILL 65536
+#define OPS 1000000
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+uint64_t
+next(uint64_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    return *seed ^= *seed << 17;
+}
+
+void *
+work_locked(void *arg) {
+    minmax *m = (minmax *)arg;
+    uint64_t seed = (uint64_t)(uintptr_t)&seed | 1, u;
+    for (int i = 0; i < OPS; i++) {
+        pthread_mutex_lock(&lock);
+        switch (i % 4) {
+        case 0: assert(mm_pollmin(m, uint64_t, &u)); break;
+        case 2: assert(mm_pollmax(m, uint64_t, &u)); break;
+        default: mm_insert(m, uint64_t, next(&seed));
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+void *
+work_sharded(void *arg) {
+    multiqueue *q = (multiqueue *)arg;
+    uint64_t seed = (uint64_t)(uintptr_t)&seed | 1, u;
+    for (int i = 0; i < OPS; i++) {
+        switch (i % 4) {
+        case 0: assert(mmq_pollmin(q, uint64_t, &u)); break;
+        case 2: assert(mmq_pollmax(q, uint64_t, &u)); break;
+        default: mmq_insert(q, uint64_t, next(&seed));
+        }
+    }
+    return NULL;
+}
+
+double
+bench(void *(*work)(void *), void *arg, int threadc) {
+    pthread_t threads[THREADC];
+    double start = now();
+    for (int i = 0; i < threadc; i++) {
+        assert(pthread_create(threads + i, NULL, work, arg) == 0);
+    }
+    for (int i = 0; i < threadc; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    return now() - start;
+}
+
+int
+main(void) {
+    uint64_t seed = 88172645463325252ull;
+    for (int threadc = 1; threadc <= THREADC; threadc *= 2) {
+        minmax *m = mm_make_keyed(uint64_t, PREFILL, 0, uint64_t);
+        multiqueue *q = mmq_make_keyed(
+            uint64_t, SHARDS_PER_THREAD * threadc, 0, uint64_t);
+        for (int i = 0; i < PREFILL; i++) {
+            uint64_t u = next(&seed);
+            mm_insert(m, uint64_t, u);
+            mmq_insert(q, uint64_t, u);
+        }
+        double locked = bench(work_locked, m, threadc);
+        double sharded = bench(work_sharded, q, threadc);
+        printf("%d threads: one lock %.3fs, multiqueue %.3fs (%.1fx)\n",
+            threadc, locked, sharded, locked / sharded);
+        mm_drop(m);
+        mmq_drop(q);
+    }
+    return 0;
+}
@@ -0,0 +1,745 @@
+/* pipeline.h v0.0.0
+ * Copyright 2018 iriri. All rights reserved. Use of this source code is
+ * governed by a BSD-style license which can be found in the LICENSE file. */
+#ifndef PIPELINE_H
+#define PIPELINE_H
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../channel/channel.h"
+
+/* ------------------------------- Interface ------------------------------- */
+#define PIPELINE_H_VERSION 0l // 0.0.0
+
+typedef struct pipeline pipeline;
+typedef struct pipeline_ordered pipeline_ordered;
+typedef void (*pipeline_map_fn)(void *in, void *out, void *ctx);
+typedef bool (*pipeline_filter_fn)(void *msg, void *ctx);
+
+typedef struct pipeline_stats {
+    uint64_t in, out;
+    uint64_t nsec; // Sampled so only an estimate
+    size_t segment, workers;
+} pipeline_stats;
+
+/* The type of the messages emitted by `pl_batch`. */
+#define pl_batch_t(T, n) struct { size_t len; T msgs[n]; }
+
+/* Exported "functions" */
+#define pl_make(in, T) pipeline_make(in, sizeof(T))
+#define pl_drop(p) pipeline_drop(p)
+
+#define pl_map(p, fn, U, ctx) pipeline_map(p, fn, sizeof(U), ctx)
+#define pl_filter(p, fn, ctx) pipeline_filter(p, fn, ctx)
+#define pl_batch(p, T, n) pipeline_batch(p, sizeof(T), alignof(T), n)
+#define pl_omap(p, fn, U, ctx, workerc, window) \
+    pipeline_omap(p, fn, sizeof(U), ctx, workerc, window)
+
+#define pl_fanout(p, n) pipeline_fanout(p, n, false)
+#define pl_autofan(p, max) pipeline_fanout(p, max, true)
+#define pl_fanin(p) pipeline_fanin(p)
+#define pl_hop(p) pipeline_hop(p)
+
+#define pl_run(p, cap) pipeline_run(p, cap)
+#define pl_stats(p, stage, stats) pipeline_getstats(p, stage, stats)
+
+#define pl_ordered(in, out, fn, ctx, workerc, window) \
+    pipeline_ordered_make(in, out, fn, ctx, workerc, window)
+#define pl_ordered_drop(o) pipeline_ordered_drop(o)
+
+/* These declarations must be present in exactly one compilation unit. Note
+ * that `CHANNEL_EXTERN_DECL` must also be present. */
+#define PIPELINE_EXTERN_DECL \
+    extern inline void pipeline_assert_( \
+        const char *, unsigned, const char *) __attribute__((noreturn)); \
+    extern inline uint64_t pipeline_now_(void); \
+    extern inline pipeline *pipeline_make(channel *, size_t); \
+    extern inline pipeline_stage_ *pipeline_add_( \
+        pipeline *, pipeline_kind_, size_t); \
+    extern inline size_t pipeline_map( \
+        pipeline *, pipeline_map_fn, size_t, void *); \
+    extern inline size_t pipeline_filter( \
+        pipeline *, pipeline_filter_fn, void *); \
+    extern inline size_t pipeline_batch(pipeline *, size_t, size_t, size_t); \
+    extern inline size_t pipeline_omap( \
+        pipeline *, pipeline_map_fn, size_t, void *, size_t, size_t); \
+    extern inline void pipeline_fanout(pipeline *, size_t, bool); \
+    extern inline void pipeline_fanin(pipeline *); \
+    extern inline void pipeline_hop(pipeline *); \
+    extern inline bool pipeline_call_( \
+        pipeline_stage_ *, pipeline_counts_ *, void *, void *); \
+    extern inline void pipeline_push_(pipeline_worker_ *, size_t, void *); \
+    extern inline void pipeline_emit_(pipeline_worker_ *, size_t, size_t); \
+    extern inline void pipeline_spawn_(pipeline_worker_ *); \
+    extern inline void pipeline_grow_(pipeline_seg_ *); \
+    extern inline void pipeline_fused_(pipeline_worker_ *); \
+    extern inline void pipeline_ordered_(pipeline_worker_ *); \
+    extern inline void *pipeline_thread_(void *); \
+    extern inline void pipeline_ordered_init_(pipeline_ordered *, \
+        channel *, channel *, pipeline_map_fn, void *, size_t, size_t); \
+    extern inline void pipeline_ordered_destroy_(pipeline_ordered *); \
+    extern inline pipeline_ordered *pipeline_ordered_make(channel *, \
+        channel *, pipeline_map_fn, void *, size_t, size_t); \
+    extern inline pipeline_ordered *pipeline_ordered_drop( \
+        pipeline_ordered *); \
+    extern inline void pipeline_seg_init_( \
+        pipeline *, pipeline_seg_ *, size_t); \
+    extern inline channel *pipeline_run(pipeline *, size_t); \
+    extern inline void pipeline_getstats( \
+        pipeline *, size_t, pipeline_stats *); \
+    extern inline pipeline *pipeline_drop(pipeline *)
+
+/* ---------------------------- Implementation ---------------------------- */
+typedef enum pipeline_kind_ {
+    PIPELINE_MAP_,
+    PIPELINE_FILTER_,
+    PIPELINE_BATCH_,
+    PIPELINE_OMAP_,
+} pipeline_kind_;
+
+typedef enum pipeline_role_ {
+    PIPELINE_FUSED_,
+    PIPELINE_ORDERED_,
+} pipeline_role_;
+
+/* `n` is the batch length of a batch and the worker count of an ordered map.
+ * Stages that share a region and have no hop between them are fused. */
+typedef struct pipeline_stage_ {
+    pipeline_kind_ kind;
+    pipeline_map_fn map;
+    pipeline_filter_fn filter;
+    void *ctx;
+    size_t insize, outsize;
+    size_t n, off, window;
+    size_t region, maxc, seg, bufoff;
+    bool elastic, hop;
+} pipeline_stage_;
+
+/* Only ever written by the owning worker. */
+typedef struct pipeline_counts_ {
+    _Atomic uint64_t in, out, nsec;
+    uint32_t tick;
+} pipeline_counts_;
+
+typedef struct pipeline_seg_ pipeline_seg_;
+
+/* Workers of ordered maps started by `pl_ordered` have no pipeline. */
+typedef struct pipeline_worker_ {
+    pipeline *p;
+    pipeline_seg_ *seg;
+    pipeline_ordered *ord;
+    pipeline_role_ role;
+    uint32_t backlog;
+    char *buf;
+    pipeline_counts_ *counts;
+} pipeline_worker_;
+
+/* The workers of an ordered map segment belong to `ord`. */
+struct pipeline_seg_ {
+    size_t first, last, maxc;
+    _Atomic size_t workerc;
+    bool elastic;
+    channel *in, *out;
+    pipeline_ordered *ord;
+    pipeline_worker_ *workers;
+};
+
+/* Messages are numbered as they are received under `recvlock` and results are
+ * sent on in that order from a ring of `window` slots. A result that would
+ * overwrite a slot that hasn't been sent on yet waits for it. Whichever worker
+ * fills the slot at `next` sends on every ready slot from there unless another
+ * worker is already doing so. */
+struct pipeline_ordered {
+    pipeline_stage_ stage;
+    channel *in, *out;
+    pthread_mutex_t recvlock;
+    uint64_t seq;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t next;
+    size_t waitc;
+    bool emitting;
+    char *slots;
+    bool *ready;
+    pthread_t *threads; // Only used by `pl_ordered`
+    pipeline_worker_ *workers;
+};
+
+struct pipeline {
+    channel *in;
+    size_t msgsize;
+    pipeline_stage_ *stages;
+    size_t stagec, stagecap;
+    size_t region, maxc;
+    bool elastic, fanned, hop, running;
+    pipeline_seg_ *segs;
+    size_t segc;
+    pthread_mutex_t lock; // Only used to wait for workers to exit
+    pthread_cond_t cond;
+    size_t livec;
+};
+
+#define PIPELINE_SAMPLE_ 32 // Every nth call to a stage's function is timed
+#define PIPELINE_BACKLOG_ 32 // Ready messages in a row before adding a worker
+
+#define pl_load_rlx_(obj) atomic_load_explicit(obj, memory_order_relaxed)
+#define pl_add_rlx_(obj, arg) \
+    atomic_store_explicit(obj, pl_load_rlx_(obj) + (arg), memory_order_relaxed)
+#define pl_round_(size) \
+    (((size) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+
+/* `pl_assert_` never becomes a noop, even when `NDEBUG` is set. */
+#define pl_assert_(pred) \
+    (__builtin_expect(!(pred), 0) ? \
+        pipeline_assert_(__FILE__, __LINE__, #pred) : (void)0)
+
+/* Batches recurse back into `pipeline_push_` and elastic segments start
+ * workers from within workers. */
+inline void pipeline_emit_(pipeline_worker_ *, size_t, size_t);
+inline void *pipeline_thread_(void *);
+
+__attribute__((noreturn)) inline void
+pipeline_assert_(const char *file, unsigned line, const char *pred) {
+    fprintf(stderr, "Failed assertion: %s, %u, %s\n", file, line, pred);
+    abort();
+}
+
+inline uint64_t
+pipeline_now_(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+inline pipeline *
+pipeline_make(channel *in, size_t msgsize) {
+    pl_assert_(msgsize == in->hdr.msgsize);
+    pipeline *p;
+    pl_assert_((p = calloc(1, sizeof(*p))));
+    p->in = channel_dup(in);
+    p->msgsize = msgsize;
+    p->maxc = 1;
+    pl_assert_(pthread_mutex_init(&p->lock, NULL) == 0);
+    pl_assert_(pthread_cond_init(&p->cond, NULL) == 0);
+    return p;
+}
+
+inline pipeline_stage_ *
+pipeline_add_(pipeline *p, pipeline_kind_ kind, size_t outsize) {
+    pl_assert_(!p->running && outsize > 0);
+    if (p->stagec == p->stagecap) {
+        p->stagecap = p->stagecap > 0 ? p->stagecap * 2 : 4;
+        pl_assert_((p->stages = realloc(
+            p->stages, p->stagecap * sizeof(*p->stages))));
+    }
+    pipeline_stage_ *s = p->stages + p->stagec++;
+    *s = (pipeline_stage_){
+        .kind = kind,
+        .insize = p->msgsize,
+        .outsize = outsize,
+        .region = p->region,
+        .maxc = p->maxc,
+        .elastic = p->elastic,
+        .hop = p->hop,
+    };
+    p->msgsize = outsize;
+    p->hop = false;
+    return s;
+}
+
+inline size_t
+pipeline_map(pipeline *p, pipeline_map_fn fn, size_t outsize, void *ctx) {
+    pipeline_stage_ *s = pipeline_add_(p, PIPELINE_MAP_, outsize);
+    s->map = fn;
+    s->ctx = ctx;
+    return (size_t)(s - p->stages);
+}
+
+inline size_t
+pipeline_filter(pipeline *p, pipeline_filter_fn fn, void *ctx) {
+    pipeline_stage_ *s = pipeline_add_(p, PIPELINE_FILTER_, p->msgsize);
+    s->filter = fn;
+    s->ctx = ctx;
+    return (size_t)(s - p->stages);
+}
+
+/* Lays the batch out the same way that the compiler lays out `pl_batch_t`. */
+inline size_t
+pipeline_batch(pipeline *p, size_t eltsize, size_t align, size_t n) {
+    pl_assert_(eltsize == p->msgsize && n > 0);
+    size_t off = (sizeof(size_t) + align - 1) / align * align;
+    pl_assert_(n <= (SIZE_MAX - off) / eltsize);
+    size_t structalign = align > alignof(size_t) ? align : alignof(size_t);
+    size_t size = (off + n * eltsize + structalign - 1) /
+        structalign * structalign;
+    pipeline_stage_ *s = pipeline_add_(p, PIPELINE_BATCH_, size);
+    s->n = n;
+    s->off = off;
+    return (size_t)(s - p->stages);
+}
+
+inline size_t
+pipeline_omap(
+    pipeline *p,
+    pipeline_map_fn fn,
+    size_t outsize,
+    void *ctx,
+    size_t workerc,
+    size_t window
+) {
+    pl_assert_(!p->fanned && workerc > 0 && window > 0);
+    pipeline_stage_ *s = pipeline_add_(p, PIPELINE_OMAP_, outsize);
+    s->map = fn;
+    s->ctx = ctx;
+    s->n = workerc;
+    s->window = window;
+    return (size_t)(s - p->stages);
+}
+
+inline void
+pipeline_fanout(pipeline *p, size_t n, bool elastic) {
+    pl_assert_(!p->running && !p->fanned);
+    if (elastic && n == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? (size_t)cpus : 1;
+    }
+    pl_assert_(n > 0);
+    p->fanned = true;
+    p->region++;
+    p->maxc = n;
+    p->elastic = elastic;
+}
+
+inline void
+pipeline_fanin(pipeline *p) {
+    pl_assert_(!p->running && p->fanned);
+    p->fanned = false;
+    p->region++;
+    p->maxc = 1;
+    p->elastic = false;
+}
+
+inline void
+pipeline_hop(pipeline *p) {
+    pl_assert_(!p->running);
+    p->hop = true;
+}
+
+/* Returns whether the message should continue down the pipeline. */
+inline bool
+pipeline_call_(pipeline_stage_ *s, pipeline_counts_ *k, void *in, void *out) {
+    uint64_t start = 0;
+    bool timed = k->tick++ % PIPELINE_SAMPLE_ == 0, ret = true;
+    if (timed) {
+        start = pipeline_now_();
+    }
+    if (s->kind == PIPELINE_FILTER_) {
+        ret = s->filter(in, s->ctx);
+    } else {
+        s->map(in, out, s->ctx);
+    }
+    if (timed) {
+        pl_add_rlx_(&k->nsec, (pipeline_now_() - start) * PIPELINE_SAMPLE_);
+    }
+    return ret;
+}
+
+/* Runs the message through the fused stages starting at `i` and then sends it
+ * on. Sends can't fail as only the segment's workers close its output. */
+inline void
+pipeline_push_(pipeline_worker_ *w, size_t i, void *msg) {
+    pipeline_seg_ *seg = w->seg;
+    pipeline_stage_ *s = w->p->stages + i;
+    for ( ; i < seg->last; i++, s++) {
+        pipeline_counts_ *k = w->counts + (i - seg->first);
+        char *buf = w->buf + s->bufoff;
+        pl_add_rlx_(&k->in, 1);
+        if (s->kind == PIPELINE_BATCH_) {
+            size_t len;
+            memcpy(&len, buf, sizeof(len));
+            memcpy(buf + s->off + len++ * s->insize, msg, s->insize);
+            if (len < s->n) {
+                memcpy(buf, &len, sizeof(len));
+            } else {
+                pipeline_emit_(w, i, len);
+            }
+            return;
+        }
+        if (!pipeline_call_(s, k, msg, buf)) {
+            return;
+        }
+        pl_add_rlx_(&k->out, 1);
+        if (s->kind == PIPELINE_MAP_) {
+            msg = buf;
+        }
+    }
+    pl_assert_(channel_send(seg->out, msg, s[-1].outsize) == CH_OK);
+}
+
+/* Sends a full, or when flushing a partial, batch on and starts a new one. */
+inline void
+pipeline_emit_(pipeline_worker_ *w, size_t i, size_t len) {
+    pipeline_stage_ *s = w->p->stages + i;
+    char *buf = w->buf + s->bufoff;
+    memcpy(buf, &len, sizeof(len));
+    pl_add_rlx_(&w->counts[i - w->seg->first].out, 1);
+    pipeline_push_(w, i + 1, buf);
+    len = 0;
+    memcpy(buf, &len, sizeof(len));
+}
+
+/* Workers are detached and counted instead of joined as elastic segments
+ * start new workers from within the pipeline. */
+inline void
+pipeline_spawn_(pipeline_worker_ *w) {
+    pthread_mutex_lock(&w->p->lock);
+    w->p->livec++;
+    pthread_mutex_unlock(&w->p->lock);
+    pthread_t thread;
+    pl_assert_(pthread_create(&thread, NULL, pipeline_thread_, w) == 0);
+    pl_assert_(pthread_detach(thread) == 0);
+}
+
+/* The caller is a worker of the segment and so still has the output channel
+ * open. */
+inline void
+pipeline_grow_(pipeline_seg_ *seg) {
+    size_t n = pl_load_rlx_(&seg->workerc);
+    if (n < seg->maxc &&
+        atomic_compare_exchange_strong(&seg->workerc, &n, n + 1)) {
+        channel_open(seg->out);
+        pipeline_spawn_(seg->workers + n);
+    }
+}
+
+/* Elastic segments only block when their input runs dry. Finding messages
+ * ready every time means that the segment is a bottleneck. */
+inline void
+pipeline_fused_(pipeline_worker_ *w) {
+    pipeline_seg_ *seg = w->seg;
+    size_t insize = w->p->stages[seg->first].insize;
+    for ( ; ; ) {
+        channel_rc rc = CH_WBLOCK;
+        if (seg->elastic) {
+            rc = channel_tryrecv(seg->in, w->buf, insize);
+            if (rc != CH_OK) {
+                w->backlog = 0;
+            } else if (++w->backlog == PIPELINE_BACKLOG_) {
+                w->backlog = 0;
+                pipeline_grow_(seg);
+            }
+        }
+        if (rc == CH_WBLOCK) {
+            rc = channel_recv(seg->in, w->buf, insize);
+        }
+        if (rc != CH_OK) {
+            break;
+        }
+        pipeline_push_(w, seg->first, w->buf);
+    }
+    for (size_t i = seg->first; i < seg->last; i++) {
+        pipeline_stage_ *s = w->p->stages + i;
+        size_t len;
+        if (s->kind == PIPELINE_BATCH_) {
+            memcpy(&len, w->buf + s->bufoff, sizeof(len));
+            if (len > 0) {
+                pipeline_emit_(w, i, len);
+            }
+        }
+    }
+    channel_close(seg->out);
+}
+
+inline void
+pipeline_ordered_(pipeline_worker_ *w) {
+    pipeline_ordered *o = w->ord;
+    pipeline_stage_ *s = &o->stage;
+    char *in = w->buf, *out = w->buf + pl_round_(s->insize);
+    for ( ; ; ) {
+        pthread_mutex_lock(&o->recvlock);
+        channel_rc rc = channel_recv(o->in, in, s->insize);
+        uint64_t seq = o->seq++;
+        pthread_mutex_unlock(&o->recvlock);
+        if (rc != CH_OK) {
+            break;
+        }
+        pl_add_rlx_(&w->counts->in, 1);
+        pipeline_call_(s, w->counts, in, out);
+
+        pthread_mutex_lock(&o->lock);
+        while (seq - o->next >= s->window) {
+            o->waitc++;
+            pthread_cond_wait(&o->cond, &o->lock);
+            o->waitc--;
+        }
+        size_t i = seq % s->window;
+        memcpy(o->slots + i * s->outsize, out, s->outsize);
+        o->ready[i] = true;
+        if (!o->emitting) {
+            o->emitting = true;
+            while (o->ready[i = o->next % s->window]) {
+                pthread_mutex_unlock(&o->lock);
+                pl_assert_(channel_send(o->out, o->slots + i * s->outsize,
+                    s->outsize) == CH_OK);
+                pl_add_rlx_(&w->counts->out, 1);
+                pthread_mutex_lock(&o->lock);
+                o->ready[i] = false;
+                o->next++;
+                if (o->waitc > 0) {
+                    pthread_cond_broadcast(&o->cond);
+                }
+            }
+            o->emitting = false;
+        }
+        pthread_mutex_unlock(&o->lock);
+    }
+    channel_close(o->out);
+}
+
+/* Nothing may touch the pipeline after the last worker signals. */
+inline void *
+pipeline_thread_(void *arg) {
+    pipeline_worker_ *w = (pipeline_worker_ *)arg;
+    pipeline *p = w->p;
+    if (w->role == PIPELINE_ORDERED_) {
+        pipeline_ordered_(w);
+    } else {
+        pipeline_fused_(w);
+    }
+    if (!p) {
+        return NULL;
+    }
+    pthread_mutex_lock(&p->lock);
+    if (--p->livec == 0) {
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* Every worker closes the output channel once so it is opened again for all
+ * but the first. */
+inline void
+pipeline_ordered_init_(
+    pipeline_ordered *o,
+    channel *in,
+    channel *out,
+    pipeline_map_fn fn,
+    void *ctx,
+    size_t workerc,
+    size_t window
+) {
+    pl_assert_(workerc > 0 && window > 0);
+    size_t outsize = out->hdr.msgsize;
+    o->stage = (pipeline_stage_){
+        .kind = PIPELINE_OMAP_,
+        .map = fn,
+        .ctx = ctx,
+        .insize = in->hdr.msgsize,
+        .outsize = outsize,
+        .n = workerc,
+        .window = window,
+    };
+    o->in = channel_dup(in);
+    o->out = channel_dup(out);
+    for (size_t i = 1; i < workerc; i++) {
+        channel_open(out);
+    }
+    pl_assert_(pthread_mutex_init(&o->recvlock, NULL) == 0);
+    pl_assert_(pthread_mutex_init(&o->lock, NULL) == 0);
+    pl_assert_(pthread_cond_init(&o->cond, NULL) == 0);
+    pl_assert_((o->slots = calloc(window, outsize)));
+    pl_assert_((o->ready = calloc(window, sizeof(*o->ready))));
+    pl_assert_((o->workers = calloc(workerc, sizeof(*o->workers))));
+    for (size_t i = 0; i < workerc; i++) {
+        pipeline_worker_ *w = o->workers + i;
+        w->ord = o;
+        w->role = PIPELINE_ORDERED_;
+        pl_assert_((w->buf = calloc(1, pl_round_(o->stage.insize) + outsize)));
+        pl_assert_((w->counts = calloc(1, sizeof(*w->counts))));
+    }
+}
+
+inline void
+pipeline_ordered_destroy_(pipeline_ordered *o) {
+    for (size_t i = 0; i < o->stage.n; i++) {
+        free(o->workers[i].buf);
+        free(o->workers[i].counts);
+    }
+    free(o->workers);
+    free(o->threads);
+    free(o->slots);
+    free(o->ready);
+    pthread_mutex_destroy(&o->recvlock);
+    pthread_mutex_destroy(&o->lock);
+    pthread_cond_destroy(&o->cond);
+    channel_drop(o->in);
+    channel_drop(o->out);
+}
+
+inline pipeline_ordered *
+pipeline_ordered_make(
+    channel *in,
+    channel *out,
+    pipeline_map_fn fn,
+    void *ctx,
+    size_t workerc,
+    size_t window
+) {
+    pipeline_ordered *o;
+    pl_assert_((o = calloc(1, sizeof(*o))));
+    pipeline_ordered_init_(o, in, out, fn, ctx, workerc, window);
+    pl_assert_((o->threads = malloc(workerc * sizeof(*o->threads))));
+    for (size_t i = 0; i < workerc; i++) {
+        pl_assert_(pthread_create(
+            o->threads + i, NULL, pipeline_thread_, o->workers + i) == 0);
+    }
+    return o;
+}
+
+inline pipeline_ordered *
+pipeline_ordered_drop(pipeline_ordered *o) {
+    for (size_t i = 0; i < o->stage.n; i++) {
+        pl_assert_(pthread_join(o->threads[i], NULL) == 0);
+    }
+    pipeline_ordered_destroy_(o);
+    free(o);
+    return NULL;
+}
+
+/* Every channel is created with one open writer so the extra writers open it
+ * again. */
+inline void
+pipeline_seg_init_(pipeline *p, pipeline_seg_ *seg, size_t cap) {
+    pipeline_stage_ *first = p->stages + seg->first;
+    size_t bufsize = pl_round_(first->insize), stagec = seg->last - seg->first;
+    seg->out = channel_make(p->stages[seg->last - 1].outsize, cap);
+    if (first->kind == PIPELINE_OMAP_) {
+        pl_assert_((seg->ord = calloc(1, sizeof(*seg->ord))));
+        pipeline_ordered_init_(seg->ord, seg->in, seg->out,
+            first->map, first->ctx, first->n, first->window);
+        seg->maxc = first->n;
+        atomic_init(&seg->workerc, seg->maxc);
+        seg->workers = seg->ord->workers;
+        for (size_t i = 0; i < seg->maxc; i++) {
+            seg->workers[i].p = p;
+            seg->workers[i].seg = seg;
+        }
+        return;
+    }
+    for (pipeline_stage_ *s = first; s < first + stagec; s++) {
+        s->bufoff = bufsize;
+        if (s->kind != PIPELINE_FILTER_) {
+            bufsize += pl_round_(s->outsize);
+        }
+    }
+    seg->maxc = first->maxc;
+    seg->elastic = first->elastic;
+    atomic_init(&seg->workerc, seg->elastic ? 1 : seg->maxc);
+    for (size_t i = 1; i < pl_load_rlx_(&seg->workerc); i++) {
+        channel_open(seg->out);
+    }
+    pl_assert_((seg->workers = calloc(seg->maxc, sizeof(*seg->workers))));
+    for (size_t i = 0; i < seg->maxc; i++) {
+        pipeline_worker_ *w = seg->workers + i;
+        w->p = p;
+        w->seg = seg;
+        w->role = PIPELINE_FUSED_;
+        pl_assert_((w->buf = calloc(1, bufsize)));
+        pl_assert_((w->counts = calloc(stagec, sizeof(*w->counts))));
+    }
+}
+
+/* Adjacent stages are fused into segments that run on the same workers and
+ * only segments are connected by channels. */
+inline channel *
+pipeline_run(pipeline *p, size_t cap) {
+    pl_assert_(!p->running && p->stagec > 0);
+    p->running = true;
+    for (size_t i = 0; i < p->stagec; i++) {
+        pipeline_stage_ *s = p->stages + i;
+        if (i == 0 || s->hop || s->region != s[-1].region ||
+            s->kind == PIPELINE_OMAP_ || s[-1].kind == PIPELINE_OMAP_) {
+            p->segc++;
+        }
+        s->seg = p->segc - 1;
+    }
+    pl_assert_((p->segs = calloc(p->segc, sizeof(*p->segs))));
+    channel *in = p->in;
+    for (size_t i = 0, j = 0; j < p->segc; j++) {
+        pipeline_seg_ *seg = p->segs + j;
+        seg->first = i;
+        for ( ; i < p->stagec && p->stages[i].seg == j; i++);
+        seg->last = i;
+        seg->in = channel_dup(in);
+        pipeline_seg_init_(p, seg, cap);
+        in = seg->out;
+    }
+    for (size_t j = 0; j < p->segc; j++) {
+        pipeline_seg_ *seg = p->segs + j;
+        for (size_t i = 0; i < pl_load_rlx_(&seg->workerc); i++) {
+            pipeline_spawn_(seg->workers + i);
+        }
+    }
+    return channel_dup(in);
+}
+
+inline void
+pipeline_getstats(pipeline *p, size_t stage, pipeline_stats *stats) {
+    pl_assert_(stage < p->stagec);
+    *stats = (pipeline_stats){0};
+    if (!p->running) {
+        return;
+    }
+    pipeline_stage_ *s = p->stages + stage;
+    pipeline_seg_ *seg = p->segs + s->seg;
+    stats->segment = s->seg;
+    stats->workers = s->kind == PIPELINE_OMAP_ ?
+        s->n : pl_load_rlx_(&seg->workerc);
+    for (size_t i = 0; i < seg->maxc; i++) {
+        pipeline_counts_ *k = seg->workers[i].counts + (stage - seg->first);
+        stats->in += pl_load_rlx_(&k->in);
+        stats->out += pl_load_rlx_(&k->out);
+        stats->nsec += pl_load_rlx_(&k->nsec);
+    }
+}
+
+inline pipeline *
+pipeline_drop(pipeline *p) {
+    pthread_mutex_lock(&p->lock);
+    while (p->livec > 0) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    for (size_t j = 0; j < p->segc; j++) {
+        pipeline_seg_ *seg = p->segs + j;
+        if (seg->ord) {
+            pipeline_ordered_destroy_(seg->ord);
+            free(seg->ord);
+        } else {
+            for (size_t i = 0; i < seg->maxc; i++) {
+                free(seg->workers[i].buf);
+                free(seg->workers[i].counts);
+            }
+            free(seg->workers);
+        }
+        channel_drop(seg->in);
+        channel_drop(seg->out);
+    }
+    free(p->segs);
+    free(p->stages);
+    channel_drop(p->in);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    free(p);
+    return NULL;
+}
+#endif
@@ -0,0 +1,229 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../pipeline.h"
+
+CHANNEL_EXTERN_DECL;
+PIPELINE_EXTERN_DECL;
+
+#define LIM 10000
+#define BATCH 16
+
+typedef pl_batch_t(int, BATCH) batch;
+
+void *
+generate(void *arg) {
+    channel *chan = (channel *)arg;
+    for (int i = 1; i <= LIM; i++) {
+        assert(ch_send(chan, &i) == CH_OK);
+    }
+    ch_close(chan);
+    ch_drop(chan);
+    return NULL;
+}
+
+channel *
+source(pthread_t *thread, size_t cap) {
+    channel *chan = ch_make(int, cap);
+    assert(pthread_create(thread, NULL, generate, ch_dup(chan)) == 0);
+    return chan;
+}
+
+void
+square(void *in, void *out, void *ctx) {
+    (void)ctx;
+    *(long *)out = (long)*(int *)in * *(int *)in;
+}
+
+bool
+even(void *msg, void *ctx) {
+    (void)ctx;
+    return *(long *)msg % 2 == 0;
+}
+
+void
+increment(void *in, void *out, void *ctx) {
+    (void)ctx;
+    *(long *)out = *(long *)in + 1;
+}
+
+void
+jitter(void *in, void *out, void *ctx) {
+    (void)ctx;
+    if (rand() % 64 == 0) {
+        usleep(100);
+    }
+    *(long *)out = *(int *)in;
+}
+
+void
+slow(void *in, void *out, void *ctx) {
+    (void)ctx;
+    usleep(20);
+    *(long *)out = *(int *)in;
+}
+
+/* Adjacent stages fuse into one segment and keep their order. */
+void
+test_fused(void) {
+    pthread_t thread;
+    channel *in = source(&thread, 0);
+    pipeline *p = pl_make(in, int);
+    size_t sq = pl_map(p, square, long, NULL);
+    size_t ev = pl_filter(p, even, NULL);
+    size_t inc = pl_map(p, increment, long, NULL);
+    channel *out = pl_run(p, 8);
+
+    long l, n = 0;
+    for (long i = 2; ch_recv(out, &l) == CH_OK; i += 2) {
+        assert(l == i * i + 1);
+        n++;
+    }
+    assert(n == LIM / 2);
+    assert(pthread_join(thread, NULL) == 0);
+
+    pipeline_stats stats;
+    pl_stats(p, sq, &stats);
+    assert(stats.in == LIM && stats.out == LIM);
+    assert(stats.segment == 0 && stats.workers == 1);
+    pl_stats(p, ev, &stats);
+    assert(stats.in == LIM && stats.out == LIM / 2);
+    assert(stats.segment == 0);
+    pl_stats(p, inc, &stats);
+    assert(stats.in == LIM / 2 && stats.out == LIM / 2);
+    assert(stats.segment == 0);
+    ch_drop(out);
+    pl_drop(p);
+    ch_drop(in);
+}
+
+/* Hops split segments and the partial batch is flushed on close. */
+void
+test_batch(void) {
+    pthread_t thread;
+    channel *in = source(&thread, 4);
+    pipeline *p = pl_make(in, int);
+    pl_hop(p);
+    size_t b = pl_batch(p, int, BATCH);
+    channel *out = pl_run(p, 0);
+
+    batch msg;
+    int next = 1;
+    while (ch_recv(out, &msg) == CH_OK) {
+        assert(msg.len == BATCH || next + (int)msg.len == LIM + 1);
+        for (size_t i = 0; i < msg.len; i++) {
+            assert(msg.msgs[i] == next++);
+        }
+    }
+    assert(next == LIM + 1);
+    assert(pthread_join(thread, NULL) == 0);
+
+    pipeline_stats stats;
+    pl_stats(p, b, &stats);
+    assert(stats.in == LIM && stats.out == (LIM + BATCH - 1) / BATCH);
+    ch_drop(out);
+    pl_drop(p);
+    ch_drop(in);
+}
+
+/* Fanned out stages are fused per replica and fan back in unordered. */
+void
+test_fanout(void) {
+    pthread_t thread;
+    channel *in = source(&thread, 16);
+    pipeline *p = pl_make(in, int);
+    pl_fanout(p, 4);
+    size_t sq = pl_map(p, square, long, NULL);
+    size_t ev = pl_filter(p, even, NULL);
+    pl_fanin(p);
+    size_t inc = pl_map(p, increment, long, NULL);
+    channel *out = pl_run(p, 16);
+
+    long l, sum = 0, n = 0;
+    while (ch_recv(out, &l) == CH_OK) {
+        sum += l;
+        n++;
+    }
+    long expected = 0;
+    for (long i = 2; i <= LIM; i += 2) {
+        expected += i * i + 1;
+    }
+    assert(n == LIM / 2 && sum == expected);
+    assert(pthread_join(thread, NULL) == 0);
+
+    pipeline_stats stats;
+    pl_stats(p, sq, &stats);
+    assert(stats.in == LIM && stats.segment == 0 && stats.workers == 4);
+    pl_stats(p, ev, &stats);
+    assert(stats.out == LIM / 2 && stats.segment == 0);
+    pl_stats(p, inc, &stats);
+    assert(stats.in == LIM / 2 && stats.segment == 1 && stats.workers == 1);
+    ch_drop(out);
+    pl_drop(p);
+    ch_drop(in);
+}
+
+void
+test_omap(void) {
+    pthread_t thread;
+    channel *in = source(&thread, 16);
+    pipeline *p = pl_make(in, int);
+    size_t om = pl_omap(p, jitter, long, NULL, 4, 8);
+    size_t inc = pl_map(p, increment, long, NULL);
+    channel *out = pl_run(p, 4);
+
+    long l, next = 2;
+    while (ch_recv(out, &l) == CH_OK) {
+        assert(l == next++);
+    }
+    assert(next == LIM + 2);
+    assert(pthread_join(thread, NULL) == 0);
+
+    pipeline_stats stats;
+    pl_stats(p, om, &stats);
+    assert(stats.in == LIM && stats.out == LIM && stats.workers == 4);
+    pl_stats(p, inc, &stats);
+    assert(stats.in == LIM && stats.segment == 1);
+    ch_drop(out);
+    pl_drop(p);
+    ch_drop(in);
+}
+
+/* A slow stage always has its input ready so it gets more workers. */
+void
+test_autofan(void) {
+    pthread_t thread;
+    channel *in = source(&thread, 64);
+    pipeline *p = pl_make(in, int);
+    pl_autofan(p, 4);
+    size_t s = pl_map(p, slow, long, NULL);
+    channel *out = pl_run(p, 64);
+
+    long l, sum = 0;
+    while (ch_recv(out, &l) == CH_OK) {
+        sum += l;
+    }
+    assert(sum == (long)LIM * (LIM + 1) / 2);
+    assert(pthread_join(thread, NULL) == 0);
+
+    pipeline_stats stats;
+    pl_stats(p, s, &stats);
+    assert(stats.in == LIM && stats.workers > 1 && stats.workers <= 4);
+    assert(stats.nsec > 0);
+    ch_drop(out);
+    pl_drop(p);
+    ch_drop(in);
+}
+
+int
+main(void) {
+    test_fused();
+    test_batch();
+    test_fanout();
+    test_omap();
+    test_autofan();
+    printf("All tests passed\n");
+    return 0;
+}
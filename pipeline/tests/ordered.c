@@ -0,0 +1,73 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../pipeline.h"
+
+CHANNEL_EXTERN_DECL;
+PIPELINE_EXTERN_DECL;
+
+#define LIM 20000
+#define THREADC 4
+
+typedef struct result {
+    int i;
+    double d;
+} result;
+
+void *
+generate(void *arg) {
+    channel *chan = (channel *)arg;
+    for (int i = 1; i <= LIM; i++) {
+        assert(ch_send(chan, &i) == CH_OK);
+    }
+    ch_close(chan);
+    ch_drop(chan);
+    return NULL;
+}
+
+/* Uneven amounts of work so that results finish out of order. */
+void
+work(void *in, void *out, void *ctx) {
+    (void)ctx;
+    int i = *(int *)in;
+    double d = 0;
+    for (int j = 0; j < (i * 7919) % 512; j++) {
+        d += j * 0.5;
+    }
+    if (i % 997 == 0) {
+        usleep(1000);
+    }
+    *(result *)out = (result){i, d};
+}
+
+void
+test(size_t incap, size_t outcap, size_t workerc, size_t window) {
+    channel *in = ch_make(int, incap), *out = ch_make(result, outcap);
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, generate, ch_dup(in)) == 0);
+    pipeline_ordered *o = pl_ordered(in, out, work, NULL, workerc, window);
+
+    result r;
+    int next = 1;
+    while (ch_recv(out, &r) == CH_OK) {
+        assert(r.i == next++);
+    }
+    assert(next == LIM + 1);
+    assert(pthread_join(thread, NULL) == 0);
+    pl_ordered_drop(o);
+    ch_drop(in);
+    ch_drop(out);
+}
+
+int
+main(void) {
+    test(0, 0, THREADC, 1);
+    test(16, 0, THREADC, 4);
+    test(0, 16, THREADC, 64);
+    test(64, 64, 1, 8);
+    test(64, 64, THREADC * 4, THREADC);
+    printf("All tests passed\n");
+    return 0;
+}